@@ -0,0 +1,1369 @@
+// pngbench: per stage timings with a baseline gate, and a synthetic corpus
+// to run them and "pngdump bench" on, that pngdump itself does not need to
+// carry. Built from pngdump.c (included below without its main) so that it
+// shares the file, thread and output helpers; the stages are timed through
+// stbi_set_stage_hook().
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function" // pngdump commands
+#endif
+
+#define PNGDUMP_NO_MAIN
+#include "pngdump.c"
+
+// directory for generated files, an existing one is fine
+static int directory_create(const char* dir) {
+    int r = 0;
+#ifdef _WIN32
+    if (!CreateDirectoryA(dir, null) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        r = EACCES;
+    }
+#else
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) { r = errno; }
+#endif
+    if (r != 0) {
+        fprintf(errors(), "failed to create \"%s\" %s\n", dir, strerror(r));
+    }
+    return r;
+}
+
+// synthetic corpus for "bench --generate": a small zlib encoder (hash
+// chained LZ77, fixed or dynamic Huffman blocks, whichever is smaller) is
+// enough to write PNGs of every color type, depth, filter mix and
+// compression level without depending on zlib or libpng
+
+typedef struct bytes_s { // growable output, deflate bits go in LSB first
+    byte* data;
+    size_t bytes;
+    size_t capacity;
+    uint64_t acc;
+    int count;   // bits in acc
+    bool failed; // out of memory, later writes are dropped
+} bytes_t;
+
+static void bytes_reserve(bytes_t* b, size_t n) {
+    if (b->bytes + n > b->capacity && !b->failed) {
+        size_t capacity = max(b->capacity * 2, b->bytes + n + 4096);
+        byte* data = (byte*)realloc(b->data, capacity);
+        if (data == null) {
+            b->failed = true;
+        } else {
+            b->data = data;
+            b->capacity = capacity;
+        }
+    }
+}
+
+static void bits_put(bytes_t* b, uint32_t v, int n) { // n <= 32
+    b->acc |= (uint64_t)v << b->count;
+    b->count += n;
+    while (b->count >= 8) {
+        bytes_reserve(b, 1);
+        if (!b->failed) { b->data[b->bytes++] = (byte)b->acc; }
+        b->acc >>= 8;
+        b->count -= 8;
+    }
+}
+
+static void bits_align(bytes_t* b) {
+    if (b->count > 0) { bits_put(b, 0, 8 - b->count); }
+}
+
+static void bytes_append(bytes_t* b, const void* data, size_t n) {
+    bits_align(b);
+    bytes_reserve(b, n);
+    if (!b->failed && n > 0) {
+        memcpy(b->data + b->bytes, data, n);
+        b->bytes += n;
+    }
+}
+
+static int bytes_save(const bytes_t* b, const char* fn) {
+    int r = 0;
+    FILE* f = fopen(fn, "wb");
+    if (f == null) {
+        r = errno;
+    } else {
+        if (fwrite(b->data, 1, b->bytes, f) != b->bytes) { r = errno; }
+        if (fclose(f) != 0 && r == 0) { r = errno; }
+    }
+    return r;
+}
+
+static void bytes_be32(bytes_t* b, uint32_t v) {
+    const byte be[4] = { (byte)(v >> 24), (byte)(v >> 16), (byte)(v >> 8), (byte)v };
+    bytes_append(b, be, sizeof(be));
+}
+
+// Huffman code lengths of at most "limit" bits for n <= 286 symbols; the
+// counts are halved until the tree is shallow enough
+static void huffman_lengths(const uint32_t* counts, int n, int limit,
+        byte* lengths) {
+    uint32_t c[286];
+    int leaves[286];
+    uint64_t weight[2 * 286];
+    int parent[2 * 286];
+    int depth[2 * 286];
+    memcpy(c, counts, n * sizeof(c[0]));
+    for (;;) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            lengths[i] = 0;
+            if (c[i] > 0) { leaves[m++] = i; }
+        }
+        if (m <= 1) {
+            if (m == 1) { lengths[leaves[0]] = 1; }
+            return;
+        }
+        for (int i = 1; i < m; i++) { // leaves by count, n is small
+            const int s = leaves[i];
+            int j = i;
+            while (j > 0 && c[leaves[j - 1]] > c[s]) {
+                leaves[j] = leaves[j - 1];
+                j--;
+            }
+            leaves[j] = s;
+        }
+        for (int i = 0; i < m; i++) { weight[i] = c[leaves[i]]; }
+        // internal nodes are made in order of weight, so the two lightest
+        // are always at the fronts of the leaves and of the nodes
+        int leaf = 0;
+        int node = m;
+        int nodes = m;
+        for (int k = 0; k < m - 1; k++) {
+            int pick[2];
+            for (int t = 0; t < 2; t++) {
+                if (leaf < m && (node >= nodes || weight[leaf] <= weight[node])) {
+                    pick[t] = leaf++;
+                } else {
+                    pick[t] = node++;
+                }
+            }
+            weight[nodes] = weight[pick[0]] + weight[pick[1]];
+            parent[pick[0]] = nodes;
+            parent[pick[1]] = nodes;
+            nodes++;
+        }
+        int deepest = 0;
+        depth[nodes - 1] = 0;
+        for (int i = nodes - 2; i >= 0; i--) { depth[i] = depth[parent[i]] + 1; }
+        for (int i = 0; i < m; i++) {
+            lengths[leaves[i]] = (byte)depth[i];
+            deepest = max(deepest, depth[i]);
+        }
+        if (deepest <= limit) { return; }
+        for (int i = 0; i < n; i++) { c[i] = (c[i] + 1) / 2; }
+    }
+}
+
+// canonical codes, bit reversed because deflate sends them MSB first
+static void huffman_codes(const byte* lengths, int n, uint16_t* codes) {
+    int count[16] = { 0 };
+    int next[16] = { 0 };
+    for (int i = 0; i < n; i++) { count[lengths[i]]++; }
+    count[0] = 0;
+    int code = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (int i = 0; i < n; i++) {
+        codes[i] = 0;
+        if (lengths[i] > 0) {
+            const int v = next[lengths[i]]++;
+            for (int k = 0; k < lengths[i]; k++) {
+                codes[i] |= (uint16_t)(((v >> k) & 1) << (lengths[i] - 1 - k));
+            }
+        }
+    }
+}
+
+static const uint16_t deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const byte deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+    513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const byte deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+    8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static int deflate_length_code(int length) { // 3..258 to 0..28
+    int code = 28;
+    while (deflate_length_base[code] > length) { code--; }
+    return code;
+}
+
+static int deflate_dist_code(int dist) { // 1..32768 to 0..29
+    int code = 29;
+    while (deflate_dist_base[code] > dist) { code--; }
+    return code;
+}
+
+typedef struct token_s {
+    uint16_t length; // 0 for a literal
+    uint16_t value;  // the literal or the match distance
+} token_t;
+
+enum { deflate_block_tokens = 1 << 16 };
+
+// one block of tokens with the codes that make it smaller, fixed or its own
+static void deflate_block(bytes_t* b, const token_t* t, int n, bool last) {
+    static const byte order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    uint32_t counts[286 + 30] = { 0 };
+    uint32_t* dist_counts = counts + 286;
+    for (int i = 0; i < n; i++) {
+        if (t[i].length == 0) {
+            counts[t[i].value]++;
+        } else {
+            counts[257 + deflate_length_code(t[i].length)]++;
+            dist_counts[deflate_dist_code(t[i].value)]++;
+        }
+    }
+    counts[256] = 1; // end of block
+    byte lengths[286 + 30];
+    byte fixed[286 + 30];
+    for (int i = 0; i < 286; i++) {
+        fixed[i] = (byte)(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+    }
+    for (int i = 0; i < 30; i++) { fixed[286 + i] = 5; }
+    huffman_lengths(counts, 286, 15, lengths);
+    huffman_lengths(dist_counts, 30, 15, lengths + 286);
+    int hlit = 286;
+    int hdist = 30;
+    while (hlit > 257 && lengths[hlit - 1] == 0) { hlit--; }
+    while (hdist > 1 && lengths[286 + hdist - 1] == 0) { hdist--; }
+    if (lengths[286] == 0 && hdist == 1) { lengths[286] = 1; } // no matches
+    // code lengths run length coded: 16 repeats the previous 3..6 times,
+    // 17 and 18 are runs of 3..10 and 11..138 zeros
+    byte all[286 + 30];
+    byte symbols[286 + 30];
+    byte extras[286 + 30];
+    int count = hlit + hdist;
+    int k = 0;
+    memcpy(all, lengths, hlit);
+    memcpy(all + hlit, lengths + 286, hdist);
+    for (int i = 0; i < count; ) {
+        int run = 1;
+        while (i + run < count && all[i + run] == all[i]) { run++; }
+        if (all[i] == 0 && run >= 3) {
+            run = min(run, 138);
+            symbols[k] = (byte)(run >= 11 ? 18 : 17);
+            extras[k++] = (byte)(run - (run >= 11 ? 11 : 3));
+            i += run;
+        } else if (i > 0 && all[i - 1] == all[i] && run >= 3) {
+            run = min(run, 6);
+            symbols[k] = 16;
+            extras[k++] = (byte)(run - 3);
+            i += run;
+        } else {
+            symbols[k] = all[i++];
+            extras[k++] = 0;
+        }
+    }
+    uint32_t cl_counts[19] = { 0 };
+    byte cl_lengths[19];
+    for (int i = 0; i < k; i++) { cl_counts[symbols[i]]++; }
+    huffman_lengths(cl_counts, 19, 7, cl_lengths);
+    int hclen = 19;
+    while (hclen > 4 && cl_lengths[order[hclen - 1]] == 0) { hclen--; }
+    // extra bits are the same either way
+    uint64_t dynamic_bits = 14 + 3 * hclen;
+    uint64_t fixed_bits = 0;
+    for (int i = 0; i < k; i++) {
+        dynamic_bits += cl_lengths[symbols[i]] +
+            (symbols[i] == 16 ? 2 : symbols[i] == 17 ? 3 : symbols[i] == 18 ? 7 : 0);
+    }
+    for (int i = 0; i < 286 + 30; i++) {
+        dynamic_bits += (uint64_t)counts[i] * lengths[i];
+        fixed_bits += (uint64_t)counts[i] * fixed[i];
+    }
+    const bool dynamic = dynamic_bits < fixed_bits;
+    const byte* used = dynamic ? lengths : fixed;
+    uint16_t codes[286 + 30];
+    huffman_codes(used, 286, codes);
+    huffman_codes(used + 286, 30, codes + 286);
+    bits_put(b, last, 1);
+    bits_put(b, dynamic ? 2 : 1, 2);
+    if (dynamic) {
+        uint16_t cl_codes[19];
+        huffman_codes(cl_lengths, 19, cl_codes);
+        bits_put(b, hlit - 257, 5);
+        bits_put(b, hdist - 1, 5);
+        bits_put(b, hclen - 4, 4);
+        for (int i = 0; i < hclen; i++) { bits_put(b, cl_lengths[order[i]], 3); }
+        for (int i = 0; i < k; i++) {
+            bits_put(b, cl_codes[symbols[i]], cl_lengths[symbols[i]]);
+            if (symbols[i] >= 16) {
+                bits_put(b, extras[i], symbols[i] == 16 ? 2 : symbols[i] == 17 ? 3 : 7);
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (t[i].length == 0) {
+            bits_put(b, codes[t[i].value], used[t[i].value]);
+        } else {
+            const int lc = deflate_length_code(t[i].length);
+            const int dc = deflate_dist_code(t[i].value);
+            bits_put(b, codes[257 + lc], used[257 + lc]);
+            bits_put(b, t[i].length - deflate_length_base[lc], deflate_length_extra[lc]);
+            bits_put(b, codes[286 + dc], used[286 + dc]);
+            bits_put(b, t[i].value - deflate_dist_base[dc], deflate_dist_extra[dc]);
+        }
+    }
+    bits_put(b, codes[256], used[256]);
+}
+
+// greedy LZ77 following hash chains of up to 2^(level-1) candidates,
+// level 0 stores the data in uncompressed blocks
+static bool deflate(bytes_t* b, const byte* p, size_t n, int level) {
+    if (level == 0) {
+        size_t i = 0;
+        do {
+            const size_t k = min(n - i, 65535);
+            const byte header[4] = {
+                (byte)k, (byte)(k >> 8), (byte)~k, (byte)(~k >> 8)
+            };
+            bits_put(b, i + k == n, 1);
+            bits_put(b, 0, 2);
+            bytes_append(b, header, sizeof(header));
+            bytes_append(b, p + i, k);
+            i += k;
+        } while (i < n);
+        return !b->failed;
+    }
+    enum { window = 32768, hash_bits = 15 };
+    const int chain = 1 << min(level - 1, 8);
+    uint32_t* head = (uint32_t*)calloc((size_t)1 << hash_bits, sizeof(uint32_t));
+    uint32_t* prev = (uint32_t*)calloc(window, sizeof(uint32_t)); // positions + 1
+    token_t* tokens = (token_t*)malloc(deflate_block_tokens * sizeof(token_t));
+    if (head == null || prev == null || tokens == null) {
+        b->failed = true;
+    }
+    int count = 0;
+    size_t i = 0;
+    while (!b->failed && i < n) {
+        size_t best = 0;
+        size_t dist = 0;
+        const size_t limit = min(n - i, 258);
+        uint32_t h = 0;
+        if (limit >= 3) {
+            h = ((uint32_t)p[i] | (uint32_t)p[i + 1] << 8 | (uint32_t)p[i + 2] << 16) *
+                2654435761u >> (32 - hash_bits);
+            uint32_t q = head[h];
+            for (int d = 0; q != 0 && d < chain && best < limit; d++) {
+                const size_t s = q - 1;
+                if (i - s > window) { break; }
+                if (p[s + best] == p[i + best]) {
+                    size_t k = 0;
+                    while (k < limit && p[s + k] == p[i + k]) { k++; }
+                    if (k > best) {
+                        best = k;
+                        dist = i - s;
+                    }
+                }
+                q = prev[s % window];
+            }
+        }
+        const size_t length = best >= 3 ? best : 1;
+        for (size_t j = i; j < i + length && j + 3 <= n; j++) {
+            if (j > i) {
+                h = ((uint32_t)p[j] | (uint32_t)p[j + 1] << 8 | (uint32_t)p[j + 2] << 16) *
+                    2654435761u >> (32 - hash_bits);
+            }
+            prev[j % window] = head[h];
+            head[h] = (uint32_t)(j + 1);
+        }
+        tokens[count].length = (uint16_t)(best >= 3 ? best : 0);
+        tokens[count].value = (uint16_t)(best >= 3 ? dist : p[i]);
+        count++;
+        i += length;
+        if (count == deflate_block_tokens || i == n) {
+            deflate_block(b, tokens, count, i == n);
+            count = 0;
+        }
+    }
+    if (!b->failed && n == 0) { deflate_block(b, tokens, 0, true); }
+    free(head);
+    free(prev);
+    free(tokens);
+    return !b->failed;
+}
+
+static uint32_t adler32(const byte* p, size_t n) {
+    uint32_t s1 = 1;
+    uint32_t s2 = 0;
+    while (n > 0) {
+        const size_t k = min(n, 5552);
+        for (size_t i = 0; i < k; i++) {
+            s1 += p[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        p += k;
+        n -= k;
+    }
+    return s2 << 16 | s1;
+}
+
+static uint32_t crc32(uint32_t crc, const byte* p, size_t n) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) { c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1; }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) { crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8); }
+    return ~crc;
+}
+
+static bool zlib_compress(bytes_t* b, const byte* p, size_t n, int level) {
+    // FLEVEL of the header only informs, 0x78 is a 32KB window deflate
+    const byte header[2] = {
+        0x78, (byte)(level <= 1 ? 0x01 : level < 6 ? 0x5E : level == 6 ? 0x9C : 0xDA)
+    };
+    bytes_append(b, header, sizeof(header));
+    if (deflate(b, p, n, level)) { bytes_be32(b, adler32(p, n)); }
+    return !b->failed;
+}
+
+typedef struct png_spec_s {
+    int w;
+    int h;
+    int color;       // PNG color type 0 gray, 2 RGB, 3 palette, 4 gray alpha, 6 RGBA
+    int depth;       // 1, 2, 4, 8 or 16 bits a sample
+    int filter;      // 0..4 on every row, 5 cycles through them, 6 adaptive
+    int level;       // compression 0..9
+    bool interlaced; // Adam7
+} png_spec_t;
+
+static const char* png_filter_names[] = {
+    "none", "sub", "up", "avg", "paeth", "mixed", "adaptive"
+};
+
+static int png_channels(int color) {
+    return color == 2 ? 3 : color == 4 ? 2 : color == 6 ? 4 : 1;
+}
+
+static size_t png_row_bytes(const png_spec_t* s, int w) {
+    return ((size_t)w * png_channels(s->color) * s->depth + 7) / 8;
+}
+
+// Adam7 pass origins and steps, a single pass for non-interlaced images
+static int png_passes(const png_spec_t* s, int pass[7][4]) {
+    static const int adam7[7][4] = {
+        { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+        { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+    };
+    static const int single[4] = { 0, 0, 1, 1 };
+    const int n = s->interlaced ? 7 : 1;
+    for (int i = 0; i < n; i++) {
+        memcpy(pass[i], s->interlaced ? adam7[i] : single, sizeof(pass[i]));
+    }
+    return n;
+}
+
+// gradients under a checkerboard of noisy and smooth squares, so that
+// filters and matches find about as much to work with as in photos
+static int png_sample(const png_spec_t* s, int x, int y, int c) {
+    const int odd = ((x >> 4) ^ (y >> 4)) & 1;
+    uint32_t noise = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^
+                     (uint32_t)c * 83492791u;
+    noise = (noise * 2654435761u) >> 28;
+    const int v = (x * (c + 1) * 255 / max(s->w - 1, 1) +
+                   y * 255 / max(s->h - 1, 1)) / 2 + odd * (32 + (int)noise);
+    if (s->depth == 16) { return (v & 0xFF) << 8 | (int)(noise * 17); }
+    return (v & 0xFF) >> (8 - s->depth);
+}
+
+static void png_row(const png_spec_t* s, int y, int x0, int dx, int w, byte* row) {
+    const int channels = png_channels(s->color);
+    memset(row, 0, png_row_bytes(s, w));
+    size_t bit = 0;
+    for (int i = 0; i < w; i++) {
+        for (int c = 0; c < channels; c++, bit += s->depth) {
+            const int v = png_sample(s, x0 + i * dx, y, c);
+            if (s->depth == 16) {
+                row[bit / 8] = (byte)(v >> 8);
+                row[bit / 8 + 1] = (byte)v;
+            } else {
+                row[bit / 8] |= (byte)(v << (8 - s->depth - bit % 8));
+            }
+        }
+    }
+}
+
+static int paeth(int a, int b, int c) {
+    const int pa = abs(b - c);
+    const int pb = abs(a - c);
+    const int pc = abs(a + b - 2 * c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+static void png_filter(byte* out, const byte* cur, const byte* prior, size_t n,
+        int bpp, int type) {
+    out[0] = (byte)type;
+    for (size_t i = 0; i < n; i++) {
+        const int a = i >= (size_t)bpp ? cur[i - bpp] : 0;
+        const int b = prior[i];
+        const int c = i >= (size_t)bpp ? prior[i - bpp] : 0;
+        const int p = type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 :
+                      type == 4 ? paeth(a, b, c) : 0;
+        out[1 + i] = (byte)(cur[i] - p);
+    }
+}
+
+// filtered scanlines of all the passes, the data the IDAT chunks compress
+static byte* png_scanlines(const png_spec_t* s, size_t* bytes) {
+    int pass[7][4];
+    const int passes = png_passes(s, pass);
+    const int bpp = max(1, png_channels(s->color) * s->depth / 8);
+    const size_t stride = png_row_bytes(s, s->w);
+    size_t total = 0;
+    for (int p = 0; p < passes; p++) {
+        const int w = (s->w - pass[p][0] + pass[p][2] - 1) / pass[p][2];
+        const int h = (s->h - pass[p][1] + pass[p][3] - 1) / pass[p][3];
+        if (w > 0 && h > 0) { total += (size_t)h * (1 + png_row_bytes(s, w)); }
+    }
+    byte* data = (byte*)malloc(total);
+    byte* rows = (byte*)calloc(7, stride + 1); // cur, prior, 5 trials
+    if (data == null || rows == null) {
+        free(data);
+        free(rows);
+        return null;
+    }
+    byte* cur = rows;
+    byte* prior = rows + stride;
+    byte* out = data;
+    for (int p = 0; p < passes; p++) {
+        const int w = (s->w - pass[p][0] + pass[p][2] - 1) / pass[p][2];
+        const size_t n = png_row_bytes(s, w);
+        if (w == 0) { continue; }
+        memset(prior, 0, n);
+        for (int y = pass[p][1], j = 0; y < s->h; y += pass[p][3], j++) {
+            png_row(s, y, pass[p][0], pass[p][2], w, cur);
+            if (s->filter < 5) {
+                png_filter(out, cur, prior, n, bpp, s->filter);
+            } else if (s->filter == 5) {
+                png_filter(out, cur, prior, n, bpp, j % 5);
+            } else { // smallest sum of the residuals as signed bytes
+                uint64_t best = UINT64_MAX;
+                for (int type = 0; type < 5; type++) {
+                    byte* trial = rows + (2 + type) * (stride + 1);
+                    uint64_t sum = 0;
+                    png_filter(trial, cur, prior, n, bpp, type);
+                    for (size_t i = 1; i <= n; i++) { sum += (uint64_t)abs((int8_t)trial[i]); }
+                    if (sum < best) {
+                        best = sum;
+                        memcpy(out, trial, n + 1);
+                    }
+                }
+            }
+            out += n + 1;
+            byte* t = prior;
+            prior = cur;
+            cur = t;
+        }
+    }
+    free(rows);
+    *bytes = total;
+    return data;
+}
+
+static void png_chunk(bytes_t* b, const char* type, const byte* data, size_t n) {
+    bytes_be32(b, (uint32_t)n);
+    bytes_append(b, type, 4);
+    bytes_append(b, data, n);
+    uint32_t crc = crc32(0, (const byte*)type, 4);
+    bytes_be32(b, crc32(crc, data, n));
+}
+
+static int png_write(const png_spec_t* s, const char* fn) {
+    int r = 0;
+    size_t n = 0;
+    bytes_t z = { 0 };
+    bytes_t png = { 0 };
+    byte* scanlines = png_scanlines(s, &n);
+    if (scanlines == null || !zlib_compress(&z, scanlines, n, s->level)) {
+        r = ENOMEM;
+    }
+    free(scanlines);
+    if (r == 0) {
+        static const byte signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        const byte ihdr[13] = {
+            (byte)(s->w >> 24), (byte)(s->w >> 16), (byte)(s->w >> 8), (byte)s->w,
+            (byte)(s->h >> 24), (byte)(s->h >> 16), (byte)(s->h >> 8), (byte)s->h,
+            (byte)s->depth, (byte)s->color, 0, 0, (byte)s->interlaced
+        };
+        bytes_append(&png, signature, sizeof(signature));
+        png_chunk(&png, "IHDR", ihdr, sizeof(ihdr));
+        if (s->color == 3) { // color ramps, every other depth with alphas
+            const int entries = 1 << s->depth;
+            byte plte[256 * 3];
+            byte trns[256];
+            for (int i = 0; i < entries; i++) {
+                plte[i * 3 + 0] = (byte)(i * 255 / (entries - 1));
+                plte[i * 3 + 1] = (byte)(i * 37);
+                plte[i * 3 + 2] = (byte)(255 - i * 91);
+                trns[i] = (byte)(255 - i * 255 / (entries - 1) / 2);
+            }
+            png_chunk(&png, "PLTE", plte, (size_t)entries * 3);
+            if (s->depth == 2 || s->depth == 8) {
+                png_chunk(&png, "tRNS", trns, (size_t)entries);
+            }
+        }
+        for (size_t i = 0; i < z.bytes; i += 65536) {
+            png_chunk(&png, "IDAT", z.data + i, min(z.bytes - i, 65536));
+        }
+        png_chunk(&png, "IEND", null, 0);
+        if (png.failed) { r = ENOMEM; }
+    }
+    if (r == 0) { r = bytes_save(&png, fn); }
+    if (r != 0) {
+        fprintf(errors(), "failed to write \"%s\" %s\n", fn, strerror(r));
+    }
+    free(z.data);
+    free(png.data);
+    return r;
+}
+
+// baseline JPEGs with restart intervals, the kind stb_image decodes in
+// parallel, so "pngdump bench" can check that corrupt ones decode the same
+// either way; the Huffman tables are the example ones from the standard
+
+typedef struct jpeg_spec_s {
+    int w;
+    int h;
+    int components; // 1 gray or 3 YCbCr
+    int sampling;   // luma blocks per MCU side: 1 for 4:4:4, 2 for 4:2:0
+    int restart;    // MCUs per restart interval
+} jpeg_spec_t;
+
+static const byte jpeg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const byte jpeg_dc_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1 };
+
+static const byte jpeg_dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const byte jpeg_ac_bits[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D
+};
+
+static const byte jpeg_ac_values[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+    0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3,
+    0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+    0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,
+    0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4,
+    0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA
+};
+
+typedef struct jpeg_writer_s {
+    bytes_t out;
+    uint32_t acc;
+    int count;            // bits in acc
+    uint16_t code[2][256]; // DC and AC codes by symbol
+    byte size[2][256];
+    float cosine[8][8];
+    int pred[3];          // DC predictions
+} jpeg_writer_t;
+
+static void jpeg_huffman(jpeg_writer_t* j, int table, const byte* bits,
+        const byte* values) {
+    uint32_t code = 0;
+    int k = 0;
+    for (int n = 1; n <= 16; n++) {
+        for (int i = 0; i < bits[n - 1]; i++, k++) {
+            j->code[table][values[k]] = (uint16_t)code++;
+            j->size[table][values[k]] = (byte)n;
+        }
+        code <<= 1;
+    }
+}
+
+static void jpeg_put(jpeg_writer_t* j, uint32_t v, int n) { // MSB first
+    j->acc = j->acc << n | (v & ((1u << n) - 1));
+    j->count += n;
+    while (j->count >= 8) {
+        const byte b[2] = { (byte)(j->acc >> (j->count - 8)), 0 };
+        bytes_append(&j->out, b, b[0] == 0xFF ? 2 : 1); // stuffed
+        j->count -= 8;
+    }
+}
+
+static void jpeg_restart(jpeg_writer_t* j, int k) {
+    if (j->count > 0) { jpeg_put(j, 0xFF, 8 - j->count); } // pad with ones
+    const byte marker[2] = { 0xFF, (byte)(0xD0 + (k & 7)) };
+    bytes_append(&j->out, marker, sizeof(marker));
+    memset(j->pred, 0, sizeof(j->pred));
+}
+
+static void jpeg_segment(jpeg_writer_t* j, int marker, const byte* data, int n) {
+    const byte header[4] = { 0xFF, (byte)marker, (byte)((n + 2) >> 8), (byte)(n + 2) };
+    bytes_append(&j->out, header, sizeof(header));
+    bytes_append(&j->out, data, n);
+}
+
+// sample of component c (Y, Cb, Cr) averaged over d x d pixels
+static float jpeg_sample(const png_spec_t* s, int c, int d, int x, int y) {
+    float sum = 0;
+    for (int i = 0; i < d; i++) {
+        for (int k = 0; k < d; k++) {
+            const int px = min(x * d + k, s->w - 1);
+            const int py = min(y * d + i, s->h - 1);
+            const float r = (float)png_sample(s, px, py, 0);
+            const float g = (float)png_sample(s, px, py, 1);
+            const float b = (float)png_sample(s, px, py, 2);
+            sum += c == 0 ? 0.299f * r + 0.587f * g + 0.114f * b :
+                   c == 1 ? -0.1687f * r - 0.3313f * g + 0.5f * b + 128 :
+                            0.5f * r - 0.4187f * g - 0.0813f * b + 128;
+        }
+    }
+    return sum / (d * d);
+}
+
+// 8x8 block of component c at block (bx, by) of that component
+static void jpeg_block(jpeg_writer_t* j, const png_spec_t* s, int c, int d,
+        int bx, int by) {
+    float px[64];
+    float coef[64];
+    for (int i = 0; i < 64; i++) {
+        px[i] = jpeg_sample(s, c, d, bx * 8 + i % 8, by * 8 + i / 8) - 128;
+    }
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            float sum = 0;
+            for (int i = 0; i < 64; i++) {
+                sum += px[i] * j->cosine[u][i % 8] * j->cosine[v][i / 8];
+            }
+            coef[v * 8 + u] = sum;
+        }
+    }
+    int run = 0;
+    for (int i = 0; i < 64; i++) {
+        int q = (int)lroundf(coef[jpeg_zigzag[i]] / 8); // flat quantization
+        if (i == 0) {
+            const int diff = q - j->pred[c];
+            j->pred[c] = q;
+            q = diff;
+        } else if (q == 0) {
+            run++;
+            continue;
+        }
+        int n = 0;
+        while ((abs(q) >> n) != 0) { n++; }
+        if (i > 0) {
+            for (; run > 15; run -= 16) { jpeg_put(j, j->code[1][0xF0], j->size[1][0xF0]); }
+            n |= run << 4;
+            run = 0;
+        }
+        jpeg_put(j, j->code[i > 0][n], j->size[i > 0][n]);
+        n &= 15;
+        if (n > 0) { jpeg_put(j, (uint32_t)(q < 0 ? q + (1 << n) - 1 : q), n); }
+    }
+    if (run > 0) { jpeg_put(j, j->code[1][0], j->size[1][0]); } // end of block
+}
+
+static int jpeg_write(const jpeg_spec_t* s, const char* fn) {
+    const png_spec_t samples = { s->w, s->h, 2, 8, 0, 0, false };
+    const int f = s->components == 3 ? s->sampling : 1;
+    const int mcu_x = (s->w + 8 * f - 1) / (8 * f);
+    const int mcu_y = (s->h + 8 * f - 1) / (8 * f);
+    jpeg_writer_t* j = (jpeg_writer_t*)calloc(1, sizeof(jpeg_writer_t));
+    if (j == null) { return ENOMEM; }
+    jpeg_huffman(j, 0, jpeg_dc_bits, jpeg_dc_values);
+    jpeg_huffman(j, 1, jpeg_ac_bits, jpeg_ac_values);
+    for (int u = 0; u < 8; u++) {
+        for (int x = 0; x < 8; x++) {
+            j->cosine[u][x] = (u == 0 ? sqrtf(0.125f) : 0.5f) *
+                (float)cos((2 * x + 1) * u * 3.14159265358979 / 16);
+        }
+    }
+    const byte soi[2] = { 0xFF, 0xD8 };
+    bytes_append(&j->out, soi, sizeof(soi));
+    byte dqt[65] = { 0 };
+    memset(dqt + 1, 8, 64);
+    jpeg_segment(j, 0xDB, dqt, sizeof(dqt));
+    byte sof[6 + 3 * 3] = {
+        8, (byte)(s->h >> 8), (byte)s->h, (byte)(s->w >> 8), (byte)s->w,
+        (byte)s->components
+    };
+    for (int c = 0; c < s->components; c++) {
+        sof[6 + c * 3] = (byte)(c + 1);
+        sof[7 + c * 3] = (byte)(c == 0 ? f << 4 | f : 0x11);
+    }
+    jpeg_segment(j, 0xC0, sof, 6 + 3 * s->components);
+    byte dht[1 + 16 + 162];
+    dht[0] = 0x00;
+    memcpy(dht + 1, jpeg_dc_bits, 16);
+    memcpy(dht + 17, jpeg_dc_values, sizeof(jpeg_dc_values));
+    jpeg_segment(j, 0xC4, dht, 17 + (int)sizeof(jpeg_dc_values));
+    dht[0] = 0x10;
+    memcpy(dht + 1, jpeg_ac_bits, 16);
+    memcpy(dht + 17, jpeg_ac_values, sizeof(jpeg_ac_values));
+    jpeg_segment(j, 0xC4, dht, 17 + (int)sizeof(jpeg_ac_values));
+    const byte dri[2] = { (byte)(s->restart >> 8), (byte)s->restart };
+    jpeg_segment(j, 0xDD, dri, sizeof(dri));
+    byte sos[1 + 2 * 3 + 3] = { (byte)s->components };
+    for (int c = 0; c < s->components; c++) { sos[1 + c * 2] = (byte)(c + 1); }
+    sos[2 + s->components * 2] = 63; // spectral selection 0..63
+    jpeg_segment(j, 0xDA, sos, 4 + 2 * s->components);
+    for (int m = 0; m < mcu_x * mcu_y; m++) {
+        if (m > 0 && m % s->restart == 0) { jpeg_restart(j, m / s->restart - 1); }
+        const int mx = m % mcu_x;
+        const int my = m / mcu_x;
+        for (int c = 0; c < s->components; c++) {
+            const int n = c == 0 ? f : 1; // blocks per side, subsampled by f / n
+            for (int i = 0; i < n * n; i++) {
+                jpeg_block(j, &samples, c, f / n, mx * n + i % n, my * n + i / n);
+            }
+        }
+    }
+    if (j->count > 0) { jpeg_put(j, 0xFF, 8 - j->count); }
+    const byte eoi[2] = { 0xFF, 0xD9 };
+    bytes_append(&j->out, eoi, sizeof(eoi));
+    int r = j->out.failed ? ENOMEM : bytes_save(&j->out, fn);
+    if (r != 0) {
+        fprintf(errors(), "failed to write \"%s\" %s\n", fn, strerror(r));
+    }
+    free(j->out.data);
+    free(j);
+    return r;
+}
+
+// all color types and depths, plain and interlaced, at 256x256; every
+// filter mix and compression levels 0, 1 and 9 of 1024x1024 RGBA; gray,
+// RGB and RGBA from 64x64 up to max_size square. Files already there are
+// kept, the content is the same every time
+static int corpus_generate(const char* dir, int max_size) {
+    static const int formats[][2] = { // color type, depth
+        { 0, 1 }, { 0, 2 }, { 0, 4 }, { 0, 8 }, { 0, 16 }, { 2, 8 }, { 2, 16 },
+        { 3, 1 }, { 3, 2 }, { 3, 4 }, { 3, 8 }, { 4, 8 }, { 4, 16 },
+        { 6, 8 }, { 6, 16 }
+    };
+    static const char* color_names[] = { "g", "?", "rgb", "p", "ga", "?", "rgba" };
+    png_spec_t specs[countof(formats) * 2 + 7 + 3 + 7 * 3];
+    int n = 0;
+    for (int i = 0; i < (int)countof(formats) * 2; i++) {
+        png_spec_t s = { 256, 256, formats[i / 2][0], formats[i / 2][1], 6, 6, i % 2 == 1 };
+        specs[n++] = s;
+    }
+    for (int filter = 0; filter <= 6; filter++) {
+        png_spec_t s = { 1024, 1024, 6, 8, filter, 6, false };
+        specs[n++] = s;
+    }
+    for (int i = 0; i < 3; i++) {
+        png_spec_t s = { 1024, 1024, 6, 8, 6, i == 0 ? 0 : i == 1 ? 1 : 9, false };
+        specs[n++] = s;
+    }
+    for (int size = 64; size <= max_size; size *= 4) {
+        for (int color = 0; color <= 6; color += color == 0 ? 2 : 4) {
+            png_spec_t s = { size, size, color, 8, 6, 6, false };
+            specs[n++] = s;
+        }
+    }
+    int r = directory_create(dir);
+    for (int i = 0; r == 0 && i < n; i++) {
+        const png_spec_t* s = &specs[i];
+        char fn[1024];
+        uint64_t size = 0;
+        uint64_t mtime = 0;
+        snprintf(fn, countof(fn), "%s/%s%d_%dx%d_%s_z%d%s.png", dir,
+            color_names[s->color], s->depth, s->w, s->h,
+            png_filter_names[s->filter], s->level, s->interlaced ? "_i" : "");
+        if (file_stamp(fn, &size, &mtime) != 0) {
+            r = png_write(s, fn);
+            if (r == 0) { fprintf(output(), "%s\n", fn); }
+        }
+    }
+    return r;
+}
+
+// three small JPEGs with restart intervals, gray, 4:2:0 and 4:4:4 with a
+// restart after every MCU. Files already there are kept, the content is
+// the same every time
+static int corpus_jpegs(const char* dir) {
+    int r = directory_create(dir);
+    static const jpeg_spec_t jpegs[] = {
+        { 127, 93, 1, 1, 3 }, { 250, 181, 3, 2, 5 }, { 64, 64, 3, 1, 1 }
+    };
+    for (int i = 0; r == 0 && i < (int)countof(jpegs); i++) {
+        const jpeg_spec_t* s = &jpegs[i];
+        char fn[1024];
+        uint64_t size = 0;
+        uint64_t mtime = 0;
+        snprintf(fn, countof(fn), "%s/%s_%dx%d_rst%d.jpg", dir,
+            s->components == 1 ? "g" : s->sampling == 2 ? "ycc420" : "ycc444",
+            s->w, s->h, s->restart);
+        if (file_stamp(fn, &size, &mtime) != 0) {
+            r = jpeg_write(s, fn);
+            if (r == 0) { fprintf(output(), "%s\n", fn); }
+        }
+    }
+    return r;
+}
+
+// ---- per stage timings, see bench_stages() ----
+
+typedef struct bench_result_s {
+    char file[1024]; // JSON escaped file name without its directory
+    char simd[8];
+    char stage[12];
+    char cache[8];
+    double ms;
+    double mbps;
+    double mpixps;
+} bench_result_t;
+
+typedef struct bench_s {
+    int iterations;
+    FILE* null_stream;  // output of the histogram and dump stages
+    byte* sweep;        // written over to evict the CPU caches
+    bench_result_t* results;
+    int count;
+    int capacity;
+    double started[3];  // by STBI_STAGE_..., see bench_stage_hook()
+    double elapsed[3];
+    int seen;           // bit mask of the stages reported
+} bench_t;
+
+enum { bench_sweep_bytes = 64 * 1024 * 1024 };
+
+enum {
+    stage_read,      // file into memory
+    stage_inflate,   // PNG IDAT zlib stream
+    stage_unfilter,  // PNG scanlines to pixels
+    stage_decode,    // stbi_load_from_memory() to the file's channels
+    stage_convert,   // decoded image to 1 channel as pngdump does
+    stage_histogram, // histograms() of the whole gray image
+    stage_dump       // dump() of up to 256x256 gray pixels
+};
+
+typedef struct bench_input_s {
+    const char* fn;
+    mapping_t map;
+    size_t raw_bytes;  // inflated PNG scanlines, from the IHDR
+    int w;
+    int h;
+    int c;
+    byte* gray;
+} bench_input_t;
+
+// results are keyed on the file name alone so that a baseline recorded
+// from another directory still matches
+static const char* path_basename(const char* fn) {
+    const char* s = fn;
+    for (const char* p = fn; *p != 0; p++) {
+        if (*p == '/' || *p == '\\') { s = p + 1; }
+    }
+    return s;
+}
+
+static void json_escape(char* out, size_t n, const char* s) {
+    size_t k = 0;
+    for (; *s != 0 && k + 2 < n; s++) {
+        if (*s == '"' || *s == '\\') { out[k++] = '\\'; }
+        out[k++] = (unsigned char)*s < 0x20 ? '?' : *s;
+    }
+    out[k] = 0;
+}
+
+// bytes the IDAT chunks of a PNG inflate to, from the IHDR, 0 otherwise
+static size_t bench_png_raw_bytes(const mapping_t* map) {
+    static const byte signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    const byte* p = (const byte*)map->data;
+    if (map->bytes < 8 + 25 || memcmp(p, signature, 8) != 0 ||
+        memcmp(p + 12, "IHDR", 4) != 0) {
+        return 0;
+    }
+    png_spec_t s = { 0 };
+    s.w = p[16] << 24 | p[17] << 16 | p[18] << 8 | p[19];
+    s.h = p[20] << 24 | p[21] << 16 | p[22] << 8 | p[23];
+    s.depth = p[24];
+    s.color = p[25];
+    s.interlaced = p[28] != 0;
+    size_t bytes = 0;
+    int pass[7][4];
+    const int passes = png_passes(&s, pass);
+    for (int i = 0; i < passes; i++) {
+        const int w = (s.w - pass[i][0] + pass[i][2] - 1) / pass[i][2];
+        const int h = (s.h - pass[i][1] + pass[i][3] - 1) / pass[i][3];
+        if (w > 0 && h > 0) { bytes += (size_t)h * (1 + png_row_bytes(&s, w)); }
+    }
+    return bytes;
+}
+
+// installed with stbi_set_stage_hook(), accumulates the time spent in each
+// stage of a decode
+static void bench_stage_hook(void* user, int stage, int done) {
+    bench_t* b = (bench_t*)user;
+    const double t = seconds();
+    if (0 <= stage && stage < (int)countof(b->started)) {
+        if (done) {
+            b->elapsed[stage] += t - b->started[stage];
+            b->seen |= 1 << stage;
+        } else {
+            b->started[stage] = t;
+        }
+    }
+}
+
+static void bench_drop_caches(bench_t* b, const char* fn) {
+#ifdef __linux__
+    int fd = open(fn, O_RDONLY);
+    if (fd >= 0) { // dirty pages cannot be dropped
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#else
+    (void)fn; // only the CPU caches
+#endif
+    for (size_t i = 0; i < bench_sweep_bytes; i += 64) { b->sweep[i]++; }
+}
+
+// the inflate, unfilter and convert stages are timed inside a whole
+// decode by bench_stage_hook()
+static int bench_run(bench_t* b, bench_input_t* in, int stage, double* time) {
+    static const int stbi_stages[] = {
+        -1, STBI_STAGE_INFLATE, STBI_STAGE_UNFILTER, -1, STBI_STAGE_CONVERT
+    };
+    int r = 0;
+    int w = 0, h = 0, c = 0;
+    FILE* out = output_stream;
+    memset(b->elapsed, 0, sizeof(b->elapsed));
+    double t = seconds();
+    if (stage == stage_read) {
+        FILE* f = fopen(in->fn, "rb");
+        byte* data = (byte*)malloc(in->map.bytes);
+        if (f == null || data == null ||
+            fread(data, 1, in->map.bytes, f) != in->map.bytes) {
+            r = f == null ? errno : EIO;
+        }
+        if (f != null) { fclose(f); }
+        free(data);
+    } else if (stage <= stage_convert) {
+        byte* data = stbi_load_from_memory((const byte*)in->map.data,
+            (int)in->map.bytes, &w, &h, &c, stage == stage_convert ? 1 : 0);
+        if (data == null) { r = EXIT_FAILURE; }
+        stbi_image_free(data);
+    } else if (stage == stage_histogram) {
+        roi_t roi = { 0, 0, in->w, in->h };
+        output_stream = b->null_stream;
+        r = histograms(in->gray, in->w, false, &roi, 1);
+    } else {
+        output_stream = b->null_stream;
+        dump(in->gray, 0, 0, min(in->w, 256), min(in->h, 256), in->w);
+    }
+    *time = seconds() - t;
+    if (stage < (int)countof(stbi_stages) && stbi_stages[stage] >= 0) {
+        *time = b->elapsed[stbi_stages[stage]];
+    }
+    output_stream = out;
+    if (r != 0) {
+        fprintf(errors(), "%s: failed to time stage %d %s\n", in->fn, stage,
+            stbi_failure_reason());
+    }
+    return r;
+}
+
+// best of "iterations" runs: warm after an untimed one, cold with the
+// file dropped from the page cache (on Linux) and the CPU caches swept
+// before every run
+static int bench_time(bench_t* b, bench_input_t* in, int stage, bool cold,
+        double* best) {
+    double time = 0;
+    int r = cold ? 0 : bench_run(b, in, stage, &time);
+    for (int i = 0; r == 0 && i < b->iterations; i++) {
+        if (cold) { bench_drop_caches(b, in->fn); }
+        r = bench_run(b, in, stage, &time);
+        if (i == 0 || time < *best) { *best = time; }
+    }
+    return r;
+}
+
+static int bench_report(bench_t* b, const char* fn, const char* stage,
+        bool cold, double time, double bytes, double pixels) {
+    if (b->count == b->capacity) {
+        int capacity = max(64, b->capacity * 2);
+        bench_result_t* results = (bench_result_t*)realloc(b->results,
+            capacity * sizeof(bench_result_t));
+        if (results == null) {
+            fprintf(errors(), "out of memory\n");
+            return EXIT_FAILURE;
+        }
+        b->results = results;
+        b->capacity = capacity;
+    }
+    bench_result_t* br = &b->results[b->count++];
+    json_escape(br->file, countof(br->file), path_basename(fn));
+    snprintf(br->simd, countof(br->simd), "%s", simd_level_name(stbi_simd_level()));
+    snprintf(br->stage, countof(br->stage), "%s", stage);
+    snprintf(br->cache, countof(br->cache), "%s", cold ? "cold" : "warm");
+    br->ms = time * 1000;
+    br->mbps = time > 0 ? bytes / time / 1e6 : 0;
+    br->mpixps = time > 0 ? pixels / time / 1e6 : 0;
+    fprintf(output(), "%s %-9s %s %9.3f ms %9.2f MB/s %9.2f Mpix/s\n",
+        fn, stage, br->cache, br->ms, br->mbps, br->mpixps);
+    return 0;
+}
+
+// times each stage of what pngdump does with a file, warm and cold:
+//   read      the file into memory, MB/s of the file
+//   inflate   the zlib stream of a PNG, MB/s of the inflated scanlines
+//   unfilter  the inflated scanlines of a PNG: unfiltering, deinterlacing
+//             and expanding to 8 bits a sample, MB/s of the scanlines
+//   decode    all of stbi_load_from_memory(), MB/s of the decoded image
+//   convert   the decoded image to gray, MB/s of the decoded image, only
+//             for formats that stb_image converts after decoding
+//   histogram of the gray image, MB/s of the gray image
+//   dump      of up to 256x256 gray pixels as text
+static int bench_stages(bench_t* b, const char* fn) {
+    bench_input_t in = { 0 };
+    in.fn = fn;
+    int r = file_map(&in.map, fn);
+    if (r != 0) {
+        fprintf(errors(), "failed to open \"%s\" %s\n", fn, strerror(r));
+        return r;
+    }
+    in.raw_bytes = bench_png_raw_bytes(&in.map);
+    b->seen = 0;
+    in.gray = stbi_load_from_memory((const byte*)in.map.data,
+        (int)in.map.bytes, &in.w, &in.h, &in.c, 1);
+    if (in.gray == null) {
+        fprintf(errors(), "failed to decode \"%s\" %s\n", fn, stbi_failure_reason());
+        r = EXIT_FAILURE;
+    }
+    const bool png = in.raw_bytes > 0 &&
+        (b->seen & (1 << STBI_STAGE_INFLATE)) != 0 &&
+        (b->seen & (1 << STBI_STAGE_UNFILTER)) != 0;
+    const bool convert = (b->seen & (1 << STBI_STAGE_CONVERT)) != 0;
+    for (int cold = 0; r == 0 && cold < 2; cold++) {
+        double t[stage_dump + 1] = { 0 };
+        for (int stage = 0; r == 0 && stage <= stage_dump; stage++) {
+            if ((png || (stage != stage_inflate && stage != stage_unfilter)) &&
+                (stage != stage_convert || convert)) {
+                r = bench_time(b, &in, stage, cold, &t[stage]);
+            }
+        }
+        const double pixels = (double)in.w * in.h;
+        const double decoded = pixels * in.c;
+        const double dumped = (double)min(in.w, 256) * min(in.h, 256);
+        if (r == 0) { r = bench_report(b, fn, "read", cold, t[stage_read], (double)in.map.bytes, pixels); }
+        if (r == 0 && png) {
+            r = bench_report(b, fn, "inflate", cold, t[stage_inflate], (double)in.raw_bytes, pixels);
+            if (r == 0) {
+                r = bench_report(b, fn, "unfilter", cold, t[stage_unfilter],
+                    (double)in.raw_bytes, pixels);
+            }
+        }
+        if (r == 0) { r = bench_report(b, fn, "decode", cold, t[stage_decode], decoded, pixels); }
+        if (r == 0 && convert) {
+            r = bench_report(b, fn, "convert", cold, t[stage_convert], decoded, pixels);
+        }
+        if (r == 0) { r = bench_report(b, fn, "histogram", cold, t[stage_histogram], pixels, pixels); }
+        if (r == 0) { r = bench_report(b, fn, "dump", cold, t[stage_dump], dumped, dumped); }
+    }
+    if (in.gray != null) { stbi_image_free(in.gray); }
+    file_unmap(&in.map);
+    return r;
+}
+
+static int bench_json_write(const bench_t* b, const char* fn) {
+    int r = 0;
+    FILE* f = fopen(fn, "w");
+    if (f == null) {
+        r = errno;
+    } else {
+        fprintf(f, "{\"results\": [\n");
+        for (int i = 0; i < b->count; i++) {
+            const bench_result_t* br = &b->results[i];
+            fprintf(f, "{\"file\": \"%s\", \"simd\": \"%s\", \"stage\": \"%s\", "
+                       "\"cache\": \"%s\", \"ms\": %.6f, \"mbps\": %.3f, "
+                       "\"mpixps\": %.3f}%s\n", br->file, br->simd, br->stage,
+                       br->cache, br->ms, br->mbps, br->mpixps,
+                       i + 1 < b->count ? "," : "");
+        }
+        fprintf(f, "]}\n");
+        if (fclose(f) != 0) { r = errno; }
+    }
+    if (r != 0) {
+        fprintf(errors(), "failed to write \"%s\" %s\n", fn, strerror(r));
+    }
+    return r;
+}
+
+// compares MB/s with a baseline written by --json, one result per line;
+// results slower by more than "tolerance" percent fail the run, and so
+// does a run that matched nothing or missed any baseline result of the
+// files it benchmarked (e.g. recorded at another SIMD level), which would
+// otherwise pass without comparing anything
+static int bench_json_compare(const bench_t* b, const char* fn, double tolerance) {
+    FILE* f = fopen(fn, "r");
+    if (f == null) {
+        fprintf(errors(), "failed to open \"%s\" %s\n", fn, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int r = 0;
+    int matched = 0;
+    int missing = 0;
+    int regressions = 0;
+    char line[2048];
+    while (fgets(line, countof(line), f) != null) {
+        bench_result_t base = { 0 };
+        if (sscanf(line, " {\"file\": \"%1023[^\"]\", \"simd\": \"%7[^\"]\", "
+                         "\"stage\": \"%11[^\"]\", \"cache\": \"%7[^\"]\", "
+                         "\"ms\": %lf, \"mbps\": %lf, \"mpixps\": %lf",
+                   base.file, base.simd, base.stage, base.cache,
+                   &base.ms, &base.mbps, &base.mpixps) != 7) {
+            continue;
+        }
+        bool benchmarked = false;
+        bool found = false;
+        for (int i = 0; i < b->count; i++) {
+            const bench_result_t* br = &b->results[i];
+            benchmarked |= strcmp(br->file, base.file) == 0;
+            if (strcmp(br->file, base.file) == 0 &&
+                strcmp(br->simd, base.simd) == 0 &&
+                strcmp(br->stage, base.stage) == 0 &&
+                strcmp(br->cache, base.cache) == 0 && base.mbps > 0) {
+                const double change = (br->mbps / base.mbps - 1) * 100;
+                const bool slower = change < -tolerance;
+                fprintf(output(), "%s %-9s %s %9.2f -> %9.2f MB/s %+6.1f%%%s\n",
+                    br->file, br->stage, br->cache, base.mbps, br->mbps,
+                    change, slower ? " REGRESSION" : "");
+                matched++;
+                regressions += slower;
+                found = true;
+            }
+        }
+        if (benchmarked && !found) {
+            fprintf(errors(), "%s %s %s %s of \"%s\" has no result to "
+                "compare with\n", base.file, base.simd, base.stage,
+                base.cache, fn);
+            missing++;
+        }
+    }
+    fclose(f);
+    fprintf(output(), "%d results compared with \"%s\", %d slower by "
+        "more than %g%%, %d missing\n", matched, fn, regressions, tolerance,
+        missing);
+    if (matched == 0) {
+        fprintf(errors(), "no result matched \"%s\"\n", fn);
+    }
+    if (regressions > 0 || missing > 0 || matched == 0) { r = EXIT_FAILURE; }
+    return r;
+}
+
+static int bench_usage(void) {
+    fprintf(errors(), "pngbench [--cpu scalar|sse2|ssse3|sse4.1|avx2|avx512] "
+                      "[--iterations N] [--json filename] [--baseline "
+                      "filename [--tolerance P]] filename... times read, "
+                      "inflate, unfilter, decode, convert, histogram and "
+                      "dump, warm and cold, fails on MB/s P%% (10) below "
+                      "the baseline\n"
+                      "pngbench --generate directory [--max-size N] writes "
+                      "a synthetic PNG corpus up to NxN (4096, at most "
+                      "16384) and restart interval JPEGs\n");
+    return EXIT_FAILURE;
+}
+
+int main(int argc, const char* argv[]) {
+    int r = 0;
+    int iterations = 10;
+    int max_size = 4096;
+    double tolerance = 10;
+    bench_t b = { 0 };
+    stbi_simd_level(); // detected before any thread can decode
+    threads_init();
+    stbi_set_parallel_for(parallel_for, null);
+    stbi_set_stage_hook(bench_stage_hook, &b);
+    r = cpu_option(&argc, argv);
+    const char* s = args_option_value(&argc, argv, "--iterations");
+    const char* generate = args_option_value(&argc, argv, "--generate");
+    const char* size = args_option_value(&argc, argv, "--max-size");
+    const char* json = args_option_value(&argc, argv, "--json");
+    const char* baseline = args_option_value(&argc, argv, "--baseline");
+    const char* percent = args_option_value(&argc, argv, "--tolerance");
+    if (r != 0) {
+        // cpu_option() has reported it
+    } else if (s != null && (sscanf(s, "%d", &iterations) != 1 || iterations <= 0)) {
+        fprintf(errors(), "expected --iterations N instead of \"%s\"\n", s);
+        r = bench_usage();
+    } else if (generate != null && generate[0] == 0) {
+        fprintf(errors(), "expected --generate directory\n");
+        r = bench_usage();
+    } else if (size != null && (sscanf(size, "%d", &max_size) != 1 ||
+                                max_size < 64 || max_size > 16384)) {
+        fprintf(errors(), "expected --max-size [64..16384] instead of \"%s\"\n", size);
+        r = bench_usage();
+    } else if ((json != null && json[0] == 0) ||
+               (baseline != null && baseline[0] == 0)) {
+        fprintf(errors(), "expected --json filename and --baseline filename\n");
+        r = bench_usage();
+    } else if (percent != null && (sscanf(percent, "%lf", &tolerance) != 1 ||
+                                   tolerance < 0)) {
+        fprintf(errors(), "expected --tolerance P instead of \"%s\"\n", percent);
+        r = bench_usage();
+    } else if ((generate == null) == (argc < 2)) {
+        fprintf(errors(), generate == null ? "expected image files to benchmark\n" :
+                                             "unexpected image files with --generate\n");
+        r = bench_usage();
+    }
+    if (r == 0 && generate != null) {
+        r = corpus_generate(generate, max_size);
+        if (r == 0) { r = corpus_jpegs(generate); }
+    } else if (r == 0) {
+        b.iterations = iterations;
+#ifdef _WIN32
+        b.null_stream = fopen("NUL", "w");
+#else
+        b.null_stream = fopen("/dev/null", "w");
+#endif
+        b.sweep = (byte*)calloc(bench_sweep_bytes, 1);
+        if (b.null_stream == null || b.sweep == null) {
+            fprintf(errors(), "failed to set up stages %s\n", strerror(errno));
+            r = EXIT_FAILURE;
+        }
+        for (int i = 1; r == 0 && i < argc; i++) {
+            r = bench_stages(&b, argv[i]);
+        }
+        if (r == 0 && json != null) { r = bench_json_write(&b, json); }
+        if (r == 0 && baseline != null) {
+            r = bench_json_compare(&b, baseline, tolerance);
+        }
+        if (b.null_stream != null) { fclose(b.null_stream); }
+        free(b.sweep);
+        free(b.results);
+    }
+    return r;
+}
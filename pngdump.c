@@ -1,7 +1,31 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -12,36 +36,1271 @@
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #endif
 
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
 #ifndef countof
 #define countof(x) (sizeof(x) / sizeof((x)[0]))
 #endif
 
 typedef uint8_t byte;
 
+typedef struct roi_s {
+    int x;
+    int y;
+    int w;
+    int h;
+} roi_t;
+
+enum { max_threads = 64 };
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+static void mutex_init(mutex_t* m) { InitializeCriticalSection(m); }
+static void mutex_lock(mutex_t* m) { EnterCriticalSection(m); }
+static void mutex_unlock(mutex_t* m) { LeaveCriticalSection(m); }
+static void cond_init(cond_t* c) { InitializeConditionVariable(c); }
+static void cond_wait(cond_t* c, mutex_t* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void cond_broadcast(cond_t* c) { WakeAllConditionVariable(c); }
+static long atomic_increment(volatile long* v) { return InterlockedIncrement(v); }
+#else
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+static void mutex_init(mutex_t* m) { pthread_mutex_init(m, null); }
+static void mutex_lock(mutex_t* m) { pthread_mutex_lock(m); }
+static void mutex_unlock(mutex_t* m) { pthread_mutex_unlock(m); }
+static void cond_init(cond_t* c) { pthread_cond_init(c, null); }
+static void cond_wait(cond_t* c, mutex_t* m) { pthread_cond_wait(c, m); }
+static void cond_broadcast(cond_t* c) { pthread_cond_broadcast(c); }
+static long atomic_increment(volatile long* v) { return __atomic_add_fetch(v, 1, __ATOMIC_SEQ_CST); }
+#endif
+
+typedef void (*thread_func_t)(void* that, int k, int n);
+
+typedef struct thread_task_s {
+    thread_func_t func;
+    void* that;
+    int k;
+    int n;
+    int* pending; // shared by all tasks of a single threads_run() call
+    struct thread_task_s* next;
+} thread_task_t;
+
+// Process wide pool of worker threads started once by threads_init() and
+// shared by all concurrent threads_run() callers.
+static struct thread_pool_s {
+    mutex_t lock;
+    cond_t work; // tasks were queued
+    cond_t done; // a task has completed
+    thread_task_t* head;
+    thread_task_t* tail;
+    int threads;
+} pool;
+
+static int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si = { 0 };
+    GetSystemInfo(&si);
+    return max(1, (int)si.dwNumberOfProcessors);
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static thread_task_t* threads_pop(void) { // pool.lock must be held
+    thread_task_t* t = pool.head;
+    if (t != null) {
+        pool.head = t->next;
+        if (pool.head == null) { pool.tail = null; }
+    }
+    return t;
+}
+
+static void threads_execute(thread_task_t* t) { // pool.lock must be held
+    mutex_unlock(&pool.lock);
+    t->func(t->that, t->k, t->n);
+    mutex_lock(&pool.lock);
+    if (--*t->pending == 0) { cond_broadcast(&pool.done); }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI threads_worker(void* unused) {
+#else
+static void* threads_worker(void* unused) {
+#endif
+    (void)unused;
+    mutex_lock(&pool.lock);
+    for (;;) {
+        thread_task_t* t = threads_pop();
+        if (t == null) {
+            cond_wait(&pool.work, &pool.lock);
+        } else {
+            threads_execute(t);
+        }
+    }
+    return 0; // unreachable, workers live as long as the process
+}
+
+// starts cpu_count() - 1 workers, the caller of threads_run() is the last
+static void threads_init(void) {
+    mutex_init(&pool.lock);
+    cond_init(&pool.work);
+    cond_init(&pool.done);
+    const int n = min(cpu_count(), max_threads) - 1;
+    for (int i = 0; i < n; i++) {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(null, 0, threads_worker, null, 0, null);
+        if (thread == null) { break; }
+        CloseHandle(thread);
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, null, threads_worker, null) != 0) { break; }
+        pthread_detach(thread);
+#endif
+        pool.threads++;
+    }
+}
+
+// calls func(that, k, n) for k in [0..n-1] on pool threads (k == 0 runs on
+// the calling thread which also helps with queued tasks while waiting) and
+// returns when all of them are done
+static void threads_run(int n, thread_func_t func, void* that) {
+    thread_task_t tasks[max_threads];
+    n = min(max(n, 1), max_threads);
+    int pending = n;
+    for (int k = 0; k < n; k++) {
+        tasks[k].func = func;
+        tasks[k].that = that;
+        tasks[k].k = k;
+        tasks[k].n = n;
+        tasks[k].pending = &pending;
+        tasks[k].next = k + 1 < n ? &tasks[k + 1] : null;
+    }
+    if (pool.threads == 0) {
+        for (int k = 0; k < n; k++) { func(that, k, n); }
+    } else {
+        mutex_lock(&pool.lock);
+        if (n > 1) {
+            if (pool.tail == null) {
+                pool.head = &tasks[1];
+            } else {
+                pool.tail->next = &tasks[1];
+            }
+            pool.tail = &tasks[n - 1];
+            cond_broadcast(&pool.work);
+        }
+        threads_execute(&tasks[0]);
+        while (pending > 0) {
+            thread_task_t* t = threads_pop();
+            if (t == null) {
+                cond_wait(&pool.done, &pool.lock);
+            } else {
+                threads_execute(t);
+            }
+        }
+        mutex_unlock(&pool.lock);
+    }
+}
+
+// lets stb_image split decoding (e.g. JPEG restart intervals) over the pool
+static void parallel_for(void* unused, stbi_task_func* task, void* data,
+        int count) {
+    (void)unused;
+    threads_run(min(count, pool.threads + 1), task, data);
+}
+
+// per thread output and errors streams, redirected for each request served
+static STBI_THREAD_LOCAL FILE* output_stream;
+static STBI_THREAD_LOCAL FILE* errors_stream;
+
+static FILE* output(void) {
+    return output_stream != null ? output_stream : stdout;
+}
+
+static FILE* errors(void) {
+    return errors_stream != null ? errors_stream : stderr;
+}
+
+// file size and modification time used to validate caches derived from file
+static int file_stamp(const char* fn, uint64_t* size, uint64_t* mtime) {
+    int r = 0;
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(fn, &st) != 0) { r = errno; }
+#else
+    struct stat st;
+    if (stat(fn, &st) != 0) { r = errno; }
+#endif
+    if (r == 0) {
+        *size = (uint64_t)st.st_size;
+        *mtime = (uint64_t)st.st_mtime;
+    }
+    return r;
+}
+
+// "<fn>.<pid>.<sequence>.tmp" differs between processes and between the
+// threads of one process, e.g. serve connections writing the same cache
+static void file_temporary(char* tmp, size_t n, const char* fn) {
+    static volatile long sequence;
+    const long k = atomic_increment(&sequence);
+#ifdef _WIN32
+    snprintf(tmp, n, "%s.%lu.%ld.tmp", fn, GetCurrentProcessId(), k);
+#else
+    snprintf(tmp, n, "%s.%ld.%ld.tmp", fn, (long)getpid(), k);
+#endif
+}
+
+// replaces fn by the temporary file tmp in a single step, returns errno
+static int file_rename(const char* tmp, const char* fn) {
+#ifdef _WIN32
+    return MoveFileExA(tmp, fn, MOVEFILE_REPLACE_EXISTING) ? 0 : EIO;
+#else
+    return rename(tmp, fn) == 0 ? 0 : errno;
+#endif
+}
+
+typedef struct mapping_s {
+    const void* data;
+    size_t bytes;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE map;
+#endif
+} mapping_t;
+
+// read only memory mapping of the whole file, returns errno
+static int file_map(mapping_t* m, const char* fn) {
+    int r = 0;
+    memset(m, 0, sizeof(*m));
+#ifdef _WIN32
+    m->file = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, null,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+    LARGE_INTEGER bytes = { 0 };
+    if (m->file == INVALID_HANDLE_VALUE) {
+        m->file = null;
+        r = ENOENT;
+    } else if (!GetFileSizeEx(m->file, &bytes) || bytes.QuadPart == 0) {
+        r = EINVAL;
+    } else {
+        m->map = CreateFileMappingA(m->file, null, PAGE_READONLY, 0, 0, null);
+        m->data = m->map == null ? null :
+            MapViewOfFile(m->map, FILE_MAP_READ, 0, 0, 0);
+        m->bytes = (size_t)bytes.QuadPart;
+        if (m->data == null) { r = ENOMEM; }
+    }
+    if (r != 0) {
+        if (m->map != null) { CloseHandle(m->map); }
+        if (m->file != null) { CloseHandle(m->file); }
+        memset(m, 0, sizeof(*m));
+    }
+#else
+    int fd = open(fn, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        r = errno;
+    } else if (fstat(fd, &st) != 0) {
+        r = errno;
+    } else if (st.st_size == 0) {
+        r = EINVAL;
+    } else {
+        void* a = mmap(null, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (a == MAP_FAILED) {
+            r = errno;
+        } else {
+            m->data = a;
+            m->bytes = (size_t)st.st_size;
+        }
+    }
+    if (fd >= 0) { close(fd); } // mapping keeps the file referenced
+#endif
+    return r;
+}
+
+static void file_unmap(mapping_t* m) {
+    if (m->data != null) {
+#ifdef _WIN32
+        UnmapViewOfFile(m->data);
+        CloseHandle(m->map);
+        CloseHandle(m->file);
+#else
+        munmap((void*)m->data, m->bytes);
+#endif
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+static double seconds(void) { // monotonic
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) { QueryPerformanceFrequency(&frequency); }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// not cryptographic, only used to tell files apart together with their size
+static uint64_t hash64(const void* data, size_t bytes) {
+    const uint64_t m = 0x9E3779B97F4A7C15ULL;
+    const byte* p = (const byte*)data;
+    uint64_t h = bytes * m;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        h = (h ^ v) * m;
+        h ^= h >> 29;
+    }
+    for (; i < bytes; i++) { h = (h ^ p[i]) * m; }
+    return h ^ (h >> 32);
+}
+
+// Decoded frames cached in directory as "<hash>-<size>-<mtime>.raw" with
+// header padded to a page so that the mapped pixels are page aligned.
+typedef struct frame_header_s {
+    char magic[4];   // "RAW1"
+    uint32_t w;
+    uint32_t h;
+    uint32_t channels;
+    uint32_t depth;  // bits per channel
+    uint32_t stride; // bytes per row
+    uint64_t size;   // of the source file
+    uint64_t mtime;
+    uint64_t hash;
+} frame_header_t;
+
+enum { frame_header_bytes = 4096 };
+
+typedef struct frame_cache_s {
+    const char* dir;  // null if caching is disabled
+    uint64_t limit;   // bytes, least recently used entries are evicted
+} frame_cache_t;
+
+static void frame_cache_entry(char* fn, int count, const frame_cache_t* fc,
+        uint64_t hash, uint64_t size, uint64_t mtime) {
+    snprintf(fn, count, "%s/%016" PRIx64 "-%" PRIx64 "-%" PRIx64 ".raw",
+        fc->dir, hash, size, mtime);
+}
+
+static int frame_cache_touch(const char* fn) { // marks entry recently used
+#ifdef _WIN32
+    return _utime(fn, null);
+#else
+    return utime(fn, null);
+#endif
+}
+
+// maps cached pixels, returns false on any mismatch
+static bool frame_cache_map(mapping_t* m, const char* fn, uint64_t hash,
+        uint64_t size, uint64_t mtime, int w, int h, int c) {
+    bool valid = file_map(m, fn) == 0 && m->bytes >= frame_header_bytes;
+    if (valid) {
+        frame_header_t fh;
+        memcpy(&fh, m->data, sizeof(fh));
+        valid = memcmp(fh.magic, "RAW1", 4) == 0 &&
+            fh.hash == hash && fh.size == size && fh.mtime == mtime &&
+            fh.w == (uint32_t)w && fh.h == (uint32_t)h &&
+            fh.channels == (uint32_t)c && fh.depth == 8 &&
+            fh.stride == (uint32_t)(w * c) &&
+            m->bytes == frame_header_bytes + (size_t)fh.stride * fh.h;
+    }
+    if (valid) {
+        frame_cache_touch(fn);
+    } else {
+        file_unmap(m);
+    }
+    return valid;
+}
+
+typedef struct frame_cache_file_s {
+    char fn[1024];
+    uint64_t bytes;
+    uint64_t mtime;
+} frame_cache_file_t;
+
+static int frame_cache_file_compare(const void* a, const void* b) {
+    const frame_cache_file_t* x = (const frame_cache_file_t*)a;
+    const frame_cache_file_t* y = (const frame_cache_file_t*)b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime ? 1 : 0;
+}
+
+static int frame_cache_list(const frame_cache_t* fc,
+        frame_cache_file_t** files, int* n) {
+    int r = 0;
+    *files = null;
+    *n = 0;
+#ifdef _WIN32
+    char pattern[1024];
+    snprintf(pattern, countof(pattern), "%s/*.raw", fc->dir);
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA(pattern, &fd);
+    bool more = h != INVALID_HANDLE_VALUE;
+    while (r == 0 && more) {
+        const char* name = fd.cFileName;
+#else
+    DIR* d = opendir(fc->dir);
+    struct dirent* de = d == null ? null : readdir(d);
+    while (r == 0 && de != null) {
+        const char* name = de->d_name;
+#endif
+        const size_t k = strlen(name);
+        if (k > 4 && strcmp(name + k - 4, ".raw") == 0) {
+            frame_cache_file_t* a = (frame_cache_file_t*)realloc(*files,
+                (*n + 1) * sizeof(frame_cache_file_t));
+            if (a == null) {
+                r = ENOMEM;
+            } else {
+                *files = a;
+                frame_cache_file_t* f = &a[*n];
+                snprintf(f->fn, countof(f->fn), "%s/%s", fc->dir, name);
+                if (file_stamp(f->fn, &f->bytes, &f->mtime) == 0) { (*n)++; }
+            }
+        }
+#ifdef _WIN32
+        more = FindNextFileA(h, &fd);
+    }
+    if (h != INVALID_HANDLE_VALUE) { FindClose(h); }
+#else
+        de = readdir(d);
+    }
+    if (d != null) { closedir(d); }
+#endif
+    return r;
+}
+
+// removes least recently used entries until the cache fits into its limit
+static void frame_cache_evict(const frame_cache_t* fc, const char* keep) {
+    frame_cache_file_t* files = null;
+    int n = 0;
+    if (frame_cache_list(fc, &files, &n) == 0) {
+        uint64_t total = 0;
+        for (int i = 0; i < n; i++) { total += files[i].bytes; }
+        qsort(files, n, sizeof(frame_cache_file_t), frame_cache_file_compare);
+        for (int i = 0; i < n && total > fc->limit; i++) {
+            if (strcmp(files[i].fn, keep) != 0 && remove(files[i].fn) == 0) {
+                total -= files[i].bytes;
+            }
+        }
+    }
+    free(files);
+}
+
+// writes entry into temporary file and renames it into place so that
+// concurrent readers never see partially written entries
+static int frame_cache_store(const frame_cache_t* fc, const char* fn,
+        const frame_header_t* fh, const byte* data) {
+    int r = 0;
+    char tmp[1100];
+    file_temporary(tmp, countof(tmp), fn);
+    static const byte zeros[frame_header_bytes];
+    const size_t bytes = (size_t)fh->stride * fh->h;
+    FILE* f = fopen(tmp, "wb");
+    if (f == null) {
+        r = errno;
+    } else {
+        if (fwrite(fh, sizeof(*fh), 1, f) != 1 ||
+            fwrite(zeros, frame_header_bytes - sizeof(*fh), 1, f) != 1 ||
+            fwrite(data, 1, bytes, f) != bytes) {
+            r = errno != 0 ? errno : EIO;
+        }
+        if (fclose(f) != 0 && r == 0) { r = errno; }
+        if (r == 0) { r = file_rename(tmp, fn); }
+        if (r != 0) { remove(tmp); }
+    }
+    if (r == 0) { frame_cache_evict(fc, fn); }
+    return r;
+}
+
+// Decoded frames kept in memory between requests while serving. Frames
+// are reference counted and the least recently used unreferenced ones are
+// released when there are too many of them or they take too much memory.
+typedef struct frame_s {
+    char fn[1024];
+    uint64_t size;
+    uint64_t mtime;
+    const byte* data;
+    mapping_t map;  // data is mapped from frame cache if map.data != null
+    size_t bytes;
+    int refs;
+    uint64_t used;  // frames.clock at last use
+} frame_t;
+
+static struct frames_s {
+    bool enabled;
+    mutex_t lock;
+    frame_t* frame[64];
+    int n;
+    uint64_t clock;
+    uint64_t bytes;
+    uint64_t limit;
+} frames;
+
+static void frame_free(frame_t* f) {
+    if (f->map.data != null) {
+        file_unmap(&f->map);
+    } else {
+        stbi_image_free((void*)f->data);
+    }
+    free(f);
+}
+
+static void frames_evict(void) { // frames.lock must be held
+    while (frames.n == countof(frames.frame) || frames.bytes > frames.limit) {
+        int lru = -1;
+        for (int i = 0; i < frames.n; i++) {
+            if (frames.frame[i]->refs == 0 &&
+                (lru < 0 || frames.frame[i]->used < frames.frame[lru]->used)) {
+                lru = i;
+            }
+        }
+        if (lru < 0) { break; } // everything is in use
+        frame_t* f = frames.frame[lru];
+        frames.bytes -= f->bytes;
+        frames.frame[lru] = frames.frame[--frames.n];
+        frame_free(f);
+    }
+}
+
+static frame_t* frames_acquire(const char* fn, uint64_t size, uint64_t mtime) {
+    frame_t* f = null;
+    mutex_lock(&frames.lock);
+    for (int i = 0; f == null && i < frames.n; i++) {
+        frame_t* e = frames.frame[i];
+        if (e->size == size && e->mtime == mtime && strcmp(e->fn, fn) == 0) {
+            f = e;
+            f->refs++;
+            f->used = ++frames.clock;
+        }
+    }
+    mutex_unlock(&frames.lock);
+    return f;
+}
+
+// takes ownership of data (and map); returns null if there is no room
+static frame_t* frames_insert(const char* fn, uint64_t size, uint64_t mtime,
+        const byte* data, mapping_t* map, size_t bytes) {
+    frame_t* f = (frame_t*)calloc(1, sizeof(frame_t));
+    if (f != null && strlen(fn) < countof(f->fn)) {
+        strcpy(f->fn, fn);
+        f->size = size;
+        f->mtime = mtime;
+        f->data = data;
+        f->map = *map;
+        f->bytes = bytes;
+        f->refs = 1;
+        mutex_lock(&frames.lock);
+        frames.bytes += bytes;
+        frames_evict();
+        if (frames.n < (int)countof(frames.frame)) {
+            f->used = ++frames.clock;
+            frames.frame[frames.n++] = f;
+        } else {
+            frames.bytes -= bytes;
+            free(f);
+            f = null;
+        }
+        mutex_unlock(&frames.lock);
+    } else {
+        free(f);
+        f = null;
+    }
+    if (f != null) { memset(map, 0, sizeof(*map)); }
+    return f;
+}
+
+static void frames_release(frame_t* f) {
+    mutex_lock(&frames.lock);
+    f->refs--;
+    frames_evict();
+    mutex_unlock(&frames.lock);
+}
+
+typedef struct image_s {
+    const char* fn;
+    int w;
+    int h;
+    int c;
+    const byte* data; // null until image_decode()
+    int scale;        // JPEG decoded at 1/scale of its size (not cached)
+    bool verify;      // PNG checksums verified on decode (not cached)
+    frame_cache_t cache;
+    mapping_t map;    // data mapped from frame cache
+    frame_t* frame;   // data shared with frames kept in memory
+} image_t;
+
+// reads image dimensions without decoding pixels
+static int image_open(image_t* im, const char* fn, int scale) {
+    int r = 0;
+    memset(im, 0, sizeof(*im));
+    im->fn = fn;
+    im->scale = scale;
+    stbi_set_jpeg_scale_thread(scale);
+    const bool ok = stbi_info(fn, &im->w, &im->h, &im->c);
+    stbi_set_jpeg_scale_thread(1);
+    if (!ok) {
+        fprintf(errors(), "failed to read \"%s\" errno=%d \"%s\" %s\n",
+            fn, errno, strerror(errno), stbi_failure_reason());
+        r = EXIT_FAILURE;
+    } else if (im->c != 1) {
+        fprintf(errors(), "expected 1 byte per pixel instead of %d"
+            " in file \"%s\" %dx%d\n", im->c, fn, im->w, im->h);
+        r = EXIT_FAILURE;
+    }
+    return r;
+}
+
+static int image_decode_file(image_t* im, const void* file, size_t bytes) {
+    int r = 0;
+    int w = 0;
+    int h = 0;
+    int c = 0;
+    stbi_set_jpeg_scale_thread(im->scale);
+    stbi_set_verify_checksums_thread(im->verify);
+    im->data = file != null ?
+        stbi_load_from_memory((const byte*)file, (int)bytes, &w, &h, &c, 1) :
+        stbi_load(im->fn, &w, &h, &c, 1);
+    stbi_set_jpeg_scale_thread(1);
+    stbi_set_verify_checksums_thread(0);
+    if (im->data == null) {
+        fprintf(errors(), "failed to read \"%s\" errno=%d \"%s\" %s\n",
+            im->fn, errno, strerror(errno), stbi_failure_reason());
+        r = EXIT_FAILURE;
+    } else if (w != im->w || h != im->h) { // file changed since open
+        fprintf(errors(), "\"%s\" %dx%d expected %dx%d\n",
+            im->fn, w, h, im->w, im->h);
+        r = EXIT_FAILURE;
+    }
+    return r;
+}
+
+// binary 8-bit PGM pixels are used where they are in the mapped file,
+// which im then keeps mapped
+static bool image_view(image_t* im, mapping_t* file) {
+    int w = 0;
+    int h = 0;
+    int c = 0;
+    int bits = 0;
+    const byte* p = file->bytes > INT_MAX ? null :
+        stbi_pnm_pixels_from_memory((const byte*)file->data,
+            (int)file->bytes, &w, &h, &c, &bits);
+    const bool ok = p != null && c == 1 && bits == 8 &&
+        w == im->w && h == im->h;
+    if (ok) {
+        im->map = *file;
+        im->data = p;
+        memset(file, 0, sizeof(*file));
+    }
+    return ok;
+}
+
+// the file is mapped, binary PGM is used in place; with frame cache enabled
+// the file is hashed, cached pixels are mapped if present and otherwise
+// decoded pixels are stored into the cache
+static int image_decode_cached(image_t* im, bool stamped,
+        uint64_t size, uint64_t mtime) {
+    int r = 0;
+    mapping_t file = { 0 };
+    const bool mapped = file_map(&file, im->fn) == 0;
+    if (mapped && image_view(im, &file)) {
+        // nothing to decode or cache
+    } else if (im->cache.dir == null || !stamped || !mapped) {
+        r = image_decode_file(im, file.data, file.bytes);
+    } else {
+        const uint64_t hash = hash64(file.data, file.bytes);
+        char fn[1024];
+        frame_cache_entry(fn, countof(fn), &im->cache, hash, size, mtime);
+        if (frame_cache_map(&im->map, fn, hash, size, mtime,
+                            im->w, im->h, 1)) {
+            im->data = (const byte*)im->map.data + frame_header_bytes;
+        } else {
+            r = image_decode_file(im, file.data, file.bytes);
+            if (r == 0) {
+                frame_header_t fh;
+                memset(&fh, 0, sizeof(fh));
+                memcpy(fh.magic, "RAW1", 4);
+                fh.w = (uint32_t)im->w;
+                fh.h = (uint32_t)im->h;
+                fh.channels = 1;
+                fh.depth = 8;
+                fh.stride = (uint32_t)im->w;
+                fh.size = size;
+                fh.mtime = mtime;
+                fh.hash = hash;
+                // failure to cache is not fatal
+                frame_cache_store(&im->cache, fn, &fh, im->data);
+            }
+        }
+    }
+    file_unmap(&file);
+    return r;
+}
+
+static int image_decode(image_t* im) {
+    int r = 0;
+    if (im->data == null && im->scale > 1) {
+        r = image_decode_file(im, null, 0); // cheap, not worth caching
+    } else if (im->data == null && im->verify) {
+        r = image_decode_file(im, null, 0); // the file itself is checked
+    } else if (im->data == null) {
+        uint64_t size = 0;
+        uint64_t mtime = 0;
+        const bool stamped = file_stamp(im->fn, &size, &mtime) == 0;
+        const bool shared = frames.enabled && stamped;
+        if (shared) { im->frame = frames_acquire(im->fn, size, mtime); }
+        if (im->frame != null) {
+            im->data = im->frame->data;
+        } else {
+            r = image_decode_cached(im, stamped, size, mtime);
+            if (r == 0 && shared) {
+                im->frame = frames_insert(im->fn, size, mtime, im->data,
+                    &im->map, (size_t)im->w * im->h);
+            }
+        }
+    }
+    return r;
+}
+
+// 1-bit grayscale PNG masks decode to packed rows, 8 times smaller than
+// pixels, which histograms count without unpacking; null for other images
+static byte* image_bitmap(image_t* im) {
+    byte* bits = null;
+    mapping_t file = { 0 };
+    if (file_map(&file, im->fn) == 0 && file.bytes <= INT_MAX) {
+        int w = 0;
+        int h = 0;
+        stbi_set_verify_checksums_thread(im->verify);
+        bits = stbi_png_bitmap_from_memory((const byte*)file.data,
+            (int)file.bytes, &w, &h);
+        stbi_set_verify_checksums_thread(0);
+        if (bits != null && (w != im->w || h != im->h)) { // file changed
+            stbi_image_free(bits);
+            bits = null;
+        }
+    }
+    file_unmap(&file);
+    return bits;
+}
+
+static void image_close(image_t* im) {
+    if (im->frame != null) {
+        frames_release(im->frame);
+    } else if (im->map.data != null) {
+        file_unmap(&im->map);
+    } else if (im->data != null) {
+        stbi_image_free((void*)im->data);
+    }
+    memset(im, 0, sizeof(*im));
+}
+
 static void dump(const byte* data, int x, int y, int w, int h, int stride) {
-    printf("(%d,%d) %dx%d\n", x, y, w, h);
+    fprintf(output(), "(%d,%d) %dx%d\n", x, y, w, h);
     for (int i = y; i < y + h; i++) {
         for (int j = x; j < x + w; j++) {
             int ix = i * stride + j;
-            printf("0x%02X ", data[ix]);
+            fprintf(output(), "0x%02X ", data[ix]);
         }
-        printf("\n");
+        fprintf(output(), "\n");
     }
 }
 
-static void histogram(const byte* data, int x, int y, int w, int h, int stride) {
-    int histogram[256] = { 0 };
-    for (int i = y; i < y + h; i++) {
-        for (int j = x; j < x + w; j++) {
-            int ix = i * stride + j;
-            histogram[data[ix]]++;
+typedef struct histograms_s {
+    const byte* data;
+    int stride;
+    bool packed; // 1-bit rows, 8 pixels a byte, counted as 0 and 255
+    const roi_t* rois;
+    int n;      // number of rois
+    int y0;     // union of all rois rows [y0..y1[
+    int y1;
+    int* counts; // [threads][n][256]
+} histograms_t;
+
+static int popcount64(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// set bits among the w pixels from x on of a packed row, leftmost pixel of
+// each byte in its high bit: only the first and last bytes need masking,
+// the ones between are counted 8 bytes at a time
+static int bits_count(const byte* row, int x, int w) {
+    if (w == 0) { return 0; }
+    const byte* p = row + x / 8;
+    const byte* e = row + (x + w - 1) / 8;
+    const byte first = (byte)(0xFF >> (x % 8));
+    const byte last = (byte)(0xFF << (7 - (x + w - 1) % 8));
+    if (p == e) { return popcount64(*p & first & last); }
+    int count = popcount64(*p++ & first);
+    for (; p + 8 <= e; p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        count += popcount64(v);
+    }
+    while (p < e) { count += popcount64(*p++); }
+    return count + popcount64(*e & last);
+}
+
+static void histograms_band(void* that, int k, int n) {
+    histograms_t* hs = (histograms_t*)that;
+    const int rows = hs->y1 - hs->y0;
+    const int y0 = hs->y0 + (int)((int64_t)rows * k / n);
+    const int y1 = hs->y0 + (int)((int64_t)rows * (k + 1) / n);
+    int* counts = hs->counts + (size_t)k * hs->n * 256;
+    for (int i = y0; i < y1; i++) {
+        // each row is read from memory once and shared by all the rois
+        // that cross it
+        const byte* row = hs->data + (size_t)i * hs->stride;
+        for (int r = 0; r < hs->n; r++) {
+            const roi_t* roi = &hs->rois[r];
+            if (roi->y <= i && i < roi->y + roi->h) {
+                int* histogram = counts + (size_t)r * 256;
+                if (hs->packed) {
+                    const int ones = bits_count(row, roi->x, roi->w);
+                    histogram[255] += ones;
+                    histogram[0] += roi->w - ones;
+                } else {
+                    const byte* p = row + roi->x;
+                    const byte* e = p + roi->w;
+                    while (p < e) { histogram[*p++]++; }
+                }
+            }
         }
     }
-    for (int i = 0; i < countof(histogram); i++) {
-        printf("%d, %d\n", i, histogram[i]);
+}
+
+static void histogram_print(const int* histogram) {
+    for (int i = 0; i < 256; i++) {
+        fprintf(output(), "%d, %d\n", i, histogram[i]);
     }
 }
 
+// single pass over the union of the rois rows split into bands across threads
+static int histograms(const byte* data, int stride, bool packed,
+        const roi_t* rois, int n) {
+    histograms_t hs = { 0 };
+    hs.data = data;
+    hs.stride = stride;
+    hs.packed = packed;
+    hs.rois = rois;
+    hs.n = n;
+    hs.y0 = INT32_MAX;
+    hs.y1 = 0;
+    for (int r = 0; r < n; r++) {
+        hs.y0 = min(hs.y0, rois[r].y);
+        hs.y1 = max(hs.y1, rois[r].y + rois[r].h);
+    }
+    const int rows = max(hs.y1 - hs.y0, 0);
+    // do not bother waking up a thread for less than 64 rows
+    const int threads = max(1, min(cpu_count(), rows / 64));
+    hs.counts = (int*)calloc((size_t)threads * n * 256, sizeof(int));
+    if (hs.counts == null) {
+        fprintf(errors(), "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (rows > 0) { threads_run(threads, histograms_band, &hs); }
+    for (int k = 1; k < threads; k++) { // reduce into thread 0 counts
+        const int* counts = hs.counts + (size_t)k * n * 256;
+        for (int i = 0; i < n * 256; i++) { hs.counts[i] += counts[i]; }
+    }
+    for (int r = 0; r < n; r++) {
+        if (n > 1) {
+            fprintf(output(), "(%d,%d) %dx%d\n", rois[r].x, rois[r].y, rois[r].w, rois[r].h);
+        }
+        histogram_print(hs.counts + (size_t)r * 256);
+    }
+    free(hs.counts);
+    return 0;
+}
+
+typedef struct tile_stats_s {
+    uint64_t sum;
+    uint64_t sum2;  // sum of squares
+    int min;
+    int max;
+} tile_stats_t;
+
+// accumulates n bytes of a single tile row into ts; the SSE2 kernel is
+// chosen at run time like the stb_image ones so that --cpu caps it too
+static void tile_stats_row(const byte* p, int n, tile_stats_t* ts) {
+    int i = 0;
+    uint64_t sum = 0;
+    uint64_t sum2 = 0;
+    int mn = ts->min;
+    int mx = ts->max;
+#ifdef STBI_SSE2
+    if (n >= 16 && stbi_simd_level() >= STBI_SIMD_SSE2) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i vsum = zero;
+        __m128i vmin = _mm_set1_epi8((char)0xFF);
+        __m128i vmax = zero;
+        while (i + 16 <= n) {
+            // 32-bit lanes of squares are flushed every 4096 iterations:
+            // 4096 * 2 * 255^2 < 2^31
+            __m128i vsq = zero;
+            const int end = min(n, i + 4096 * 16);
+            for (; i + 16 <= end; i += 16) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+                const __m128i lo = _mm_unpacklo_epi8(v, zero);
+                const __m128i hi = _mm_unpackhi_epi8(v, zero);
+                vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+                vsq = _mm_add_epi32(vsq, _mm_madd_epi16(lo, lo));
+                vsq = _mm_add_epi32(vsq, _mm_madd_epi16(hi, hi));
+                vmin = _mm_min_epu8(vmin, v);
+                vmax = _mm_max_epu8(vmax, v);
+            }
+            uint32_t sq[4];
+            _mm_storeu_si128((__m128i*)sq, vsq);
+            sum2 += (uint64_t)sq[0] + sq[1] + sq[2] + sq[3];
+        }
+        uint64_t s[2];
+        byte b0[16];
+        byte b1[16];
+        _mm_storeu_si128((__m128i*)s, vsum);
+        _mm_storeu_si128((__m128i*)b0, vmin);
+        _mm_storeu_si128((__m128i*)b1, vmax);
+        sum += s[0] + s[1];
+        for (int k = 0; k < 16; k++) {
+            mn = min(mn, b0[k]);
+            mx = max(mx, b1[k]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        const int v = p[i];
+        sum += v;
+        sum2 += (uint64_t)(v * v);
+        mn = min(mn, v);
+        mx = max(mx, v);
+    }
+    ts->sum += sum;
+    ts->sum2 += sum2;
+    ts->min = mn;
+    ts->max = mx;
+}
+
+typedef struct tiles_s {
+    const byte* data;
+    int stride;
+    roi_t roi;
+    int tw;          // tile width and height
+    int th;
+    int cols;        // number of tiles horizontally and vertically
+    int rows;
+    double percentile; // < 0 if not requested
+    float* out;      // [rows][cols][fields]
+    int fields;
+    int* histograms; // [threads][cols][256] only if percentile requested
+} tiles_t;
+
+static void tiles_band(void* that, int k, int n) {
+    tiles_t* ts = (tiles_t*)that;
+    const int r0 = (int)((int64_t)ts->rows * k / n);
+    const int r1 = (int)((int64_t)ts->rows * (k + 1) / n);
+    tile_stats_t stats[256];
+    int* histograms = ts->histograms == null ? null :
+        ts->histograms + (size_t)k * ts->cols * 256;
+    // one band of tiles at a time, at most countof(stats) columns wide, so
+    // that the accumulators stay in L1 while the rows stream through
+    for (int tr = r0; tr < r1; tr++) {
+        const int y0 = ts->roi.y + tr * ts->th;
+        const int y1 = min(y0 + ts->th, ts->roi.y + ts->roi.h);
+        for (int c0 = 0; c0 < ts->cols; c0 += countof(stats)) {
+            const int c1 = min(c0 + (int)countof(stats), ts->cols);
+            for (int tc = c0; tc < c1; tc++) {
+                stats[tc - c0].sum = 0;
+                stats[tc - c0].sum2 = 0;
+                stats[tc - c0].min = 255;
+                stats[tc - c0].max = 0;
+            }
+            if (histograms != null) {
+                memset(histograms, 0, (size_t)(c1 - c0) * 256 * sizeof(int));
+            }
+            for (int i = y0; i < y1; i++) {
+                const byte* row = ts->data + (size_t)i * ts->stride + ts->roi.x;
+                for (int tc = c0; tc < c1; tc++) {
+                    const int x0 = tc * ts->tw;
+                    const int w = min(ts->tw, ts->roi.w - x0);
+                    tile_stats_row(row + x0, w, &stats[tc - c0]);
+                    if (histograms != null) {
+                        int* histogram = histograms + (size_t)(tc - c0) * 256;
+                        for (int j = 0; j < w; j++) { histogram[row[x0 + j]]++; }
+                    }
+                }
+            }
+            for (int tc = c0; tc < c1; tc++) {
+                const tile_stats_t* s = &stats[tc - c0];
+                const int w = min(ts->tw, ts->roi.w - tc * ts->tw);
+                const double count = (double)w * (y1 - y0);
+                const double mean = s->sum / count;
+                float* f = ts->out + ((size_t)tr * ts->cols + tc) * ts->fields;
+                f[0] = (float)mean;
+                f[1] = (float)max(0.0, s->sum2 / count - mean * mean);
+                f[2] = (float)s->min;
+                f[3] = (float)s->max;
+                if (histograms != null) { // nearest rank percentile
+                    const int* histogram = histograms + (size_t)(tc - c0) * 256;
+                    double rank = ts->percentile / 100.0 * count;
+                    if (rank < 1) { rank = 1; }
+                    int64_t seen = 0;
+                    int v = 0;
+                    while (v < 255 && (seen += histogram[v]) < rank) { v++; }
+                    f[4] = (float)v;
+                }
+            }
+        }
+    }
+}
+
+// Per tile mean, variance, min, max and optionally percentile of each roi
+// split into tw x th tiles (tiles at the right and bottom edges may be
+// smaller). Written as CSV to stdout or as binary grid into file "bin":
+//   "TILE" uint32 cols, rows, tw, th, fields; float[rows][cols][fields]
+static int tilestats(const byte* data, int stride, const roi_t* rois, int n,
+        int tw, int th, double percentile, const char* bin) {
+    int r = 0;
+    FILE* f = null;
+    if (bin != null) {
+        f = fopen(bin, "wb");
+        if (f == null) {
+            fprintf(errors(), "failed to create \"%s\" errno=%d \"%s\"\n",
+                bin, errno, strerror(errno));
+            r = EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; r == 0 && i < n; i++) {
+        tiles_t ts = { 0 };
+        ts.data = data;
+        ts.stride = stride;
+        ts.roi = rois[i];
+        ts.tw = tw;
+        ts.th = th;
+        // w + tw - 1 would overflow for tiles as large as INT_MAX
+        ts.cols = rois[i].w / tw + (rois[i].w % tw != 0);
+        ts.rows = rois[i].h / th + (rois[i].h % th != 0);
+        ts.percentile = percentile;
+        ts.fields = percentile >= 0 ? 5 : 4;
+        const int threads = max(1, min(cpu_count(), ts.rows));
+        ts.out = (float*)malloc((size_t)ts.rows * ts.cols * ts.fields * sizeof(float));
+        if (percentile >= 0) {
+            ts.histograms = (int*)malloc((size_t)threads *
+                min(ts.cols, 256) * 256 * sizeof(int));
+        }
+        if (ts.out == null || (percentile >= 0 && ts.histograms == null)) {
+            fprintf(errors(), "out of memory\n");
+            r = EXIT_FAILURE;
+        } else {
+            if (ts.rows > 0 && ts.cols > 0) {
+                threads_run(threads, tiles_band, &ts);
+            }
+            if (f != null) {
+                const uint32_t header[5] = { (uint32_t)ts.cols, (uint32_t)ts.rows,
+                    (uint32_t)tw, (uint32_t)th, (uint32_t)ts.fields };
+                const size_t count = (size_t)ts.rows * ts.cols * ts.fields;
+                if (fwrite("TILE", 4, 1, f) != 1 ||
+                    fwrite(header, sizeof(header), 1, f) != 1 ||
+                    fwrite(ts.out, sizeof(float), count, f) != count) {
+                    fprintf(errors(), "failed to write \"%s\"\n", bin);
+                    r = EXIT_FAILURE;
+                }
+            } else {
+                if (n > 1) {
+                    fprintf(output(), "(%d,%d) %dx%d\n", rois[i].x, rois[i].y,
+                        rois[i].w, rois[i].h);
+                }
+                fprintf(output(), "col, row, mean, variance, min, max");
+                if (percentile >= 0) { fprintf(output(), ", p%g", percentile); }
+                fprintf(output(), "\n");
+                for (int tr = 0; tr < ts.rows; tr++) {
+                    for (int tc = 0; tc < ts.cols; tc++) {
+                        const float* v = ts.out +
+                            ((size_t)tr * ts.cols + tc) * ts.fields;
+                        fprintf(output(), "%d, %d, %.3f, %.3f, %d, %d", tc, tr,
+                            v[0], v[1], (int)v[2], (int)v[3]);
+                        if (percentile >= 0) { fprintf(output(), ", %d", (int)v[4]); }
+                        fprintf(output(), "\n");
+                    }
+                }
+            }
+        }
+        free(ts.histograms);
+        free(ts.out);
+    }
+    if (f != null && fclose(f) != 0 && r == 0) {
+        fprintf(errors(), "failed to write \"%s\"\n", bin);
+        r = EXIT_FAILURE;
+    }
+    return r;
+}
+
+// Summed area tables of pixel values and their squares (w + 1) x (h + 1)
+// with zero top row and left column so that any rectangle sum is
+// t[y1][x1] - t[y0][x1] - t[y1][x0] + t[y0][x0].
+// Cached beside the image file as "<filename>.sat":
+//   "SAT1" uint32 w, h, 0; uint64 file size, mtime; sum[]; sum2[]
+typedef struct integral_s {
+    int w;
+    int h;
+    const uint64_t* sum;
+    const uint64_t* sum2;
+    uint64_t* heap;  // when built in memory
+    mapping_t map;   // when mapped from cache file
+} integral_t;
+
+enum { integral_header_bytes = 32 };
+
+static int integral_build(integral_t* it, const byte* data, int w, int h) {
+    int r = 0;
+    memset(it, 0, sizeof(*it));
+    const size_t count = (size_t)(w + 1) * (h + 1);
+    it->heap = (uint64_t*)calloc(count * 2, sizeof(uint64_t));
+    if (it->heap == null) {
+        fprintf(errors(), "out of memory\n");
+        r = EXIT_FAILURE;
+    } else {
+        uint64_t* sum = it->heap;
+        uint64_t* sum2 = it->heap + count;
+        for (int i = 0; i < h; i++) {
+            const byte* row = data + (size_t)i * w;
+            const uint64_t* s0 = sum + (size_t)i * (w + 1);
+            const uint64_t* q0 = sum2 + (size_t)i * (w + 1);
+            uint64_t* s1 = sum + (size_t)(i + 1) * (w + 1);
+            uint64_t* q1 = sum2 + (size_t)(i + 1) * (w + 1);
+            uint64_t rs = 0; // running row sums
+            uint64_t rq = 0;
+            for (int j = 0; j < w; j++) {
+                rs += row[j];
+                rq += (uint64_t)(row[j] * row[j]);
+                s1[j + 1] = s0[j + 1] + rs;
+                q1[j + 1] = q0[j + 1] + rq;
+            }
+        }
+        it->w = w;
+        it->h = h;
+        it->sum = sum;
+        it->sum2 = sum2;
+    }
+    return r;
+}
+
+static void integral_free(integral_t* it) {
+    if (it->heap != null) { free(it->heap); }
+    file_unmap(&it->map);
+    memset(it, 0, sizeof(*it));
+}
+
+static bool integral_map(integral_t* it, const char* fn,
+        int w, int h, uint64_t size, uint64_t mtime) {
+    memset(it, 0, sizeof(*it));
+    const size_t count = (size_t)(w + 1) * (h + 1);
+    bool valid = file_map(&it->map, fn) == 0 &&
+        it->map.bytes == integral_header_bytes + count * 2 * sizeof(uint64_t);
+    if (valid) {
+        const byte* p = (const byte*)it->map.data;
+        uint32_t dims[3];
+        uint64_t stamp[2];
+        memcpy(dims, p + 4, sizeof(dims));
+        memcpy(stamp, p + 16, sizeof(stamp));
+        valid = memcmp(p, "SAT1", 4) == 0 &&
+            dims[0] == (uint32_t)w && dims[1] == (uint32_t)h &&
+            stamp[0] == size && stamp[1] == mtime;
+    }
+    if (valid) {
+        it->w = w;
+        it->h = h;
+        it->sum = (const uint64_t*)((const byte*)it->map.data +
+                                    integral_header_bytes);
+        it->sum2 = it->sum + count;
+    } else {
+        file_unmap(&it->map);
+    }
+    return valid;
+}
+
+// written into a temporary file renamed into place, like cached frames, so
+// that concurrent requests never map a partially written table
+static int integral_save(const integral_t* it, const char* fn,
+        uint64_t size, uint64_t mtime) {
+    int r = 0;
+    const size_t count = (size_t)(it->w + 1) * (it->h + 1);
+    const uint32_t dims[3] = { (uint32_t)it->w, (uint32_t)it->h, 0 };
+    const uint64_t stamp[2] = { size, mtime };
+    char tmp[1100];
+    file_temporary(tmp, countof(tmp), fn);
+    FILE* f = fopen(tmp, "wb");
+    if (f == null) {
+        r = errno;
+    } else {
+        if (fwrite("SAT1", 4, 1, f) != 1 ||
+            fwrite(dims, sizeof(dims), 1, f) != 1 ||
+            fwrite(stamp, sizeof(stamp), 1, f) != 1 ||
+            fwrite(it->sum, sizeof(uint64_t), count, f) != count ||
+            fwrite(it->sum2, sizeof(uint64_t), count, f) != count) {
+            r = errno != 0 ? errno : EIO;
+        }
+        if (fclose(f) != 0 && r == 0) { r = errno; }
+        if (r == 0) { r = file_rename(tmp, fn); }
+        if (r != 0) { remove(tmp); }
+    }
+    if (r != 0) {
+        fprintf(errors(), "failed to write \"%s\" errno=%d \"%s\"\n",
+            fn, r, strerror(r));
+    }
+    return r;
+}
+
+// maps "<filename>.sat" if it is up to date, otherwise decodes the image,
+// builds integral image and (if persist) writes it to the cache file
+static int integral_open(integral_t* it, image_t* im, bool persist) {
+    int r = 0;
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    char fn[1024];
+    snprintf(fn, countof(fn), "%s.sat", im->fn);
+    const bool stamped = file_stamp(im->fn, &size, &mtime) == 0;
+    if (!persist || !stamped ||
+        !integral_map(it, fn, im->w, im->h, size, mtime)) {
+        r = image_decode(im);
+        if (r == 0) { r = integral_build(it, im->data, im->w, im->h); }
+        if (r == 0 && persist && stamped) {
+            integral_save(it, fn, size, mtime); // failure is not fatal
+        }
+    }
+    return r;
+}
+
+static void integral_query(const integral_t* it, const roi_t* roi,
+        double* mean, double* variance) {
+    const size_t stride = (size_t)it->w + 1;
+    const size_t i0 = (size_t)roi->y * stride + roi->x;
+    const size_t i1 = (size_t)(roi->y + roi->h) * stride + roi->x;
+    const size_t w = (size_t)roi->w;
+    // unsigned wrap around in intermediate results is harmless
+    const uint64_t s = it->sum[i1 + w] - it->sum[i0 + w] -
+                       it->sum[i1] + it->sum[i0];
+    const uint64_t q = it->sum2[i1 + w] - it->sum2[i0 + w] -
+                       it->sum2[i1] + it->sum2[i0];
+    const double count = (double)roi->w * roi->h;
+    *mean = count > 0 ? s / count : 0;
+    *variance = count > 0 ? max(0.0, q / count - *mean * *mean) : 0;
+}
+
+static void stats_print(const roi_t* roi, double mean, double variance) {
+    fprintf(output(), "(%d,%d) %dx%d mean %.3f variance %.3f\n",
+        roi->x, roi->y, roi->w, roi->h, mean, variance);
+}
+
 static int args_option_index(int argc, const char* argv[], const char* option) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--") == 0) { break; } // no options after '--'
@@ -58,83 +1317,932 @@ static int args_remove_at(int ix, int argc, const char* argv[]) { // returns new
     return argc - 1;
 }
 
-static int parse_roi(int *argc, const char* argv[], 
-       int *rx, int *ry, int *rw, int *rh, int iw, int ih) {
-    int r = 0;
-    int ix = args_option_index(*argc, argv, "--roi");
+// removes "option value" pair from the arguments, returns null if option
+// is not present and "" if the value is missing
+static const char* args_option_value(int* argc, const char* argv[],
+        const char* option) {
+    const char* v = null;
+    int ix = args_option_index(*argc, argv, option);
     if (ix >= 0) {
-        if (*argc < ix + 1) {
-            perror("expected --roi X,Y:WxH");
+        v = ix + 1 < *argc ? argv[ix + 1] : "";
+        *argc = args_remove_at(ix, *argc, argv);
+        if (ix < *argc) { *argc = args_remove_at(ix, *argc, argv); }
+    }
+    return v;
+}
+
+// decimal int after optional blanks at *s, advances *s past it; false if
+// there are no digits or the value does not fit an int (which sscanf "%d"
+// leaves undefined)
+static bool parse_int(const char** s, int* v) {
+    char* e = null;
+    errno = 0;
+    const long n = strtol(*s, &e, 10);
+    if (e == *s || errno == ERANGE || n < INT_MIN || n > INT_MAX) {
+        return false;
+    }
+    *v = (int)n;
+    *s = e;
+    return true;
+}
+
+// "WxH" as in "--tile 32x32" and the size of a roi
+static bool parse_size(const char** s, int* w, int* h) {
+    return parse_int(s, w) && *(*s)++ == 'x' && parse_int(s, h);
+}
+
+static int roi_parse(roi_t* roi, const char* s, int iw, int ih) {
+    int r = 0;
+    int x = 0;
+    int y = 0;
+    int w = 0;
+    int h = 0;
+    const char* p = s;
+    if (!parse_int(&p, &x) || *p++ != ',' || !parse_int(&p, &y) ||
+        *p++ != ':' || !parse_size(&p, &w, &h)) {
+        fprintf(errors(), "expected X,Y:WxH instead of \"%s\"\n", s);
+        r = EXIT_FAILURE;
+    } else if (0 <= x && x <= iw && 0 <= w && w <= iw - x &&
+               0 <= y && y <= ih && 0 <= h && h <= ih - y) {
+        // x + w and y + h could overflow for huge w and h
+        roi->x = x;
+        roi->y = y;
+        roi->w = w;
+        roi->h = h;
+    } else {
+        fprintf(errors(), "%d,%d:%dx%d out of [%d][%d] range\n",
+            x, y, w, h, iw, ih);
+        r = EXIT_FAILURE;
+    }
+    return r;
+}
+
+static int roi_append(roi_t** rois, int* n, const char* s, int iw, int ih) {
+    roi_t roi = { 0 };
+    int r = roi_parse(&roi, s, iw, ih);
+    if (r == 0) {
+        roi_t* a = (roi_t*)realloc(*rois, (*n + 1) * sizeof(roi_t));
+        if (a == null) {
+            fprintf(errors(), "out of memory\n");
             r = EXIT_FAILURE;
-        } else { // function does not touch *rx, *ry, *rw, *rh on failure
-            int x = 0;
-            int y = 0;
-            int w = 0;
-            int h = 0;
-            if (sscanf(argv[ix + 1], "%d,%d:%dx%d", &x, &y, &w, &h) != 4) {
-                perror("expected --roi X,Y:WxH");
+        } else {
+            a[*n] = roi;
+            *rois = a;
+            (*n)++;
+        }
+    }
+    return r;
+}
+
+// file with one X,Y:WxH per line, empty lines and lines starting with '#'
+// are ignored
+static int roi_file_read(roi_t** rois, int* n, const char* fn, int iw, int ih) {
+    int r = 0;
+    FILE* f = fopen(fn, "r");
+    if (f == null) {
+        fprintf(errors(), "failed to open \"%s\" errno=%d \"%s\"\n",
+            fn, errno, strerror(errno));
+        r = EXIT_FAILURE;
+    } else {
+        char line[256];
+        while (r == 0 && fgets(line, countof(line), f) != null) {
+            const char* s = line;
+            while (*s == ' ' || *s == '\t') { s++; }
+            if (*s != '#' && *s != '\r' && *s != '\n' && *s != 0) {
+                r = roi_append(rois, n, s, iw, ih);
+            }
+        }
+        fclose(f);
+    }
+    return r;
+}
+
+// collects all "--roi X,Y:WxH" and "--rois filename" options in the order
+// they are present on the command line; *rois must be free()-ed by caller
+static int parse_roi(int *argc, const char* argv[],
+       roi_t** rois, int* n, int iw, int ih) {
+    int r = 0;
+    bool found = true;
+    while (r == 0 && found) {
+        int ix = args_option_index(*argc, argv, "--roi");
+        int fx = args_option_index(*argc, argv, "--rois");
+        found = ix >= 0 || fx >= 0;
+        if (found) {
+            const bool file = ix < 0 || (fx >= 0 && fx < ix);
+            if (file) { ix = fx; }
+            if (ix + 1 >= *argc) {
+                fprintf(errors(), file ? "expected --rois filename\n" :
+                                       "expected --roi X,Y:WxH\n");
                 r = EXIT_FAILURE;
-            } else if (0 <= x && x + w <= iw && 0 <= y && y + h <= ih) {
-                *argc = args_remove_at(ix, *argc, argv); // removes "--roi"
-                *argc = args_remove_at(ix, *argc, argv); // removes "X,Y:WxH"
-                *rx = x;
-                *ry = y;
-                *rw = w;
-                *rh = h;
             } else {
-                fprintf(stderr, "%d,%d:%d:%d out of [%d][%d] range\n", 
-                    x, y, w, h, iw, ih);
-                r = EXIT_FAILURE;
+                r = file ? roi_file_read(rois, n, argv[ix + 1], iw, ih) :
+                           roi_append(rois, n, argv[ix + 1], iw, ih);
+                *argc = args_remove_at(ix, *argc, argv); // removes option
+                *argc = args_remove_at(ix, *argc, argv); // removes value
             }
         }
     }
     return r;
 }
 
+// removes boolean option from the arguments, returns true if it was present
+static bool args_option_flag(int* argc, const char* argv[], const char* option) {
+    int ix = args_option_index(*argc, argv, option);
+    if (ix >= 0) { *argc = args_remove_at(ix, *argc, argv); }
+    return ix >= 0;
+}
+
+// cache limits in MB are converted to uint64_t bytes, NaN and infinity
+// must not get that far
+enum { max_megabytes = 1 << 30 };
+
+// "--cache directory" (or PNGDUMP_CACHE environment variable) enables
+// decoded frames cache, "--cache-limit MB" bounds it (default 1024MB)
+static int parse_cache(int *argc, const char* argv[], frame_cache_t* fc) {
+    int r = 0;
+    const char* dir = args_option_value(argc, argv, "--cache");
+    const char* limit = args_option_value(argc, argv, "--cache-limit");
+    double mb = 1024;
+    if (dir == null) { dir = getenv("PNGDUMP_CACHE"); }
+    if (dir != null && dir[0] == 0) {
+        fprintf(errors(), "expected --cache directory\n");
+        r = EXIT_FAILURE;
+    } else if (limit != null && (sscanf(limit, "%lf", &mb) != 1 ||
+                                 !(0 <= mb && mb <= max_megabytes))) {
+        fprintf(errors(), "expected --cache-limit MB instead of \"%s\"\n", limit);
+        r = EXIT_FAILURE;
+    } else {
+        fc->dir = dir;
+        fc->limit = (uint64_t)(mb * 1024 * 1024);
+    }
+    return r;
+}
+
+// "--scale 1/N" decodes JPEG images at 1/2, 1/4 or 1/8 of their size
+static int parse_scale(int *argc, const char* argv[], int* scale) {
+    int r = 0;
+    const char* v = args_option_value(argc, argv, "--scale");
+    const char* p = v != null && strncmp(v, "1/", 2) == 0 ? v + 2 : null;
+    *scale = 1;
+    if (v != null && (p == null || !parse_int(&p, scale) ||
+                      (*scale != 1 && *scale != 2 && *scale != 4 && *scale != 8))) {
+        fprintf(errors(), "expected --scale 1/1|1/2|1/4|1/8 instead of \"%s\"\n", v);
+        r = EXIT_FAILURE;
+    }
+    return r;
+}
+
 static int usage() {
-    fprintf(stderr, "pngdump [--roi X,Y:WxH] dump|histogram\n");
+    fprintf(errors(), "pngdump [--file filename] [--verify] "
+                      "[--cache directory [--cache-limit MB]] "
+                      "[--roi X,Y:WxH]... [--rois filename] "
+                      "dump|histogram|tilestats|stats|repl\n"
+                      "--file takes PNG, JPEG, PGM (P2, P5) and other formats "
+                      "stb_image reads, binary PGM is used in place\n"
+                      "--verify checks PNG chunk CRCs and zlib Adler-32, "
+                      "bypassing caches\n"
+                      "histogram [--scale 1/N] decodes JPEG at 1/2, 1/4 or 1/8 size, "
+                      "counts 1-bit PNG masks without unpacking them\n"
+                      "tilestats [--tile WxH] [--percentile P] [--bin filename]\n"
+                      "stats|repl [--integral]\n"
+                      "repl reads X,Y:WxH lines from stdin\n"
+                      "pngdump serve --socket path [--memory-limit MB]\n"
+                      "pngdump --socket path <arguments> sends request to server\n"
+                      "pngdump bench [--iterations N] filename... "
+                      "times decoding at each SIMD level and with --verify, "
+                      "checks gamma and that corrupt restart interval JPEGs "
+                      "decode the same in parallel\n"
+                      "pngbench times stages against a baseline and "
+                      "generates a synthetic corpus\n"
+                      "pngdump frames --file filename [--roi X,Y:WxH]... "
+                      "histograms each frame of animated GIF\n"
+                      "--cpu scalar|sse2|ssse3|sse4.1|avx2|avx512 "
+                      "caps the SIMD level of any command, of the server "
+                      "with serve but not of --socket requests\n");
     return EXIT_FAILURE;
 }
 
-int main(int argc, const char* argv[]) {
+static int tilestats_command(int* argc, const char* argv[],
+        const byte* data, int stride, const roi_t* rois, int n) {
+    int r = 0;
+    int tw = 32;
+    int th = 32;
+    double percentile = -1;
+    const char* tile = args_option_value(argc, argv, "--tile");
+    const char* pct = args_option_value(argc, argv, "--percentile");
+    const char* bin = args_option_value(argc, argv, "--bin");
+    const char* p = tile;
+    if (tile != null && (!parse_size(&p, &tw, &th) || tw <= 0 || th <= 0)) {
+        fprintf(errors(), "expected --tile WxH instead of \"%s\"\n", tile);
+        r = usage();
+    } else if (pct != null && (sscanf(pct, "%lf", &percentile) != 1 ||
+                               !(0 <= percentile && percentile <= 100))) {
+        fprintf(errors(), "expected --percentile [0..100] instead of \"%s\"\n", pct);
+        r = usage();
+    } else if (bin != null && bin[0] == 0) {
+        fprintf(errors(), "expected --bin filename\n");
+        r = usage();
+    } else {
+        r = tilestats(data, stride, rois, n, tw, th, percentile, bin);
+    }
+    return r;
+}
+
+// mean and variance of each roi; with "--integral" from the summed area
+// table cached beside the image (decode is skipped if the cache is valid)
+static int stats_command(int* argc, const char* argv[], image_t* im,
+        const roi_t* rois, int n) {
+    int r = 0;
+    if (args_option_flag(argc, argv, "--integral")) {
+        integral_t it = { 0 };
+        r = integral_open(&it, im, true);
+        for (int i = 0; r == 0 && i < n; i++) {
+            double mean = 0;
+            double variance = 0;
+            integral_query(&it, &rois[i], &mean, &variance);
+            stats_print(&rois[i], mean, variance);
+        }
+        integral_free(&it);
+    } else {
+        r = image_decode(im);
+        for (int i = 0; r == 0 && i < n; i++) {
+            tile_stats_t ts = { 0, 0, 255, 0 };
+            for (int y = rois[i].y; y < rois[i].y + rois[i].h; y++) {
+                tile_stats_row(im->data + (size_t)y * im->w + rois[i].x,
+                    rois[i].w, &ts);
+            }
+            const double count = (double)rois[i].w * rois[i].h;
+            const double mean = count > 0 ? ts.sum / count : 0;
+            const double variance = count > 0 ?
+                max(0.0, ts.sum2 / count - mean * mean) : 0;
+            stats_print(&rois[i], mean, variance);
+        }
+    }
+    return r;
+}
+
+// answers X,Y:WxH queries from stdin until end of input or "quit"
+static int repl_command(int* argc, const char* argv[], image_t* im) {
+    const bool persist = args_option_flag(argc, argv, "--integral");
+    integral_t it = { 0 };
+    int r = integral_open(&it, im, persist);
+    char line[256];
+    while (r == 0 && fgets(line, countof(line), stdin) != null) {
+        if (strncmp(line, "quit", 4) == 0) { break; }
+        roi_t roi = { 0 };
+        if (line[0] != '\n' && line[0] != '\r' &&
+            roi_parse(&roi, line, im->w, im->h) == 0) {
+            double mean = 0;
+            double variance = 0;
+            integral_query(&it, &roi, &mean, &variance);
+            stats_print(&roi, mean, variance);
+        }
+        fflush(output());
+    }
+    integral_free(&it);
+    return r;
+}
+
+// executes single command line, "served" requests have no stdin
+static int run(int argc, const char* argv[], bool served) {
+    const char* fn = args_option_value(&argc, argv, "--file");
+    const bool verify = args_option_flag(&argc, argv, "--verify");
+    image_t im = { 0 };
+    int scale = 1;
+    int r = parse_scale(&argc, argv, &scale);
+    if (r != 0) {
+        r = usage();
+    } else if (fn != null && fn[0] == 0) {
+        fprintf(errors(), "expected --file filename\n");
+        r = usage();
+    } else {
+        r = image_open(&im, fn != null ? fn : "camera.png", scale);
+        im.verify = verify;
+    }
+    if (r == 0) {
+        r = parse_cache(&argc, argv, &im.cache);
+    }
+    roi_t* rois = null;
+    int n = 0;
+    if (r == 0) {
+        r = parse_roi(&argc, argv, &rois, &n, im.w, im.h);
+    }
+    if (r == 0 && n == 0) { // default roi 0,0:w:h
+        char s[64];
+        snprintf(s, countof(s), "0,0:%dx%d", im.w, im.h);
+        r = roi_append(&rois, &n, s, im.w, im.h);
+    }
+    if (r == 0 && scale != 1 && (argc < 2 || strcmp(argv[1], "histogram") != 0)) {
+        fprintf(errors(), "--scale is only supported by histogram\n");
+        r = usage();
+    }
+    if (r == 0) {
+        if (argc < 2) {
+            fprintf(errors(), "expected command: dump or histogram\n");
+            r = usage();
+        } else if (strcmp(argv[1], "dump") == 0) {
+            r = image_decode(&im);
+            for (int i = 0; r == 0 && i < n; i++) {
+                dump(im.data, rois[i].x, rois[i].y, rois[i].w, rois[i].h, im.w);
+            }
+        } else if (strcmp(argv[1], "histogram") == 0) {
+            byte* bits = image_bitmap(&im);
+            if (bits != null) {
+                r = histograms(bits, (im.w + 7) / 8, true, rois, n);
+                stbi_image_free(bits);
+            } else {
+                r = image_decode(&im);
+                if (r == 0) { r = histograms(im.data, im.w, false, rois, n); }
+            }
+        } else if (strcmp(argv[1], "tilestats") == 0) {
+            r = image_decode(&im);
+            if (r == 0) {
+                r = tilestats_command(&argc, argv, im.data, im.w, rois, n);
+            }
+        } else if (strcmp(argv[1], "stats") == 0) {
+            r = stats_command(&argc, argv, &im, rois, n);
+        } else if (strcmp(argv[1], "repl") == 0 && !served) {
+            r = repl_command(&argc, argv, &im);
+        } else {
+            fprintf(errors(), "unexpected command: %s\n", argv[1]);
+            r = EXIT_FAILURE;
+        }
+    }
+    if (rois != null) { free(rois); }
+    image_close(&im);
+    return r;
+}
+
+static const char* simd_level_name(int level) {
+    static const char* names[] = {
+        "scalar", "sse2", "ssse3", "sse4.1", "avx2", "avx512"
+    };
+    return level >= 0 && level < (int)countof(names) ? names[level] : "?";
+}
+
+// --cpu level caps the SIMD kernels of the whole process at that level,
+// e.g. to compare them or to reproduce what an older CPU would run
+static int cpu_option(int* argc, const char* argv[]) {
+    int r = 0;
+    const char* s = args_option_value(argc, argv, "--cpu");
+    if (s != null) {
+        int level = STBI_SIMD_AVX512;
+        while (level >= 0 && strcmp(s, simd_level_name(level)) != 0) {
+            level--;
+        }
+        if (level < 0) {
+            fprintf(errors(), "expected --cpu scalar|sse2|ssse3|sse4.1|"
+                              "avx2|avx512 instead of \"%s\"\n", s);
+            r = usage();
+        } else if (level > stbi_simd_level()) {
+            fprintf(errors(), "--cpu %s is not supported, up to %s is\n", s,
+                simd_level_name(stbi_simd_level()));
+            r = EXIT_FAILURE;
+        } else {
+            stbi_set_simd_level(level);
+        }
+    }
+    return r;
+}
+
+// stbi_loadf of 8-bit images and stbi_load of HDR images convert with
+// tables instead of pow(), reports the largest difference from pow() with
+// the default gamma 2.2 and scale 1, which must be 0
+static int bench_gamma(const char* fn, const mapping_t* m) {
+    int r = 0;
+    int w = 0, h = 0, c = 0;
+    const byte* data = (const byte*)m->data;
+    const bool hdr = stbi_is_hdr_from_memory(data, (int)m->bytes);
+    float* f = stbi_loadf_from_memory(data, (int)m->bytes, &w, &h, &c, 0);
+    byte* b = stbi_load_from_memory(data, (int)m->bytes, &w, &h, &c, 0);
+    if (f == null || b == null) {
+        fprintf(errors(), "failed to decode \"%s\" %s\n", fn,
+            stbi_failure_reason());
+        r = EXIT_FAILURE;
+    } else {
+        const int n = c & 1 ? c : c - 1; // alpha is linear
+        double max_error = 0;
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            for (int k = 0; k < n; k++) {
+                const size_t ix = i * c + k;
+                double error = 0;
+                if (hdr) {
+                    float z = (float)pow(f[ix] * 1.0f, 1.0f / 2.2f) * 255 + 0.5f;
+                    z = z < 0 ? 0 : z > 255 ? 255 : z;
+                    error = fabs((double)b[ix] - (int)z);
+                } else {
+                    error = fabs(f[ix] - (float)pow(b[ix] / 255.0f, 2.2f));
+                }
+                max_error = max(max_error, error);
+            }
+        }
+        fprintf(output(), "%s %s max error %g\n", fn,
+            hdr ? "hdr_to_ldr" : "ldr_to_hdr", max_error);
+        if (max_error > 0) {
+            fprintf(errors(), "%s: gamma conversion differs from pow()\n", fn);
+            r = EXIT_FAILURE;
+        }
+    }
+    if (f != null) { stbi_image_free(f); }
+    if (b != null) { stbi_image_free(b); }
+    return r;
+}
+
+// decodes a PNG file "iterations" times with and without checksums verified,
+// alternating so both see the same machine state, and reports the best time
+// of each; verification is meant to cost under ~5% of the decode time
+static int bench_verify(const char* fn, const mapping_t* m, int iterations) {
+    static const byte signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    if (m->bytes < sizeof(signature) ||
+        memcmp(m->data, signature, sizeof(signature)) != 0) {
+        return 0;
+    }
+    int r = 0;
+    double best[2] = { 0, 0 };
+    for (int i = 0; r == 0 && i < iterations * 2; i++) {
+        int w = 0, h = 0, c = 0;
+        stbi_set_verify_checksums_thread(i & 1);
+        double time = seconds();
+        byte* data = stbi_load_from_memory((const byte*)m->data,
+            (int)m->bytes, &w, &h, &c, 0);
+        time = seconds() - time;
+        if (data == null) {
+            fprintf(errors(), "failed to decode \"%s\"%s %s\n", fn,
+                i & 1 ? " with --verify" : "", stbi_failure_reason());
+            r = EXIT_FAILURE;
+        }
+        stbi_image_free(data);
+        if (i < 2 || time < best[i & 1]) { best[i & 1] = time; }
+    }
+    stbi_set_verify_checksums_thread(0);
+    if (r == 0) {
+        fprintf(output(), "%s verify %9.3f ms %9.3f ms without, %+.1f%%\n",
+            fn, best[1] * 1000, best[0] * 1000,
+            best[0] > 0 ? (best[1] / best[0] - 1) * 100 : 0.0);
+    }
+    return r;
+}
+
+// decodes corrupt copies of a JPEG with restart intervals, which stb_image
+// splits over the thread pool, with and without the pool; each copy must
+// decode to the same pixels or fail with the same error either way
+static int bench_restarts(const char* fn, const mapping_t* m) {
+    enum { copies = 300 };
+    const byte* data = (const byte*)m->data;
+    const size_t bytes = m->bytes;
+    size_t scan = 0; // entropy coded data of the first scan
+    bool restarts = false;
+    if (bytes < 4 || data[0] != 0xFF || data[1] != 0xD8) { return 0; }
+    for (size_t i = 2; scan == 0 && i + 4 <= bytes && data[i] == 0xFF; ) {
+        const size_t n = (size_t)data[i + 2] << 8 | data[i + 3];
+        if (data[i + 1] == 0xDD) { restarts = true; }
+        if (data[i + 1] == 0xDA) { scan = i + 2 + n; }
+        i += 2 + n;
+    }
+    if (!restarts || scan == 0 || scan + 16 >= bytes) { return 0; }
+    byte* copy = (byte*)malloc(bytes);
+    if (copy == null) {
+        fprintf(errors(), "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    int differ = 0;
+    uint32_t seed = 1;
+    for (int i = 0; i < copies; i++) {
+        memcpy(copy, data, bytes);
+        const int changes = 1 + i % 3;
+        for (int k = 0; k < changes; k++) { // markers, stuffing and noise
+            seed = seed * 1103515245u + 12345u;
+            const size_t at = scan + (seed >> 8) % (bytes - scan - 2);
+            const uint32_t v = seed >> 24;
+            copy[at] = (byte)(v % 4 == 0 ? 0xFF : v % 4 == 1 ? 0xD0 + v / 4 % 8 :
+                              v % 4 == 2 ? 0 : v);
+        }
+        int w[2] = { 0, 0 }, h[2] = { 0, 0 }, c[2] = { 0, 0 };
+        byte* pixels[2];
+        const char* reason[2];
+        for (int p = 0; p < 2; p++) {
+            stbi_set_parallel_for(p == 0 ? null : parallel_for, null);
+            pixels[p] = stbi_load_from_memory(copy, (int)bytes, &w[p], &h[p], &c[p], 0);
+            reason[p] = pixels[p] == null ? stbi_failure_reason() : "";
+        }
+        const bool same = (pixels[0] == null) == (pixels[1] == null) &&
+            strcmp(reason[0], reason[1]) == 0 &&
+            (pixels[0] == null || (w[0] == w[1] && h[0] == h[1] && c[0] == c[1] &&
+             memcmp(pixels[0], pixels[1], (size_t)w[0] * h[0] * c[0]) == 0));
+        if (!same) {
+            fprintf(errors(), "%s: corrupt copy %d decodes differently in "
+                "parallel (%s, %s)\n", fn, i,
+                pixels[0] != null ? "ok" : reason[0],
+                pixels[1] != null ? "ok" : reason[1]);
+            differ++;
+        }
+        stbi_image_free(pixels[0]);
+        stbi_image_free(pixels[1]);
+    }
+    free(copy);
+    fprintf(output(), "%s restarts %d corrupt copies, %d decode differently "
+        "in parallel\n", fn, copies, differ);
+    return differ > 0 ? EXIT_FAILURE : 0;
+}
+
+// decodes each file "iterations" times at every SIMD level the cpu supports
+// and reports time per image; output of every level must match scalar
+static int bench_file(const char* fn, int iterations) {
+    mapping_t m;
+    int r = file_map(&m, fn);
+    if (r != 0) {
+        fprintf(errors(), "failed to open \"%s\" %s\n", fn, strerror(r));
+        return r;
+    }
+    const int supported = stbi_simd_level();
+    byte* reference = null;
+    size_t bytes = 0;
+    for (int level = STBI_SIMD_NONE; r == 0 && level <= supported; level++) {
+        stbi_set_simd_level(level);
+        int w = 0, h = 0, c = 0;
+        byte* data = stbi_load_from_memory((const byte*)m.data, (int)m.bytes,
+            &w, &h, &c, 0); // warm up and correctness check
+        if (data == null) {
+            fprintf(errors(), "failed to decode \"%s\" %s\n", fn,
+                stbi_failure_reason());
+            r = EXIT_FAILURE;
+        } else if (reference == null) {
+            reference = data;
+            bytes = (size_t)w * h * c;
+        } else {
+            if (memcmp(reference, data, bytes) != 0) {
+                fprintf(errors(), "%s: %s output differs from scalar\n", fn,
+                    simd_level_name(level));
+                r = EXIT_FAILURE;
+            }
+            stbi_image_free(data);
+        }
+        double time = seconds();
+        for (int i = 0; r == 0 && i < iterations; i++) {
+            data = stbi_load_from_memory((const byte*)m.data, (int)m.bytes,
+                &w, &h, &c, 0);
+            stbi_image_free(data);
+        }
+        time = (seconds() - time) / iterations;
+        if (r == 0) {
+            fprintf(output(), "%s %dx%dx%d %-6s %9.3f ms %8.2f Mpix/s\n",
+                fn, w, h, c, simd_level_name(level), time * 1000,
+                time > 0 ? (double)w * h / time / 1e6 : 0.0);
+        }
+    }
+    stbi_set_simd_level(supported);
+    if (r == 0) { r = bench_verify(fn, &m, iterations); }
+    if (r == 0) { r = bench_gamma(fn, &m); }
+    if (r == 0) { r = bench_restarts(fn, &m); }
+    if (reference != null) { stbi_image_free(reference); }
+    file_unmap(&m);
+    return r;
+}
+
+static int bench(int argc, const char* argv[]) {
+    int r = 0;
+    int iterations = 10;
+    const char* s = args_option_value(&argc, argv, "--iterations");
+    if (s != null && (sscanf(s, "%d", &iterations) != 1 || iterations <= 0)) {
+        fprintf(errors(), "expected --iterations N instead of \"%s\"\n", s);
+        r = usage();
+    } else if (argc < 3) {
+        fprintf(errors(), "expected image files to benchmark\n");
+        r = usage();
+    }
+    for (int i = 2; r == 0 && i < argc; i++) {
+        r = bench_file(argv[i], iterations);
+    }
+    return r;
+}
+
+// histograms of the luma of each frame of an animated GIF, decoded one
+// frame at a time so memory does not grow with the number of frames
+static int frames_command(int argc, const char* argv[]) {
     int r = 0;
     int w = 0;
     int h = 0;
-    int c = 0;
-    byte* data  = null;  /* Pointer to loaded image data. */
-    data = stbi_load("camera.png", &w, &h, &c, 0);
-    if (data == null) {
-        fprintf(stderr, "failed to read \"camera.png\" errno=%d \"%s\"", 
-            errno, strerror(errno));
-        r = EXIT_FAILURE;
+    stbi_gif_frames* g = null;
+    const char* fn = args_option_value(&argc, argv, "--file");
+    if (fn == null || fn[0] == 0) {
+        fprintf(errors(), "expected --file filename\n");
+        r = usage();
+    } else {
+        g = stbi_gif_frames_open(fn, &w, &h);
+        if (g == null) {
+            fprintf(errors(), "failed to read \"%s\" errno=%d \"%s\" %s\n",
+                fn, errno, strerror(errno), stbi_failure_reason());
+            r = EXIT_FAILURE;
+        }
     }
+    roi_t* rois = null;
+    int n = 0;
     if (r == 0) {
-        if (c != 1) {
-            fprintf(stderr, "expected 1 byte per pixel instead of %d"
-                " in file \"camera.png\" %dx%d", c, w, h);
+        r = parse_roi(&argc, argv, &rois, &n, w, h);
+    }
+    if (r == 0 && n == 0) { // default roi 0,0:w:h
+        char s[64];
+        snprintf(s, countof(s), "0,0:%dx%d", w, h);
+        r = roi_append(&rois, &n, s, w, h);
+    }
+    if (r == 0 && argc > 2) {
+        fprintf(errors(), "unexpected argument: %s\n", argv[2]);
+        r = usage();
+    }
+    byte* luma = null;
+    if (r == 0) {
+        luma = (byte*)malloc((size_t)w * h + 1);
+        if (luma == null) {
+            fprintf(errors(), "out of memory\n");
             r = EXIT_FAILURE;
         }
     }
-    int rx = 0; // default roi 0,0:w:h
-    int ry = 0;
-    int rw = w;
-    int rh = h;
+    int frame = 0;
+    int delay = 0;
+    const byte* rgba = null;
+    while (r == 0 && (rgba = stbi_gif_frames_next(g, &delay)) != null) {
+        const size_t pixels = (size_t)w * h;
+        for (size_t i = 0; i < pixels; i++) { // same weights as stb_image
+            const byte* p = rgba + i * 4;
+            luma[i] = (byte)((p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8);
+        }
+        fprintf(output(), "frame %d delay %d ms\n", frame, delay);
+        r = histograms(luma, w, false, rois, n);
+        frame++;
+    }
+    if (r == 0 && frame == 0) {
+        fprintf(errors(), "no frames in \"%s\" %s\n", fn, stbi_failure_reason());
+        r = EXIT_FAILURE;
+    }
+    if (luma != null) { free(luma); }
+    if (rois != null) { free(rois); }
+    stbi_gif_frames_close(g);
+    return r;
+}
+
+// Requests and responses over local stream socket:
+//   request:  one argument per line (argv[0] excluded), empty line ends it
+//   response: "<exit code> <output bytes> <errors bytes>\n" output errors
+// A connection may carry any number of requests. Relative paths in
+// arguments are resolved against the server current directory, the
+// client makes them absolute before sending.
+enum { max_request_args = 256, max_request_arg = 4096 };
+
+#ifndef _WIN32
+
+static int write_all(int fd, const void* data, size_t bytes) {
+    const byte* p = (const byte*)data;
+    while (bytes > 0) {
+        ssize_t k = write(fd, p, bytes);
+        if (k < 0 && errno == EINTR) { continue; }
+        if (k <= 0) { return errno != 0 ? errno : EIO; }
+        p += k;
+        bytes -= (size_t)k;
+    }
+    return 0;
+}
+
+static int socket_address(struct sockaddr_un* a, const char* path) {
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a->sun_path)) {
+        fprintf(errors(), "socket path too long: \"%s\"\n", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(a->sun_path, path);
+    return 0;
+}
+
+// reads one request, returns number of arguments (including argv[0]),
+// 0 at the end of the connection and -1 on malformed request
+static int serve_read_request(FILE* in, char* args, const char* argv[]) {
+    int argc = 1;
+    argv[0] = "pngdump";
+    for (;;) {
+        char* arg = args + (size_t)argc * max_request_arg;
+        if (fgets(arg, max_request_arg, in) == null) { return 0; }
+        size_t k = strlen(arg);
+        if (k == 0 || arg[k - 1] != '\n') { return -1; } // too long
+        arg[k - 1] = 0;
+        if (k == 1) { return argc; } // empty line ends the request
+        if (argc == max_request_args - 1) { return -1; }
+        argv[argc++] = arg;
+    }
+}
+
+static void* serve_connection(void* p) {
+    const int fd = (int)(intptr_t)p;
+    FILE* in = fdopen(fd, "r");
+    char* args = (char*)malloc((size_t)max_request_args * max_request_arg);
+    const char* argv[max_request_args + 1];
+    bool connected = in != null && args != null;
+    while (connected) {
+        const int argc = serve_read_request(in, args, argv);
+        connected = argc > 0;
+        if (connected) {
+            argv[argc] = null;
+            char* out = null;
+            char* err = null;
+            size_t out_bytes = 0;
+            size_t err_bytes = 0;
+            output_stream = open_memstream(&out, &out_bytes);
+            errors_stream = open_memstream(&err, &err_bytes);
+            int r = EXIT_FAILURE;
+            if (output_stream != null && errors_stream != null) {
+                r = run(argc, argv, true);
+            }
+            if (output_stream != null) { fclose(output_stream); }
+            if (errors_stream != null) { fclose(errors_stream); }
+            output_stream = null;
+            errors_stream = null;
+            char header[64];
+            snprintf(header, countof(header), "%d %zu %zu\n",
+                r, out_bytes, err_bytes);
+            connected = write_all(fd, header, strlen(header)) == 0 &&
+                write_all(fd, out, out_bytes) == 0 &&
+                write_all(fd, err, err_bytes) == 0;
+            free(out);
+            free(err);
+        } else if (argc < 0) {
+            static const char* malformed = "1 0 18\nmalformed request\n";
+            write_all(fd, malformed, strlen(malformed));
+        }
+    }
+    free(args);
+    if (in != null) { fclose(in); } else { close(fd); }
+    return null;
+}
+
+// keeps thread pool and decoded frames warm between requests and serves
+// every connection on its own thread until killed
+static int serve(int argc, const char* argv[]) {
+    int r = 0;
+    const char* path = args_option_value(&argc, argv, "--socket");
+    const char* limit = args_option_value(&argc, argv, "--memory-limit");
+    double mb = 1024;
+    struct sockaddr_un a;
+    if (path == null || path[0] == 0) {
+        fprintf(errors(), "expected --socket path\n");
+        r = usage();
+    } else if (limit != null && (sscanf(limit, "%lf", &mb) != 1 ||
+                                 !(0 <= mb && mb <= max_megabytes))) {
+        fprintf(errors(), "expected --memory-limit MB instead of \"%s\"\n", limit);
+        r = usage();
+    } else {
+        r = socket_address(&a, path);
+    }
+    int s = -1;
     if (r == 0) {
-        r = parse_roi(&argc, argv, &rx, &ry, &rw, &rh, w, h);
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path); // stale socket left by previous server
+        if (s < 0 || bind(s, (struct sockaddr*)&a, sizeof(a)) != 0 ||
+            listen(s, SOMAXCONN) != 0) {
+            fprintf(errors(), "failed to listen on \"%s\" errno=%d \"%s\"\n",
+                path, errno, strerror(errno));
+            r = EXIT_FAILURE;
+        }
     }
     if (r == 0) {
-        if (argc < 1) {
-            perror("expected command: dump or histogram");
-            usage();
+        signal(SIGPIPE, SIG_IGN); // clients may disconnect at any time
+        mutex_init(&frames.lock);
+        frames.limit = (uint64_t)(mb * 1024 * 1024);
+        frames.enabled = true;
+        for (;;) {
+            int c = accept(s, null, null);
+            if (c < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) { continue; }
+                fprintf(errors(), "accept() failed errno=%d \"%s\"\n",
+                    errno, strerror(errno));
+                r = EXIT_FAILURE;
+                break;
+            }
+            pthread_t thread;
+            if (pthread_create(&thread, null, serve_connection,
+                               (void*)(intptr_t)c) == 0) {
+                pthread_detach(thread);
+            } else {
+                close(c);
+            }
+        }
+    }
+    if (s >= 0) { close(s); }
+    return r;
+}
+
+static bool read_all(FILE* in, FILE* out, size_t bytes) {
+    char buffer[64 * 1024];
+    while (bytes > 0) {
+        const size_t k = fread(buffer, 1, min(bytes, sizeof(buffer)), in);
+        if (k == 0 || fwrite(buffer, 1, k, out) != k) { return false; }
+        bytes -= k;
+    }
+    return true;
+}
+
+// thin client: forwards the command line to the server and copies response
+static int client(int argc, const char* argv[], const char* path) {
+    static const char* path_options[] = { "--file", "--rois", "--bin", "--cache" };
+    struct sockaddr_un a;
+    int r = socket_address(&a, path);
+    int s = r == 0 ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+    if (r == 0 && (s < 0 || connect(s, (struct sockaddr*)&a, sizeof(a)) != 0)) {
+        fprintf(errors(), "failed to connect to \"%s\" errno=%d \"%s\"\n",
+            path, errno, strerror(errno));
+        r = EXIT_FAILURE;
+    }
+    char cwd[1024] = { 0 };
+    if (r == 0 && getcwd(cwd, countof(cwd)) == null) { cwd[0] = 0; }
+    for (int i = 1; r == 0 && i < argc; i++) {
+        char arg[max_request_arg];
+        bool path_value = false;
+        for (int j = 0; j < (int)countof(path_options); j++) {
+            if (strcmp(argv[i - 1], path_options[j]) == 0) { path_value = true; }
+        }
+        if (path_value && argv[i][0] != '/' && cwd[0] != 0) {
+            snprintf(arg, countof(arg) - 1, "%s/%s", cwd, argv[i]);
+        } else {
+            snprintf(arg, countof(arg) - 1, "%s", argv[i]);
+        }
+        if (arg[0] == 0 || strchr(arg, '\n') != null) {
+            fprintf(errors(), "unexpected argument \"%s\"\n", argv[i]);
+            r = EXIT_FAILURE;
+        } else {
+            strcat(arg, "\n");
+            r = write_all(s, arg, strlen(arg)) == 0 ? 0 : EXIT_FAILURE;
+        }
+    }
+    if (r == 0) { r = write_all(s, "\n", 1) == 0 ? 0 : EXIT_FAILURE; }
+    FILE* in = s >= 0 && r == 0 ? fdopen(s, "r") : null;
+    if (in != null) {
+        int status = 0;
+        size_t out_bytes = 0;
+        size_t err_bytes = 0;
+        if (fscanf(in, "%d %zu %zu", &status, &out_bytes, &err_bytes) != 3 ||
+            fgetc(in) != '\n' ||
+            !read_all(in, stdout, out_bytes) ||
+            !read_all(in, stderr, err_bytes)) {
+            fprintf(errors(), "unexpected response from \"%s\"\n", path);
             r = EXIT_FAILURE;
-        } else if (strcmp(argv[1], "dump") == 0) {
-            dump(data, rx, ry, rw, rh, w);
-        } else if (strcmp(argv[1], "histogram") == 0) {
-            histogram(data, rx, ry, rw, rh, w);
         } else {
-            fprintf(stderr, "unexpected command: %s", argv[1]);
+            r = status;
         }
+        fclose(in);
+    } else if (s >= 0) {
+        close(s);
     }
-    if (data != null) { free(data); }
     return r;
 }
+
+#endif
+
+#ifndef PNGDUMP_NO_MAIN // pngbench.c includes this file for its helpers
+
+int main(int argc, const char* argv[]) {
+    stbi_simd_level(); // detected before any thread can decode
+    threads_init();
+    stbi_set_parallel_for(parallel_for, null);
+    const bool capped = args_option_index(argc, argv, "--cpu") >= 0;
+    int r = cpu_option(&argc, argv);
+    const bool serving = argc > 1 && strcmp(argv[1], "serve") == 0;
+    const bool benching = argc > 1 && strcmp(argv[1], "bench") == 0;
+    const bool framing = argc > 1 && strcmp(argv[1], "frames") == 0;
+#ifdef _WIN32
+    if (r != 0) {
+        // bad --cpu level, already reported
+    } else if (benching) {
+        r = bench(argc, argv);
+    } else if (framing) {
+        r = frames_command(argc, argv);
+    } else if (serving || args_option_index(argc, argv, "--socket") >= 0) {
+        fprintf(errors(), "serve and --socket are not supported on Windows\n");
+        r = EXIT_FAILURE;
+    } else {
+        r = run(argc, argv, false);
+    }
+#else
+    const char* path = serving || benching || framing ?
+        null : args_option_value(&argc, argv, "--socket");
+    if (r != 0) {
+        // bad --cpu level, already reported
+    } else if (benching) {
+        r = bench(argc, argv);
+    } else if (framing) {
+        r = frames_command(argc, argv);
+    } else if (serving) {
+        r = serve(argc, argv);
+    } else if (path != null && capped) {
+        // one server process decodes for all of its clients: the level
+        // is chosen when it is started, not per request
+        fprintf(errors(), "--cpu is not supported with --socket, "
+                          "start the server with \"serve --cpu level\"\n");
+        r = EXIT_FAILURE;
+    } else if (path != null) {
+        r = path[0] == 0 ? usage() : client(argc, argv, path);
+    } else {
+        r = run(argc, argv, false);
+    }
+#endif
+    return r;
+}
+
+#endif // PNGDUMP_NO_MAIN
@@ -30,14 +30,14 @@
       GIF (*comp always reports as 4-channel)
       HDR (radiance rgbE format)
       PIC (Softimage PIC)
-      PNM (PPM and PGM binary only)
+      PNM (PPM and PGM, binary and ASCII)
 
       Animated GIF still needs a proper API, but here's one way to do it:
           http://gist.github.com/urraka/685d9a6340b26b830d49
 
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
-      - SIMD acceleration on x86/x64 (SSE2) and ARM (NEON)
+      - SIMD acceleration on x86/x64 (SSE2, AVX2) and ARM (NEON)
 
    Full documentation under "DOCUMENTATION" below.
 
@@ -271,6 +271,60 @@ RECENT REVISION HISTORY:
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
+// On x86 with GCC/Clang (5+) or MSVC 2013+, kernels for later instruction
+// sets are also compiled (with per-function target attributes, so the rest
+// of the build does not need -mavx2 and the like) and picked when CPUID,
+// read once, finds them:
+//
+//     SSSE3    format conversions (channel shuffles, gray from RGB), BGR
+//              swaps
+//     SSE4.1   PNG Paeth unfiltering, and CRC-32 with PCLMULQDQ
+//     AVX2     JPEG IDCT and color conversion, PNG palettes, Adler-32,
+//              8-bit to float
+//     AVX-512  Adler-32 (AVX-512BW, GCC 6+ or MSVC 2017+)
+//
+// Define STBI_NO_AVX2 to leave out the AVX2 and AVX-512 kernels, or
+// STBI_NO_AVX512 for just the AVX-512 ones.
+//
+// The kernel level in effect can be lowered (e.g. to compare them) with
+//
+//     stbi_set_simd_level(STBI_SIMD_SSE2);
+//
+// levels above what the CPU supports are clamped; stbi_simd_level() returns
+// the level in effect, and every kernel at or below it is used.
+//
+// ===========================================================================
+//
+// Multithreading
+//
+// stb_image creates no threads. Work that can be split (currently baseline
+// JPEGs with restart intervals decoded from memory, where the intervals are
+// entropy decoded and IDCT'd independently) is handed to a parallel-for
+// supplied by the application:
+//
+//     stbi_set_parallel_for(my_parallel_for, my_pool);
+//
+// my_parallel_for(my_pool, task, data, count) must call task(data, k, n) for
+// every k in [0, n) and return when they are all done; n is chosen by the
+// application between 1 and count and each task takes every n-th item.
+// Output is identical to the serial decode.
+//
+// ===========================================================================
+//
+// Stage timing
+//
+// A profiler can time the separate stages of a decode without reaching into
+// stb_image internals:
+//
+//     stbi_set_stage_hook(my_hook, my_timer);
+//
+// my_hook(my_timer, stage, done) is called on the decoding thread with done
+// 0 as a stage starts and done 1 as it ends; a stage that fails only
+// reports its start. The stages are STBI_STAGE_INFLATE (the zlib stream of
+// a PNG), STBI_STAGE_UNFILTER (PNG scanlines to pixels: unfiltering,
+// deinterlacing, transparency and palette expansion) and STBI_STAGE_CONVERT
+// (changing the number of channels to req_comp, any format).
+//
 // ===========================================================================
 //
 // HDR image support   (disable by defining STBI_NO_HDR)
@@ -428,6 +482,45 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
+
+// animated GIFs one composited frame at a time, in constant memory however
+// many frames there are:
+//
+//     stbi_gif_frames *g = stbi_gif_frames_open("anim.gif", &x, &y);
+//     while ((frame = stbi_gif_frames_next(g, &delay)) != NULL)
+//        ... x*y 4-component pixels, shown for delay milliseconds ...
+//     stbi_gif_frames_close(g);
+//
+// a frame is valid until the next call. Like stbi_load_gif_from_memory,
+// frames end at the end of the file or at the first corrupt one, and are
+// flipped by stbi_set_flip_vertically_on_load
+typedef struct stbi_gif_frames stbi_gif_frames;
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y);
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open          (char const *filename, int *x, int *y);
+#endif
+STBIDEF stbi_uc         *stbi_gif_frames_next          (stbi_gif_frames *frames, int *delay);
+STBIDEF void             stbi_gif_frames_close         (stbi_gif_frames *frames);
+#endif
+
+#ifndef STBI_NO_PNM
+// binary PGM and PPM files (P5 and P6) hold their pixels as they are, so
+// those of one already in memory, say mapped from its file, can be used in
+// place: returns a pointer to them in buffer, or NULL if it isn't a binary
+// PNM or is truncated. 16-bit samples are big-endian, as in the file
+STBIDEF stbi_uc const *stbi_pnm_pixels_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *bits_per_channel);
+#endif
+
+#ifndef STBI_NO_PNG
+// 1-bit grayscale PNGs, such as masks, with their pixels left packed: 8 to a
+// byte with the leftmost in the high bit and each row starting a new byte,
+// so (x+7)/8 bytes a row. Fails on any other PNG; a tRNS chunk is ignored.
+// Rows are flipped by stbi_set_flip_vertically_on_load; free with
+// stbi_image_free
+STBIDEF stbi_uc *stbi_png_bitmap_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y);
+STBIDEF stbi_uc *stbi_png_bitmap_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y);
 #endif
 
 #ifdef STBI_WINDOWS_UTF8
@@ -521,6 +614,71 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// SIMD kernel levels, the best one the CPU supports is used by default
+enum
+{
+   STBI_SIMD_NONE   = 0,
+   STBI_SIMD_SSE2   = 1, // NEON on ARM
+   STBI_SIMD_SSSE3  = 2,
+   STBI_SIMD_SSE41  = 3,
+   STBI_SIMD_AVX2   = 4,
+   STBI_SIMD_AVX512 = 5  // AVX-512F and BW
+};
+
+// select a lower level (clamped to what the CPU supports), not thread-safe
+// while images are being loaded
+STBIDEF void stbi_set_simd_level(int level);
+STBIDEF int  stbi_simd_level(void);
+
+// run items [k, k+n, k+2n, ...) of a parallel job, see "Multithreading" above
+typedef void stbi_task_func(void *task_data, int k, int n);
+typedef void stbi_parallel_for_func(void *user, stbi_task_func *task, void *task_data, int count);
+
+// NULL (the default) runs everything on the calling thread; not thread-safe
+// while images are being loaded
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *parallel_for, void *user);
+
+// see "Stage timing" above; NULL (the default) reports nothing, not
+// thread-safe while images are being loaded
+enum
+{
+   STBI_STAGE_INFLATE  = 0,
+   STBI_STAGE_UNFILTER = 1,
+   STBI_STAGE_CONVERT  = 2
+};
+
+typedef void stbi_stage_func(void *user, int stage, int done);
+
+STBIDEF void stbi_set_stage_hook(stbi_stage_func *hook, void *user);
+
+// decode JPEGs at 1/denominator of their size, denominator 1 (the default),
+// 2, 4 or 8; stbi_info reports the reduced size as well. The reduced sizes
+// use smaller IDCTs and far less upsampling and color conversion work, so
+// they are much cheaper than decoding at full size and downsampling
+STBIDEF void stbi_set_jpeg_scale(int denominator);
+// as above, but only applies to images loaded on the thread that calls it
+STBIDEF void stbi_set_jpeg_scale_thread(int denominator);
+
+// progressive JPEGs keep all their coefficients until the last scan; in low
+// memory mode only the nonzero ones are kept, packed, which is a fraction of
+// the memory for photos at some cost in speed. Not thread-safe while images
+// are being loaded
+STBIDEF void stbi_set_jpeg_low_memory(int flag_true_if_low_memory);
+
+// keep up to max_bytes of coefficient buffers per thread for the next
+// progressive JPEGs loaded on the same thread (needs thread-local variables,
+// see stbi_set_flip_vertically_on_load_thread); 0, the default, frees them,
+// including the ones kept by the calling thread
+STBIDEF void stbi_set_jpeg_buffer_pool(size_t max_bytes);
+
+// check the CRC of every PNG chunk and the Adler-32 of zlib streams (PNG
+// image data and the stbi_zlib_decode functions below), so that corrupted
+// files fail with "bad CRC" or "bad adler32" instead of decoding to
+// garbage; off by default, costs a few percent of the decode time
+STBIDEF void stbi_set_verify_checksums(int flag_true_if_should_verify);
+// as above, but only applies to images loaded on the thread that calls it
+STBIDEF void stbi_set_verify_checksums_thread(int flag_true_if_should_verify);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -635,6 +793,18 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #endif
 #endif
 
+// values detected on first use (the CPU features, the SIMD level) can be
+// first used by several threads at once; each computes the same value, so
+// relaxed atomic loads and stores make that race-free without a lock
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
+   #define stbi__atomic_load(p)      __atomic_load_n(p, __ATOMIC_RELAXED)
+   #define stbi__atomic_store(p, v)  __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#else
+   // aligned int loads and stores are not torn on any target of these compilers
+   #define stbi__atomic_load(p)      (*(volatile int *) (p))
+   #define stbi__atomic_store(p, v)  (*(volatile int *) (p) = (v))
+#endif
+
 #ifdef _MSC_VER
 typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
@@ -747,18 +917,15 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
    return ((info3 >> 26) & 1) != 0;
 }
-#endif
 
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -766,9 +933,106 @@ static int stbi__sse2_available(void)
    // instructions at will, and so are we.
    return 1;
 }
+
+#endif
+
+// kernels beyond SSE2 are compiled with per-function target attributes so
+// that they can be selected at run time without building everything for
+// them; what the CPU has is probed once, by stbi__cpu_features()
+#if (defined(_MSC_VER) && _MSC_VER >= 1800) || \
+    (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+#define STBI__TARGETS
+#include <immintrin.h>
+
+#ifndef STBI_NO_AVX2
+#define STBI__AVX2
+// AVX-512BW intrinsics and the run-time test need GCC 6 or MSVC 2017
+#if !defined(STBI_NO_AVX512) && ((defined(_MSC_VER) && _MSC_VER >= 1910) || \
+    (defined(__GNUC__) && __GNUC__ >= 6) || defined(__clang__))
+#define STBI__AVX512
+#endif
+#endif
+
+enum
+{
+   STBI__CPU_SSSE3  = 1,
+   STBI__CPU_SSE41  = 2,
+   STBI__CPU_AVX2   = 4,
+   STBI__CPU_AVX512 = 8,  // F and BW
+   STBI__CPU_PCLMUL = 16  // carry-less multiplication, for PNG CRC-32s
+};
+
+#ifdef _MSC_VER
+#define STBI__TARGET_SSSE3
+#define STBI__TARGET_SSE41
+#define STBI__TARGET_AVX2
+#define STBI__TARGET_AVX512
+#define STBI__TARGET_PCLMUL
+
+static int stbi__cpu_probe(void)
+{
+   int info[4], f = 0, max;
+   __cpuid(info,0);
+   max = info[0];
+   __cpuid(info,1);
+   if (info[2] & (1 <<  9)) f |= STBI__CPU_SSSE3;
+   if (info[2] & (1 << 19)) f |= STBI__CPU_SSE41;
+   if (info[2] & (1 <<  1)) f |= STBI__CPU_PCLMUL;
+   // OS must have enabled XSAVE and the AVX (YMM) state, and for AVX-512
+   // the opmask and ZMM state as well
+   if (max >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28))) {
+      unsigned __int64 xcr0 = _xgetbv(0);
+      __cpuidex(info,7,0);
+      if ((xcr0 & 6) == 6 && (info[1] & (1 << 5)))
+         f |= STBI__CPU_AVX2;
+      if ((xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) && (info[1] & (1 << 30)))
+         f |= STBI__CPU_AVX512;
+   }
+   return f;
+}
+#else
+#define STBI__TARGET_SSSE3  __attribute__((target("ssse3")))
+#define STBI__TARGET_SSE41  __attribute__((target("sse4.1")))
+#define STBI__TARGET_AVX2   __attribute__((target("avx2")))
+#define STBI__TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#define STBI__TARGET_PCLMUL __attribute__((target("pclmul")))
+
+static int stbi__cpu_probe(void)
+{
+   // checks OS support for the YMM and ZMM state as well
+   int f = 0;
+   if (__builtin_cpu_supports("ssse3"))  f |= STBI__CPU_SSSE3;
+   if (__builtin_cpu_supports("sse4.1")) f |= STBI__CPU_SSE41;
+   if (__builtin_cpu_supports("avx2"))   f |= STBI__CPU_AVX2;
+#ifdef STBI__AVX512
+   if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+      f |= STBI__CPU_AVX512;
+#endif
+   if (__builtin_cpu_supports("pclmul")) f |= STBI__CPU_PCLMUL;
+   return f;
+}
 #endif
 
+static int stbi__cpu_features_found = -1; // -1 until probed
+
+static int stbi__cpu_features(void)
+{
+   int f = stbi__atomic_load(&stbi__cpu_features_found);
+   if (f < 0) {
+      f = stbi__cpu_probe();
+      // leave out the features of kernels that were not compiled
+#ifndef STBI__AVX2
+      f &= ~STBI__CPU_AVX2;
+#endif
+#ifndef STBI__AVX512
+      f &= ~STBI__CPU_AVX512;
 #endif
+      stbi__atomic_store(&stbi__cpu_features_found, f);
+   }
+   return f;
+}
+#endif // STBI__TARGETS
+
 #endif
 
 // ARM NEON
@@ -789,6 +1053,12 @@ static int stbi__sse2_available(void)
 #define STBI_SIMD_ALIGN(type, name) type name
 #endif
 
+// ARMv8 CRC-32 instructions, when the compiler targets them
+#if !defined(STBI_NO_SIMD) && defined(__ARM_FEATURE_CRC32)
+#define STBI__ARM_CRC32
+#include <arm_acle.h>
+#endif
+
 #ifndef STBI_MAX_DIMENSIONS
 #define STBI_MAX_DIMENSIONS (1 << 24)
 #endif
@@ -1016,7 +1286,7 @@ static int stbi__mul2sizes_valid(int a, int b)
    return a <= INT_MAX/b;
 }
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR) || !defined(STBI_NO_PSD) || !defined(STBI_NO_BMP)
 // returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
 static int stbi__mad2sizes_valid(int a, int b, int add)
 {
@@ -1040,7 +1310,7 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR) || !defined(STBI_NO_PSD) || !defined(STBI_NO_BMP)
 // mallocs with size overflow checking
 static void *stbi__malloc_mad2(int a, int b, int add)
 {
@@ -1098,6 +1368,73 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
 }
 
+static int stbi__simd_level_global = -1; // -1 until detected
+
+static int stbi__simd_level_supported(void)
+{
+   int level = STBI_SIMD_NONE;
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) level = STBI_SIMD_SSE2;
+#ifdef STBI__TARGETS
+   if (level == STBI_SIMD_SSE2) {
+      // each level also needs all the features of the ones below it
+      static int const needs[] = { STBI__CPU_SSSE3, STBI__CPU_SSE41, STBI__CPU_AVX2, STBI__CPU_AVX512 };
+      int f = stbi__cpu_features();
+      while (level < STBI_SIMD_AVX512 && (f & needs[level - STBI_SIMD_SSE2]) != 0) ++level;
+   }
+#endif
+#endif
+#ifdef STBI_NEON
+   level = STBI_SIMD_SSE2;
+#endif
+   return level;
+}
+
+STBIDEF void stbi_set_simd_level(int level)
+{
+   int supported = stbi__simd_level_supported();
+   stbi__atomic_store(&stbi__simd_level_global, level < STBI_SIMD_NONE ? STBI_SIMD_NONE : level > supported ? supported : level);
+}
+
+STBIDEF int stbi_simd_level(void)
+{
+   int level = stbi__atomic_load(&stbi__simd_level_global);
+   if (level < 0) {
+      level = stbi__simd_level_supported();
+      stbi__atomic_store(&stbi__simd_level_global, level);
+   }
+   return level;
+}
+
+static stbi_parallel_for_func *stbi__parallel_for;
+static void *stbi__parallel_for_user;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *parallel_for, void *user)
+{
+   stbi__parallel_for = parallel_for;
+   stbi__parallel_for_user = user;
+}
+
+// runs task over count items on the application's threads, if any
+static void stbi__run_parallel(stbi_task_func *task, void *task_data, int count)
+{
+   if (stbi__parallel_for && count > 1)
+      stbi__parallel_for(stbi__parallel_for_user, task, task_data, count);
+   else
+      task(task_data, 0, 1);
+}
+
+static stbi_stage_func *stbi__stage_hook;
+static void *stbi__stage_hook_user;
+
+STBIDEF void stbi_set_stage_hook(stbi_stage_func *hook, void *user)
+{
+   stbi__stage_hook = hook;
+   stbi__stage_hook_user = user;
+}
+
+#define stbi__stage(stage, done)  (stbi__stage_hook ? stbi__stage_hook(stbi__stage_hook_user, stage, done) : (void) 0)
+
 #ifndef STBI_THREAD_LOCAL
 #define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
 #else
@@ -1640,7 +1977,7 @@ static void stbi__skip(stbi__context *s, int n)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM) && defined(STBI_NO_PSD) && defined(STBI_NO_BMP)
 // nothing
 #else
 static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
@@ -1668,6 +2005,29 @@ static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
 }
 #endif
 
+#if !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA)
+// returns the next n bytes of s where they are if they're all buffered,
+// which is always the case for memory, and otherwise reads them into buf;
+// like stbi__get8, it reads 0 past the end of the data
+static stbi_uc const *stbi__get_row(stbi__context *s, stbi_uc *buf, int n)
+{
+   stbi_uc const *p = s->img_buffer;
+   int blen = (int) (s->img_buffer_end - s->img_buffer);
+   if (blen >= n) {
+      s->img_buffer += n;
+      return p;
+   }
+   memset(buf, 0, n);
+   if (s->io.read) {
+      stbi__getn(s, buf, n);
+   } else {
+      memcpy(buf, p, blen);
+      s->img_buffer = s->img_buffer_end;
+   }
+   return buf;
+}
+#endif
+
 #if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PIC)
 // nothing
 #else
@@ -1732,6 +2092,69 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+#ifdef STBI__TARGETS
+// converts as many of the w pixels of a row as whole 16 byte loads and
+// stores allow, returns how many: channels are moved with pshufb, and gray
+// from RGB(A) is computed in 32-bit lanes, exactly as stbi__compute_y
+static STBI__TARGET_SSSE3 int stbi__convert_row_ssse3(stbi_uc *dest, stbi_uc const *src, int w, int img_n, int req_comp)
+{
+   static signed char const shuffles[4][4][16] = {
+      { { 0 },
+        { 0,-1, 1,-1, 2,-1, 3,-1, 4,-1, 5,-1, 6,-1, 7,-1 },                  // 1 to 2
+        { 0,0,0, 1,1,1, 2,2,2, 3,3,3, 4,4,4, -1 },                           // 1 to 3
+        { 0,0,0,-1, 1,1,1,-1, 2,2,2,-1, 3,3,3,-1 } },                        // 1 to 4
+      { { 0,2,4,6,8,10,12,14, -1,-1,-1,-1,-1,-1,-1,-1 },                     // 2 to 1
+        { 0 },
+        { 0,0,0, 2,2,2, 4,4,4, 6,6,6, 8,8,8, -1 },                           // 2 to 3
+        { 0,0,0,1, 2,2,2,3, 4,4,4,5, 6,6,6,7 } },                            // 2 to 4
+      { { 0,-1,1,-1,2,-1,-1,-1, 3,-1,4,-1,5,-1,-1,-1 },                      // 3 to 1 and 2,
+        { 6,-1,7,-1,8,-1,-1,-1, 9,-1,10,-1,11,-1,-1,-1 },                    // 16-bit r,g,b
+        { 0 },
+        { 0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1 } },                      // 3 to 4
+      { { 0,-1,1,-1,2,-1,-1,-1, 4,-1,5,-1,6,-1,-1,-1 },                      // 4 to 1 and 2
+        { 8,-1,9,-1,10,-1,-1,-1, 12,-1,13,-1,14,-1,-1,-1 },
+        { 0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1 },                     // 4 to 3
+        { 0 } },
+   };
+   __m128i opaque = _mm_setzero_si128();
+   int i = 0;
+   if (img_n >= 3 && req_comp <= 2) {
+      __m128i lo = _mm_loadu_si128((__m128i const *) shuffles[img_n-1][0]);
+      __m128i hi = _mm_loadu_si128((__m128i const *) shuffles[img_n-1][1]);
+      __m128i weights = _mm_setr_epi16(77,150,29,0, 77,150,29,0);
+      __m128i alpha = _mm_setr_epi8(-1,3,-1,-1, -1,7,-1,-1, -1,11,-1,-1, -1,15,-1,-1);
+      __m128i pack = req_comp == 1 ? _mm_setr_epi8(0,4,8,12, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1)
+                                   : _mm_setr_epi8(0,1,4,5,8,9,12,13, -1,-1,-1,-1, -1,-1,-1,-1);
+      if (img_n == 3) opaque = _mm_set1_epi32(0xff00);
+      for (; img_n*(w - i) >= 16; i += 4) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (src + img_n*i));
+         // r*77 + g*150 and b*29 of two pixels each, summed in pairs
+         __m128i y = _mm_hadd_epi32(_mm_madd_epi16(_mm_shuffle_epi8(v, lo), weights),
+                                    _mm_madd_epi16(_mm_shuffle_epi8(v, hi), weights));
+         y = _mm_srli_epi32(y, 8);
+         if (req_comp == 1) {
+            stbi__uint32 t = (stbi__uint32) _mm_cvtsi128_si32(_mm_shuffle_epi8(y, pack));
+            memcpy(dest + i, &t, 4);
+         } else {
+            if (img_n == 4) y = _mm_or_si128(y, _mm_shuffle_epi8(v, alpha));
+            _mm_storel_epi64((__m128i *) (dest + 2*i), _mm_shuffle_epi8(_mm_or_si128(y, opaque), pack));
+         }
+      }
+   } else {
+      __m128i shuffle = _mm_loadu_si128((__m128i const *) shuffles[img_n-1][req_comp-1]);
+      // as many pixels as fit 16 bytes in and out, while 16 bytes fit both
+      int step = 16 / (img_n > req_comp ? img_n : req_comp), n = img_n < req_comp ? img_n : req_comp;
+      if (img_n == 1 && req_comp == 2) opaque = _mm_set1_epi16((short) 0xff00);
+      if (img_n != 2 && req_comp == 4) opaque = _mm_set1_epi32((int) 0xff000000);
+      for (; n*(w - i) >= 16; i += step) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (src + img_n*i));
+         _mm_storeu_si128((__m128i *) (dest + req_comp*i), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), opaque));
+      }
+   }
+   return i;
+}
+#endif
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
    int i,j;
@@ -1739,6 +2162,7 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+   stbi__stage(STBI_STAGE_CONVERT, 0);
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
@@ -1750,8 +2174,16 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
 
+      i = 0;
+#ifdef STBI__TARGETS
+      if (stbi_simd_level() >= STBI_SIMD_SSSE3) {
+         i = stbi__convert_row_ssse3(dest, src, x, img_n, req_comp);
+         src += i * img_n;
+         dest += i * req_comp;
+      }
+#endif
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(; i < (int) x; ++i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1773,11 +2205,12 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
    }
 
    STBI_FREE(data);
+   stbi__stage(STBI_STAGE_CONVERT, 1);
    return good;
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PNM)
 // nothing
 #else
 static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
@@ -1786,7 +2219,7 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_PSD) && defined(STBI_NO_PNM)
 // nothing
 #else
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
@@ -1796,6 +2229,7 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
+   stbi__stage(STBI_STAGE_CONVERT, 0);
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
@@ -1830,29 +2264,80 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
    }
 
    STBI_FREE(data);
+   stbi__stage(STBI_STAGE_CONVERT, 1);
    return good;
 }
 #endif
 
 #ifndef STBI_NO_LINEAR
+#ifdef STBI__AVX2
+// looks up 8 components at a time, alpha ones (comp 2 and 4) in the second
+// half of the table; returns how many components it did
+static STBI__TARGET_AVX2 int stbi__ldr_to_hdr_avx2(float *output, stbi_uc const *data, int count, float const *table, int comp)
+{
+   __m256i offset = comp == 2 ? _mm256_setr_epi32(0,256,0,256,0,256,0,256)
+                  : comp == 4 ? _mm256_setr_epi32(0,0,0,256,0,0,0,256)
+                  : _mm256_setzero_si256();
+   int i;
+   for (i=0; i + 8 <= count; i += 8) {
+      __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (data + i))), offset);
+      _mm256_storeu_ps(output + i, _mm256_i32gather_ps(table, idx, 4));
+   }
+   return i;
+}
+#endif
+
+#ifdef STBI_THREAD_LOCAL
+// the table only changes with stbi_ldr_to_hdr_gamma/scale, so each thread
+// keeps the last one it built instead of calling pow 256 times per image
+static STBI_THREAD_LOCAL float stbi__l2h_table[512];
+static STBI_THREAD_LOCAL float stbi__l2h_table_gamma, stbi__l2h_table_scale;
+static STBI_THREAD_LOCAL int   stbi__l2h_table_set;
+#endif
+
+// an 8-bit component only has 256 values to convert: color components in
+// the first half of the table, alpha in the second
+static float const *stbi__ldr_to_hdr_table(float *table)
+{
+   int i;
+#ifdef STBI_THREAD_LOCAL
+   if (stbi__l2h_table_set && stbi__l2h_table_gamma == stbi__l2h_gamma && stbi__l2h_table_scale == stbi__l2h_scale)
+      return stbi__l2h_table;
+   table = stbi__l2h_table;
+#endif
+   for (i=0; i < 256; ++i) {
+      table[i] = (float) (pow(i/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+      table[256 + i] = i/255.0f;
+   }
+#ifdef STBI_THREAD_LOCAL
+   stbi__l2h_table_gamma = stbi__l2h_gamma;
+   stbi__l2h_table_scale = stbi__l2h_scale;
+   stbi__l2h_table_set = 1;
+#endif
+   return table;
+}
+
 static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
-   int i,k,n;
+   int i,k,n,count;
    float *output;
+   float built[512];
+   float const *table;
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
    if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
-      }
-   }
-   if (n < comp) {
-      for (i=0; i < x*y; ++i) {
-         output[i*comp + n] = data[i*comp + n]/255.0f;
-      }
+   table = stbi__ldr_to_hdr_table(built);
+   count = x*y*comp;
+   i = 0;
+#ifdef STBI__AVX2
+   if (stbi_simd_level() >= STBI_SIMD_AVX2)
+      i = stbi__ldr_to_hdr_avx2(output, data, count, table, comp);
+#endif
+   for (k = i % comp; i < count; ++i) {
+      output[i] = table[(k < n ? 0 : 256) + data[i]];
+      if (++k == comp) k = 0;
    }
    STBI_FREE(data);
    return output;
@@ -1861,27 +2346,88 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
+static int stbi__hdr_to_ldr_component(float v)
+{
+   float z = (float) pow(v*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
+   if (z < 0) z = 0;
+   if (z > 255) z = 255;
+   return stbi__float2int(z);
+}
+
+// with a positive gamma and scale stbi__hdr_to_ldr_component never
+// decreases as v grows, so the smallest v giving each of the 256 outputs,
+// which a binary search over the bits of the positive floats finds, tells
+// the output of any v >= 0 with 8 comparisons instead of pow; the result
+// is the same
+static int stbi__hdr_to_ldr_thresholds(float t[256])
+{
+   stbi__uint32 lo = 0, hi, mid;
+   float f;
+   int v;
+   if (!(stbi__h2l_gamma_i > 0 && stbi__h2l_scale_i > 0)) return 0;
+   for (v=1; v < 256; ++v) {
+      // the threshold of v-1, in lo, is not above this one
+      hi = 0x7f800000; // +inf, which gives 255
+      while (lo < hi) {
+         mid = lo + (hi - lo) / 2;
+         memcpy(&f, &mid, sizeof(f));
+         if (stbi__hdr_to_ldr_component(f) >= v) hi = mid; else lo = mid + 1;
+      }
+      memcpy(&t[v], &lo, sizeof(f));
+   }
+   t[0] = 0;
+   return 1;
+}
+
+// the output for f, the last v whose threshold is not above it; negative
+// and NaN inputs, which HDR files don't give, go through pow as pow of a
+// negative number depends on the gamma
+static int stbi__hdr_to_ldr_search(float f, float const t[256])
+{
+   int v = 0;
+   if (!(f >= 0)) return stbi__hdr_to_ldr_component(f);
+   v += (f >= t[v + 128]) << 7;
+   v += (f >= t[v +  64]) << 6;
+   v += (f >= t[v +  32]) << 5;
+   v += (f >= t[v +  16]) << 4;
+   v += (f >= t[v +   8]) << 3;
+   v += (f >= t[v +   4]) << 2;
+   v += (f >= t[v +   2]) << 1;
+   v += (f >= t[v +   1]);
+   return v;
+}
+
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 {
    int i,k,n;
    stbi_uc *output;
+   float t[256];
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
    if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-         if (z < 0) z = 0;
-         if (z > 255) z = 255;
-         output[i*comp + k] = (stbi_uc) stbi__float2int(z);
+   // finding the thresholds takes about 8000 pow calls
+   if (x*y*n >= 16384 && stbi__hdr_to_ldr_thresholds(t)) {
+      if (n == comp) {
+         for (i=0; i < x*y*comp; ++i)
+            output[i] = (stbi_uc) stbi__hdr_to_ldr_search(data[i], t);
+      } else {
+         for (i=0; i < x*y; ++i)
+            for (k=0; k < n; ++k)
+               output[i*comp + k] = (stbi_uc) stbi__hdr_to_ldr_search(data[i*comp+k], t);
       }
-      if (k < comp) {
-         float z = data[i*comp+k] * 255 + 0.5f;
+   } else {
+      for (i=0; i < x*y; ++i)
+         for (k=0; k < n; ++k)
+            output[i*comp + k] = (stbi_uc) stbi__hdr_to_ldr_component(data[i*comp+k]);
+   }
+   if (n < comp) {
+      for (i=0; i < x*y; ++i) {
+         float z = data[i*comp+n] * 255 + 0.5f;
          if (z < 0) z = 0;
          if (z > 255) z = 255;
-         output[i*comp + k] = (stbi_uc) stbi__float2int(z);
+         output[i*comp + n] = (stbi_uc) stbi__float2int(z);
       }
    }
    STBI_FREE(data);
@@ -1926,6 +2472,29 @@ typedef struct
    int    delta[17];   // old 'firstsymbol' - old 'firstcode'
 } stbi__huffman;
 
+typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
+                                    int w, int hs);
+
+typedef struct
+{
+   resample_row_func resample;
+   stbi_uc *line0,*line1;
+   int hs,vs;   // expansion factor in each axis
+   int w_lores; // horizontal pixels pre-expansion
+   int ystep;   // how far through vertical expansion we are
+   int ypos;    // which pre-expansion row we're on
+} stbi__resample;
+
+// a progressive block in low memory mode: dc, and n nonzero ac coefficients
+// as (index, value) pairs at entry 'at' of the component's store, which has
+// room for cap of them there
+typedef struct
+{
+   stbi__uint32 at;
+   short dc;
+   stbi_uc n, cap;
+} stbi__jpeg_packed;
+
 typedef struct
 {
    stbi__context *s;
@@ -1933,11 +2502,14 @@ typedef struct
    stbi__huffman huff_ac[4];
    stbi__uint16 dequant[4][64];
    stbi__int16 fast_ac[4][1 << FAST_BITS];
+   stbi__int16 fast_dc[4][1 << FAST_BITS];
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
    int img_mcu_x, img_mcu_y;
-   int img_mcu_w, img_mcu_h;
+   int img_mcu_w, img_mcu_h;    // in output pixels
+   int scale;                   // output is downscaled by 1 << scale
+   stbi__uint32 code_y;         // height before scaling
 
 // definition of jpeg image component
    struct
@@ -1949,19 +2521,28 @@ typedef struct
       int dc_pred;
 
       int x,y,w2,h2;
+      int rows;         // rows in data, fewer than h2 for a strip (row y is at y % rows)
+      int clear_from;   // strip rows from here on were never decoded, cleared as they're reached
+      int scale;        // blocks are IDCT'd to (8 >> scale) pixels square
+      void (*idct)(stbi_uc *out, int out_stride, short data[64]);
       stbi_uc *data;
       void *raw_data, *raw_coeff;
       stbi_uc *linebuf;
       short   *coeff;   // progressive only
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      size_t   coeff_size;       // of raw_coeff
+      stbi__jpeg_packed *packed; // instead of coeff in low memory mode
+      short   *store;            // entries of the packed blocks
+      size_t   store_n, store_cap;
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   size_t         code_buffer; // jpeg entropy-coded buffer, msb first
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
 
    int            progressive;
+   int            low_memory;
    int            spec_start;
    int            spec_end;
    int            succ_high;
@@ -1973,9 +2554,17 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scans;        // entropy coded segments decoded so far
+
+// output, resampled and color converted while decoding when possible
+   int req_comp, out_n, decode_n, is_rgb;
+   int out_y;        // output rows done
+   stbi_uc *output;
+   stbi__resample res_comp[4];
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block_x2_kernel)(stbi_uc *out, int out_stride, short data[128]); // optional
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2049,27 +2638,89 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
    }
 }
 
+// build a table that decodes both magnitude and value of small DCs in one go
+static void stbi__build_fast_dc(stbi__int16 *fast_dc, stbi__huffman *h)
+{
+   int i;
+   for (i=0; i < (1 << FAST_BITS); ++i) {
+      stbi_uc fast = h->fast[i];
+      fast_dc[i] = 0;
+      if (fast < 255) {
+         int magbits = h->values[fast];
+         int len = h->size[fast];
+
+         if (magbits <= 15 && len + magbits <= FAST_BITS) {
+            // same as the fast ac table, the diff fits in 9 bits
+            int k = 0;
+            if (magbits) {
+               int m = 1 << (magbits - 1);
+               k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
+               if (k < m) k += (~0U << magbits) + 1;
+            }
+            fast_dc[i] = (stbi__int16) ((k * 16) + (len + magbits));
+         }
+      }
+   }
+}
+
+// the bit buffer is as wide as a register
+#define STBI__JBITS  ((int) sizeof(size_t) * 8)
+
+// next sizeof(size_t) bytes at p as a big-endian number
+stbi_inline static size_t stbi__jpeg_load_be(stbi_uc const *p)
+{
+   size_t v;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   memcpy(&v, p, sizeof(v));
+   if (sizeof(v) == 8) v = (size_t) __builtin_bswap64((unsigned long long) v);
+   else                v = (size_t) __builtin_bswap32((unsigned int) v);
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64))
+   memcpy(&v, p, sizeof(v));
+   if (sizeof(v) == 8) v = (size_t) _byteswap_uint64((unsigned __int64) v);
+   else                v = (size_t) _byteswap_ulong((unsigned long) v);
+#else
+   int i;
+   v = 0;
+   for (i=0; i < (int) sizeof(v); ++i)
+      v = (v << 8) | p[i];
+#endif
+   return v;
+}
+
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   if (!j->nomore && s->img_buffer_end - s->img_buffer >= (int) sizeof(size_t)) {
+      // take as many whole bytes as fit at once, unless a 0xff (stuffing
+      // or a marker) is among the next few bytes
+      size_t w, ones = ((size_t) -1) / 255;
+      memcpy(&w, s->img_buffer, sizeof(w));
+      w = ~w;
+      if (((w - ones) & ~w & (ones << 7)) == 0) {
+         int n = (STBI__JBITS - j->code_bits) >> 3;
+         size_t v = stbi__jpeg_load_be(s->img_buffer) >> (STBI__JBITS - n * 8);
+         j->code_buffer |= v << (STBI__JBITS - n * 8 - j->code_bits);
+         j->code_bits += n * 8;
+         s->img_buffer += n;
+         return;
+      }
+   }
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      if (b) j->code_buffer |= (size_t) b << (STBI__JBITS - 8 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= STBI__JBITS - 8);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -2080,7 +2731,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (STBI__JBITS - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2097,7 +2748,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> (STBI__JBITS - 16));
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2111,8 +2762,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (STBI__JBITS - k)) + h->delta[k];
+   STBI_ASSERT((j->code_buffer >> (STBI__JBITS - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2131,10 +2782,9 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
    int sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> (STBI__JBITS - 1)); // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
+   k = (unsigned int) (j->code_buffer >> (STBI__JBITS - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & (sgn - 1));
 }
@@ -2144,21 +2794,20 @@ stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
    unsigned int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (unsigned int) (j->code_buffer >> (STBI__JBITS - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> (STBI__JBITS - 1));
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2179,19 +2828,26 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
+static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__int16 *fdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
 {
    int diff,dc,k;
    int t;
 
    if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-   t = stbi__jpeg_huff_decode(j, hdc);
-   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+   t = fdc[j->code_buffer >> (STBI__JBITS - FAST_BITS)];
+   if (t && (t & 15) <= j->code_bits) { // fast-DC path
+      j->code_buffer <<= t & 15;
+      j->code_bits -= t & 15;
+      diff = t >> 4;
+   } else {
+      t = stbi__jpeg_huff_decode(j, hdc);
+      if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+      diff = t ? stbi__extend_receive(j, t) : 0;
+   }
 
    // 0 all the ac values now so we can do it 32-bits at a time
    memset(data,0,64*sizeof(data[0]));
 
-   diff = t ? stbi__extend_receive(j, t) : 0;
    dc = j->img_comp[b].dc_pred + diff;
    j->img_comp[b].dc_pred = dc;
    data[0] = (short) (dc * dequant[0]);
@@ -2202,7 +2858,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (STBI__JBITS - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2277,7 +2933,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (STBI__JBITS - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2378,6 +3034,82 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
    return 1;
 }
 
+// all 64 coefficients of a packed block
+static void stbi__jpeg_unpack(stbi__jpeg *j, int n, stbi__jpeg_packed *b, short data[64])
+{
+   short *e = j->img_comp[n].store + 2 * (size_t) b->at;
+   int k;
+   memset(data, 0, 64*sizeof(data[0]));
+   data[0] = b->dc;
+   for (k=0; k < b->n; ++k)
+      data[e[2*k]] = e[2*k+1];
+}
+
+// stores the ac coefficients of data[] into block b, moving it to the end of
+// the store if they don't fit where it is (its old entries are not reused)
+static int stbi__jpeg_pack(stbi__jpeg *j, int n, stbi__jpeg_packed *b, short data[64])
+{
+   short *e;
+   int k, count = 0;
+   for (k=1; k < 64; ++k)
+      count += data[k] != 0;
+   if (count > b->cap) {
+      int cap = (count + 3) & ~3;
+      if (j->img_comp[n].store_n + cap > j->img_comp[n].store_cap) {
+         size_t grow = j->img_comp[n].store_cap + j->img_comp[n].store_cap / 2 + cap;
+         short *p;
+         if (grow > 0x3fffffff) return stbi__err("outofmem", "Out of memory");
+         p = (short *) STBI_REALLOC_SIZED(j->img_comp[n].store, j->img_comp[n].store_cap * 4, grow * 4);
+         if (p == NULL) return stbi__err("outofmem", "Out of memory");
+         j->img_comp[n].store = p;
+         j->img_comp[n].store_cap = grow;
+      }
+      b->at = (stbi__uint32) j->img_comp[n].store_n;
+      b->cap = (stbi_uc) cap;
+      j->img_comp[n].store_n += cap;
+   }
+   e = j->img_comp[n].store + 2 * (size_t) b->at;
+   for (k=1; k < 64; ++k) {
+      if (data[k]) {
+         *e++ = (short) k;
+         *e++ = data[k];
+      }
+   }
+   b->n = (stbi_uc) count;
+   return 1;
+}
+
+static int stbi__jpeg_decode_block_prog_packed(stbi__jpeg *j, int n, stbi__jpeg_packed *b)
+{
+   short data[64];
+   if (j->spec_start == 0) {
+      data[0] = b->dc;
+      if (!stbi__jpeg_decode_block_prog_dc(j, data, &j->huff_dc[j->img_comp[n].hd], n)) return 0;
+      if (j->succ_high == 0) b->n = 0; // the first scan clears the block
+      b->dc = data[0];
+      return 1;
+   }
+   // a block in an end-of-band run of a first scan is left as it is
+   if (j->succ_high == 0 && j->eob_run) {
+      --j->eob_run;
+      return 1;
+   }
+   stbi__jpeg_unpack(j, n, b, data);
+   if (!stbi__jpeg_decode_block_prog_ac(j, data, &j->huff_ac[j->img_comp[n].ha], j->fast_ac[j->img_comp[n].ha])) return 0;
+   return stbi__jpeg_pack(j, n, b, data);
+}
+
+// one block of a progressive scan, bx, by in blocks
+static int stbi__jpeg_decode_block_prog(stbi__jpeg *j, int n, int bx, int by)
+{
+   size_t b = (size_t) by * j->img_comp[n].coeff_w + bx;
+   if (j->img_comp[n].packed)
+      return stbi__jpeg_decode_block_prog_packed(j, n, j->img_comp[n].packed + b);
+   if (j->spec_start == 0)
+      return stbi__jpeg_decode_block_prog_dc(j, j->img_comp[n].coeff + 64*b, &j->huff_dc[j->img_comp[n].hd], n);
+   return stbi__jpeg_decode_block_prog_ac(j, j->img_comp[n].coeff + 64*b, &j->huff_ac[j->img_comp[n].ha], j->fast_ac[j->img_comp[n].ha]);
+}
+
 // take a -128..127 value and stbi__clamp it and convert to 0..255
 stbi_inline static stbi_uc stbi__clamp(int x)
 {
@@ -2489,23 +3221,103 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
-#ifdef STBI_SSE2
-// sse2 integer IDCT. not the fastest possible implementation but it
-// produces bit-identical results to the generic C version so it's
-// fully "transparent".
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+// reduced IDCTs for scaled decoding: the 8x8 IDCT averaged over 2x2 or 4x4
+// pixels (as in jidctred), with the averaging and the 1/sqrt(8) scaling of
+// each direction folded into the constants. Coefficient 4 cancels out of a
+// pair average, and 2, 4 and 6 out of an average of four.
+#define STBI__IDCT_1D_4(s0,s1,s2,s3,s5,s6,s7)                                   \
+   int e0,e1,o0,o1;                                                             \
+   e0 = s0*stbi__f2f(0.353553391f);                                             \
+   e1 = e0 - s2*stbi__f2f(0.326640741f) + s6*stbi__f2f(0.135299025f);           \
+   e0 = e0 + s2*stbi__f2f(0.326640741f) - s6*stbi__f2f(0.135299025f);           \
+   o0 = s1*stbi__f2f(0.453063723f) + s3*stbi__f2f(0.159094823f)                 \
+      - s5*stbi__f2f(0.106303762f) - s7*stbi__f2f(0.090119978f);                \
+   o1 = s1*stbi__f2f(0.187665139f) - s3*stbi__f2f(0.384088878f)                 \
+      + s5*stbi__f2f(0.256639984f) - s7*stbi__f2f(0.037328917f);
+
+#define STBI__IDCT_1D_2(s0,s1,s3,s5,s7)                                         \
+   int e,o;                                                                     \
+   e = s0*stbi__f2f(0.353553391f);                                              \
+   o = s1*stbi__f2f(0.320364431f) - s3*stbi__f2f(0.112497028f)                  \
+     + s5*stbi__f2f(0.075168111f) - s7*stbi__f2f(0.063724447f);
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
 {
-   // This is constructed to match our regular (generic) integer IDCT exactly.
-   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
-   __m128i tmp;
+   int i,val[32],*v=val;
+   short *d = data;
 
-   // dot product constant: even elems=x, odd elems=y
-   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+   // columns, keeping 2 extra bits of precision; column 4 isn't needed
+   for (i=0; i < 8; ++i,++d,++v) {
+      if (i == 4) continue;
+      if (d[ 8]==0 && d[16]==0 && d[24]==0 && d[40]==0 && d[48]==0 && d[56]==0) {
+         v[0] = v[8] = v[16] = v[24] = (d[0]*stbi__f2f(0.353553391f) + 512) >> 10;
+      } else {
+         STBI__IDCT_1D_4(d[0],d[8],d[16],d[24],d[40],d[48],d[56])
+         e0 += 512; e1 += 512;
+         v[ 0] = (e0+o0) >> 10;
+         v[24] = (e0-o0) >> 10;
+         v[ 8] = (e1+o1) >> 10;
+         v[16] = (e1-o1) >> 10;
+      }
+   }
 
-   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
-   // out(1) = c1[even]*x + c1[odd]*y
-   #define dct_rot(out0,out1, x,y,c0,c1) \
-      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+   // rows; round, add the 128 bias and remove 1<<12 and 1<<2
+   for (i=0, v=val; i < 4; ++i,v+=8,out+=out_stride) {
+      STBI__IDCT_1D_4(v[0],v[1],v[2],v[3],v[5],v[6],v[7])
+      e0 += (1<<13) + (128<<14);
+      e1 += (1<<13) + (128<<14);
+      out[0] = stbi__clamp((e0+o0) >> 14);
+      out[3] = stbi__clamp((e0-o0) >> 14);
+      out[1] = stbi__clamp((e1+o1) >> 14);
+      out[2] = stbi__clamp((e1-o1) >> 14);
+   }
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   static const unsigned char cols[5] = { 0,1,3,5,7 };
+   int i,val[16],*v;
+
+   // columns 0 and the odd ones, the others average out
+   for (i=0; i < 5; ++i) {
+      short *d = data + cols[i];
+      STBI__IDCT_1D_2(d[0],d[8],d[24],d[40],d[56])
+      e += 512;
+      val[cols[i]]   = (e+o) >> 10;
+      val[cols[i]+8] = (e-o) >> 10;
+   }
+
+   for (i=0, v=val; i < 2; ++i,v+=8,out+=out_stride) {
+      STBI__IDCT_1D_2(v[0],v[1],v[3],v[5],v[7])
+      e += (1<<13) + (128<<14);
+      out[0] = stbi__clamp((e+o) >> 14);
+      out[1] = stbi__clamp((e-o) >> 14);
+   }
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
+#ifdef STBI_SSE2
+// sse2 integer IDCT. not the fastest possible implementation but it
+// produces bit-identical results to the generic C version so it's
+// fully "transparent".
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   // This is constructed to match our regular (generic) integer IDCT exactly.
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
       __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
       __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
       __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
@@ -2670,6 +3482,182 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI__AVX2
+// AVX2 version of the sse2 IDCT above working on two horizontally adjacent
+// blocks at once, one per 128-bit lane (data[0..63] is the left block and
+// data[64..127] the right one). All the unpacks and packs used for the
+// transposes operate within lanes, so each lane computes exactly what the
+// sse2 version does and the results stay bit-identical.
+static STBI__TARGET_AVX2 void stbi__idct_avx2_x2(stbi_uc *out, int out_stride, short data[128])
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // left block in the low lane, right block in the high lane
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data + (k)*8))), \
+                              _mm_loadu_si128((const __m128i *) (data + 64 + (k)*8)), 1)
+
+   // lanes hold rows r and r+1 of each block as 64-bit halves; reorder them
+   // so that row r of both blocks is contiguous and store 16 bytes per row
+   #define dct_store2(p) \
+      tmp = _mm256_permute4x64_epi64(p, 0xd8); \
+      _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(tmp)); out += out_stride; \
+      _mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(tmp, 1)); out += out_stride
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose (per lane)
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose (per lane)
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // store
+      dct_store2(p0);
+      dct_store2(p2);
+      dct_store2(p1);
+      dct_store2(p3);
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store2
+}
+#endif // STBI__AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2897,6 +3885,27 @@ static stbi_uc stbi__get_marker(stbi__jpeg *j)
 // of the components is specified by order[]
 #define STBI__RESTART(x)     ((x) >= 0xd0 && (x) <= 0xd7)
 
+// row y of component n (the component buffer may be a strip used as a ring)
+static stbi_uc *stbi__jpeg_row(stbi__jpeg *z, int n, int y)
+{
+   return z->img_comp[n].data + (size_t) (y % z->img_comp[n].rows) * z->img_comp[n].w2;
+}
+
+static void stbi__jpeg_emit_rows(stbi__jpeg *z, int y_end);
+
+// IDCT of count horizontally adjacent blocks of component n, data[64*k]
+// goes to the k-th block from out; full size blocks go two at a time when
+// there is a kernel for that
+static void stbi__jpeg_idct_row(stbi__jpeg *z, int n, stbi_uc *out, short *data, int count)
+{
+   int k = 0, stride = z->img_comp[n].w2, bw = 8 >> z->img_comp[n].scale;
+   if (z->idct_block_x2_kernel && bw == 8)
+      for (; k+1 < count; k += 2)
+         z->idct_block_x2_kernel(out + k*8, stride, data + 64*k);
+   for (; k < count; ++k)
+      z->img_comp[n].idct(out + k*bw, stride, data + 64*k);
+}
+
 // after a restart interval, stbi__jpeg_reset the entropy decoder and
 // the dc prediction
 static void stbi__jpeg_reset(stbi__jpeg *j)
@@ -2912,13 +3921,243 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// scan an interleaved mcu... process scan_n components in order
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int i, int j)
+{
+   int k,x,y;
+   STBI_SIMD_ALIGN(short, data[64*4]);
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      // scan out an mcu's worth of this component; that's just determined
+      // by the basic H and V specified for the component
+      int bw = 8 >> z->img_comp[n].scale;
+      for (y=0; y < z->img_comp[n].v; ++y) {
+         int y2 = (j*z->img_comp[n].v + y)*bw;
+         for (x=0; x < z->img_comp[n].h; ++x) {
+            int ha = z->img_comp[n].ha;
+            if (!stbi__jpeg_decode_block(z, data+64*x, z->huff_dc+z->img_comp[n].hd, z->fast_dc[z->img_comp[n].hd], z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         }
+         // a row of an mcu is horizontally adjacent blocks
+         stbi__jpeg_idct_row(z, n, stbi__jpeg_row(z, n, y2) + i*z->img_comp[n].h*bw, data, z->img_comp[n].h);
+      }
+   }
+   return 1;
+}
+
+// Sequential scans with restart intervals decoded from memory are split at
+// their RSTn markers and the intervals are decoded by stbi__run_parallel,
+// a batch of them at a time so that the component strips stay small.
+
+#define STBI__JPEG_BATCH_MCU_ROWS 16 // approximate mcu rows per parallel batch
+
+// units (mcus, or blocks for a single component scan) per row and rows of
+// them in the current scan, and image rows per row of units
+static void stbi__jpeg_scan_units(stbi__jpeg *z, int *w, int *h, int *rows)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      *w = (z->img_comp[n].x+7) >> 3;
+      *h = (z->img_comp[n].y+7) >> 3;
+      *rows = 8 >> z->img_comp[n].scale;
+   } else {
+      *w = z->img_mcu_x;
+      *h = z->img_mcu_y;
+      *rows = z->img_mcu_h;
+   }
+}
+
+static int stbi__jpeg_parallel_possible(stbi__jpeg *z)
+{
+   return stbi__parallel_for && z->restart_interval > 0 && !z->progressive && !z->s->read_from_callbacks;
+}
+
+// restart intervals per batch; returns the mcu rows a component strip needs
+// for it: the rows a batch spans plus the previous, partial and next ones
+static int stbi__jpeg_batch(stbi__jpeg *z, int *intervals)
+{
+   int w = z->img_mcu_x;
+   int n = (STBI__JPEG_BATCH_MCU_ROWS * w + z->restart_interval - 1) / z->restart_interval;
+   if (n < 1) n = 1;
+   if (intervals) *intervals = n;
+   // a single component scan has 8x8 block units, at least as many per row
+   // as there are mcus, so this is enough for it too
+   return (n * z->restart_interval + w - 1) / w + 3;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **begin;        // entropy coded data of each interval, with its marker
+   stbi_uc *ok;            // per interval result
+   int first, count;       // intervals of the current batch
+   int n;                  // intervals in the scan
+   int units;              // units in the scan
+   stbi_uc *end;           // where the last interval's bit reader stopped
+   unsigned char marker;   // and the marker it ran into, if any
+} stbi__jpeg_restarts;
+
+// decodes one interval exactly as the serial decoder would, failing if it
+// does not end at its restart marker so the serial decoder can take over;
+// the window of each interval ends with its marker, which is as far as the
+// serial bit reader gets too
+static int stbi__jpeg_decode_interval(stbi__jpeg *j, stbi__jpeg_restarts *r, int k)
+{
+   stbi__context s;
+   int u = k * j->restart_interval;
+   int last = u + j->restart_interval;
+   if (last > r->units) last = r->units;
+   stbi__start_mem(&s, r->begin[k], (int) (r->begin[k+1] - r->begin[k]));
+   j->s = &s;
+   stbi__jpeg_reset(j);
+   if (j->scan_n == 1) {
+      STBI_SIMD_ALIGN(short, data[64]);
+      int n = j->order[0];
+      int w = (j->img_comp[n].x+7) >> 3;
+      int bw = 8 >> j->img_comp[n].scale;
+      int ha = j->img_comp[n].ha;
+      for (; u < last; ++u) {
+         if (!stbi__jpeg_decode_block(j, data, j->huff_dc+j->img_comp[n].hd, j->fast_dc[j->img_comp[n].hd], j->huff_ac+ha, j->fast_ac[ha], n, j->dequant[j->img_comp[n].tq])) return 0;
+         stbi__jpeg_idct_row(j, n, stbi__jpeg_row(j, n, u / w * bw) + u % w * bw, data, 1);
+      }
+   } else {
+      for (; u < last; ++u)
+         if (!stbi__jpeg_decode_mcu(j, u % j->img_mcu_x, u / j->img_mcu_x)) return 0;
+   }
+   // the serial loop looks for the marker when the count runs out, which
+   // for the last interval also decides where the scan ends
+   if (last - k * j->restart_interval == j->restart_interval) {
+      if (j->code_bits < 24) stbi__grow_buffer_unsafe(j);
+      if (k+1 < r->n && !STBI__RESTART(j->marker)) return 0;
+   }
+   if (k+1 == r->n) {
+      r->end = s.img_buffer;
+      r->marker = j->marker;
+   }
+   return 1;
+}
+
+static void stbi__jpeg_restarts_task(void *task_data, int k, int n)
+{
+   stbi__jpeg_restarts *r = (stbi__jpeg_restarts *) task_data;
+   // each task needs its own bit reader; huffman tables are shared by copy
+   stbi__jpeg *j = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (j) memcpy(j, r->z, sizeof(*j));
+   for (; k < r->count; k += n)
+      r->ok[r->first + k] = j && stbi__jpeg_decode_interval(j, r, r->first + k);
+   if (j) STBI_FREE(j);
+}
+
+// returns -1 if the scan has to be decoded serially: no usable restart
+// markers, or an interval that fails or doesn't end where the markers say,
+// in which case the serial decoder's error or recovery behaviour applies
+static int stbi__jpeg_parse_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_restarts r;
+   stbi_uc *start = z->s->img_buffer, *p = start, *e = z->s->img_buffer_end, *term = NULL;
+   int w, h, rows, n, k, batch, result = 1;
+
+   stbi__jpeg_scan_units(z, &w, &h, &rows);
+   r.z = z;
+   r.units = w * h;
+   r.n = n = (r.units + z->restart_interval - 1) / z->restart_interval;
+   if (n < 2) return -1;
+   r.begin = (stbi_uc **) stbi__malloc_mad2(n+1, sizeof(stbi_uc *), 0);
+   r.ok = (stbi_uc *) stbi__malloc(n);
+   if (!r.begin || !r.ok) {
+      if (r.begin) STBI_FREE(r.begin);
+      if (r.ok) STBI_FREE(r.ok);
+      return -1;
+   }
+
+   // find the RSTn markers and the marker ending the scan; anything
+   // unexpected is left to the serial decoder and its error handling
+   k = 0;
+   r.begin[0] = p;
+   while (p < e) {
+      stbi_uc *q;
+      if (*p != 0xff) { ++p; continue; }
+      q = p + 1;
+      while (q < e && *q == 0xff) ++q; // fill bytes
+      if (q == e) break;
+      if (*q == 0) { p = q + 1; continue; } // stuffed zero
+      r.begin[k+1] = q + 1;
+      if (!STBI__RESTART(*q)) { term = p; break; }
+      if (*q != 0xd0 + (k & 7) || k+1 == n) break;
+      p = r.begin[++k];
+   }
+   if (!term || k != n-1) {
+      STBI_FREE(r.begin);
+      STBI_FREE(r.ok);
+      return -1;
+   }
+
+   stbi__jpeg_batch(z, &batch);
+   for (r.first = 0; r.first < n && result; r.first += batch) {
+      r.count = n - r.first < batch ? n - r.first : batch;
+      stbi__run_parallel(stbi__jpeg_restarts_task, &r, r.count);
+      for (k=r.first; k < r.first + r.count; ++k)
+         if (!r.ok[k]) result = 0;
+      // convert all but the last complete row of units of the batch
+      if (result && z->scan_n == z->s->img_n) {
+         int done = r.first + r.count == n ? h : (r.first + r.count) * z->restart_interval / w;
+         stbi__jpeg_emit_rows(z, (done - 1) * rows);
+      }
+   }
+   STBI_FREE(r.begin);
+   STBI_FREE(r.ok);
+
+   // continue where the serial decoder would have stopped reading, or start
+   // over serially; rows already converted are skipped when emitting and the
+   // ones still pending are decoded again in the same order
+   stbi__jpeg_reset(z);
+   if (result) {
+      z->s->img_buffer = r.end;
+      z->marker = r.marker;
+   } else {
+      z->s->img_buffer = start;
+   }
+   return result ? 1 : -1;
+}
+
+// a sequential scan that ends after u units leaves the rest as if it never
+// got to them: zero, whether a parallel batch decoded them before falling
+// back or a strip still holds rows from further up
+static void stbi__jpeg_clear_units(stbi__jpeg *z, int u)
+{
+   int w, h, rows, k;
+   stbi__jpeg_scan_units(z, &w, &h, &rows);
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      int bw = 8 >> z->img_comp[n].scale;
+      int uw = z->scan_n == 1 ? bw : z->img_comp[n].h * bw; // unit size in this component
+      int uh = z->scan_n == 1 ? bw : z->img_comp[n].v * bw;
+      int y = u / w * uh, y_end = y + uh;
+      for (; y < y_end && y < z->img_comp[n].h2; ++y)
+         memset(stbi__jpeg_row(z, n, y) + u % w * uw, 0, z->img_comp[n].w2 - u % w * uw);
+      if (z->img_comp[n].rows < z->img_comp[n].h2) {
+         // later rows share the strip with rows still to be converted
+         if (z->img_comp[n].clear_from > y) z->img_comp[n].clear_from = y;
+      } else {
+         for (; y < z->img_comp[n].h2; ++y)
+            memset(stbi__jpeg_row(z, n, y), 0, z->img_comp[n].w2);
+      }
+   }
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+   int first = z->scans++ == 0;
    stbi__jpeg_reset(z);
+   // another scan into strips only happens in corrupt streams and is decoded
+   // serially: a parallel batch decodes ahead into rows still to be converted
+   if (stbi__jpeg_parallel_possible(z) && (first || z->img_comp[0].rows == z->img_comp[0].h2)) {
+      int r = stbi__jpeg_parse_parallel(z);
+      if (r >= 0) return r;
+   }
    if (!z->progressive) {
       if (z->scan_n == 1) {
          int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
+         STBI_SIMD_ALIGN(short, data[128]);
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2926,50 +4165,56 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
+         int bw = 8 >> z->img_comp[n].scale;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               // blocks are decoded in pairs so that the IDCT can do two at once
+               short *block = data + 64 * (i & 1);
+               stbi_uc *out = stbi__jpeg_row(z, n, j*bw) + (i & ~1)*bw;
+               if (!stbi__jpeg_decode_block(z, block, z->huff_dc+z->img_comp[n].hd, z->fast_dc[z->img_comp[n].hd], z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               if (i & 1)
+                  stbi__jpeg_idct_row(z, n, out, data, 2);
+               else if (i == w-1)
+                  stbi__jpeg_idct_row(z, n, out, data, 1);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) {
+                     if ((i & 1) == 0 && i != w-1) stbi__jpeg_idct_row(z, n, out, data, 1);
+                     stbi__jpeg_clear_units(z, j*w + i+1);
+                     return 1;
+                  }
                   stbi__jpeg_reset(z);
                }
             }
+            // a single component image needs no other rows to convert these
+            if (z->s->img_n == 1)
+               stbi__jpeg_emit_rows(z, (j+1)*bw);
          }
          return 1;
       } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
+         int i,j;
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
+               if (!stbi__jpeg_decode_mcu(z, i, j)) return 0;
                // after all interleaved components, that's an interleaved MCU,
                // so now count down the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) {
+                     stbi__jpeg_clear_units(z, j*z->img_mcu_x + i+1);
+                     return 1;
+                  }
                   stbi__jpeg_reset(z);
                }
             }
+            // with every component in this scan the previous mcu row can be
+            // converted now, it only needed the first rows of this one
+            if (z->scan_n == z->s->img_n)
+               stbi__jpeg_emit_rows(z, j*z->img_mcu_h);
          }
          return 1;
       }
@@ -2985,15 +4230,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               if (z->spec_start == 0) {
-                  if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                     return 0;
-               } else {
-                  int ha = z->img_comp[n].ha;
-                  if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
-                     return 0;
-               }
+               if (!stbi__jpeg_decode_block_prog(z, n, i, j))
+                  return 0;
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -3016,8 +4254,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                      for (x=0; x < z->img_comp[n].h; ++x) {
                         int x2 = (i*z->img_comp[n].h + x);
                         int y2 = (j*z->img_comp[n].v + y);
-                        short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
-                        if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
+                        if (z->spec_start != 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
+                        if (!stbi__jpeg_decode_block_prog(z, n, x2, y2))
                            return 0;
                      }
                   }
@@ -3043,23 +4281,80 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
+static int stbi__jpeg_start_output(stbi__jpeg *z, int strip);
+
+typedef struct
+{
+   stbi__jpeg *z;
+   int first[4], count[4]; // block rows of each component in the batch
+   int items;              // block rows in the batch
+} stbi__jpeg_idct_rows;
+
+// dequantize and idct one row of blocks of a progressive component
+static void stbi__jpeg_finish_row(stbi__jpeg *z, int n, int j)
+{
+   int i, w = (z->img_comp[n].x+7) >> 3;
+   int bw = 8 >> z->img_comp[n].scale;
+   stbi__uint16 *dequant = z->dequant[z->img_comp[n].tq];
+   stbi_uc *out = stbi__jpeg_row(z, n, j*bw);
+   if (z->img_comp[n].packed) {
+      STBI_SIMD_ALIGN(short, data[128]);
+      stbi__jpeg_packed *b = z->img_comp[n].packed + (size_t) j * z->img_comp[n].coeff_w;
+      for (i=0; i < w; i += 2) {
+         int count = i+1 < w ? 2 : 1;
+         stbi__jpeg_unpack(z, n, b+i, data);
+         stbi__jpeg_dequantize(data, dequant);
+         if (count == 2) {
+            stbi__jpeg_unpack(z, n, b+i+1, data+64);
+            stbi__jpeg_dequantize(data+64, dequant);
+         }
+         stbi__jpeg_idct_row(z, n, out + i*bw, data, count);
+      }
+   } else {
+      // coefficients of adjacent blocks are contiguous
+      short *data = z->img_comp[n].coeff + 64 * (size_t) j * z->img_comp[n].coeff_w;
+      for (i=0; i < w; ++i)
+         stbi__jpeg_dequantize(data + 64*i, dequant);
+      stbi__jpeg_idct_row(z, n, out, data, w);
+   }
+}
+
+static void stbi__jpeg_idct_rows_task(void *task_data, int k, int n)
+{
+   stbi__jpeg_idct_rows *r = (stbi__jpeg_idct_rows *) task_data;
+   for (; k < r->items; k += n) {
+      int c = 0, j = k;
+      while (j >= r->count[c])
+         j -= r->count[c++];
+      stbi__jpeg_finish_row(r->z, c, r->first[c] + j);
+   }
+}
+
 static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
+      // dequantize and idct the data a batch of mcu rows at a time, the rows
+      // of all components in parallel, converting up to the last mcu row of
+      // the batch as soon as the batch is done
+      stbi__jpeg_idct_rows r;
+      int m, n, batch = stbi__parallel_for ? STBI__JPEG_BATCH_MCU_ROWS : 1;
+      r.z = z;
+      for (m=0; m < z->img_mcu_y; m += batch) {
+         int count = z->img_mcu_y - m < batch ? z->img_mcu_y - m : batch;
+         r.items = 0;
+         for (n=0; n < z->decode_n; ++n) {
+            int h = (z->img_comp[n].y+7) >> 3;
+            int end = (m+count) * z->img_comp[n].v;
+            r.first[n] = m * z->img_comp[n].v;
+            r.count[n] = (end < h ? end : h) - r.first[n];
+            if (r.count[n] < 0) r.count[n] = 0;
+            r.items += r.count[n];
          }
+         stbi__run_parallel(stbi__jpeg_idct_rows_task, &r, r.items);
+         stbi__jpeg_emit_rows(z, (m+count-1)*z->img_mcu_h);
       }
    }
+   stbi__jpeg_emit_rows(z, z->s->img_y);
 }
 
 static int stbi__process_marker(stbi__jpeg *z, int m)
@@ -3114,6 +4409,8 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
                v[i] = stbi__get8(z->s);
             if (tc != 0)
                stbi__build_fast_ac(z->fast_ac[th], z->huff_ac + th);
+            else
+               stbi__build_fast_dc(z->fast_dc[th], z->huff_dc + th);
             L -= n;
          }
          return L==0;
@@ -3204,6 +4501,127 @@ static int stbi__process_scan_header(stbi__jpeg *z)
    return 1;
 }
 
+static int stbi__jpeg_low_memory = 0;
+
+STBIDEF void stbi_set_jpeg_low_memory(int flag_true_if_low_memory)
+{
+   stbi__jpeg_low_memory = flag_true_if_low_memory;
+}
+
+// coefficient buffers of earlier progressive JPEGs, oldest first, kept for
+// the next ones decoded on the same thread
+static size_t stbi__jpeg_pool_limit = 0;
+
+#ifdef STBI_THREAD_LOCAL
+#define STBI__JPEG_POOL_SIZE  8
+
+static STBI_THREAD_LOCAL void  *stbi__jpeg_pool[STBI__JPEG_POOL_SIZE];
+static STBI_THREAD_LOCAL size_t stbi__jpeg_pool_size[STBI__JPEG_POOL_SIZE];
+static STBI_THREAD_LOCAL size_t stbi__jpeg_pool_bytes;
+static STBI_THREAD_LOCAL int    stbi__jpeg_pool_n;
+
+static void *stbi__jpeg_pool_remove(int i)
+{
+   void *p = stbi__jpeg_pool[i];
+   stbi__jpeg_pool_bytes -= stbi__jpeg_pool_size[i];
+   --stbi__jpeg_pool_n;
+   for (; i < stbi__jpeg_pool_n; ++i) {
+      stbi__jpeg_pool[i] = stbi__jpeg_pool[i+1];
+      stbi__jpeg_pool_size[i] = stbi__jpeg_pool_size[i+1];
+   }
+   return p;
+}
+
+static void stbi__jpeg_pool_trim(size_t limit)
+{
+   while (stbi__jpeg_pool_n && stbi__jpeg_pool_bytes > limit)
+      STBI_FREE(stbi__jpeg_pool_remove(0));
+}
+
+// the smallest kept buffer of at least size bytes, or a new one; *got is
+// set to the size of the buffer
+static void *stbi__jpeg_pool_malloc(size_t size, size_t *got)
+{
+   int i, best = -1;
+   for (i=0; i < stbi__jpeg_pool_n; ++i)
+      if (stbi__jpeg_pool_size[i] >= size && (best < 0 || stbi__jpeg_pool_size[i] < stbi__jpeg_pool_size[best]))
+         best = i;
+   if (best >= 0) {
+      *got = stbi__jpeg_pool_size[best];
+      return stbi__jpeg_pool_remove(best);
+   }
+   *got = size;
+   return stbi__malloc(size);
+}
+
+static void stbi__jpeg_pool_free(void *p, size_t size)
+{
+   if (p == NULL) return;
+   if (size > stbi__jpeg_pool_limit) {
+      STBI_FREE(p);
+      return;
+   }
+   stbi__jpeg_pool_trim(stbi__jpeg_pool_limit - size);
+   if (stbi__jpeg_pool_n == STBI__JPEG_POOL_SIZE)
+      STBI_FREE(stbi__jpeg_pool_remove(0));
+   stbi__jpeg_pool[stbi__jpeg_pool_n] = p;
+   stbi__jpeg_pool_size[stbi__jpeg_pool_n] = size;
+   stbi__jpeg_pool_bytes += size;
+   ++stbi__jpeg_pool_n;
+}
+#else
+static void stbi__jpeg_pool_trim(size_t limit)
+{
+   STBI_NOTUSED(limit);
+}
+
+static void *stbi__jpeg_pool_malloc(size_t size, size_t *got)
+{
+   *got = size;
+   return stbi__malloc(size);
+}
+
+static void stbi__jpeg_pool_free(void *p, size_t size)
+{
+   STBI_NOTUSED(size);
+   STBI_FREE(p);
+}
+#endif // STBI_THREAD_LOCAL
+
+STBIDEF void stbi_set_jpeg_buffer_pool(size_t max_bytes)
+{
+   stbi__jpeg_pool_limit = max_bytes;
+   stbi__jpeg_pool_trim(max_bytes);
+}
+
+// the coefficients of a progressive component, zeroed: either all of them,
+// or in low memory mode a packed block each and a store for their nonzero
+// coefficients that starts at 4 per block and grows as needed
+static int stbi__jpeg_alloc_coeff(stbi__jpeg *z, int n)
+{
+   size_t blocks = (size_t) z->img_comp[n].coeff_w * z->img_comp[n].coeff_h, got;
+   // the packed buffers are smaller than the full one, so this covers both
+   if (!stbi__mad3sizes_valid(z->img_comp[n].coeff_w * 8, z->img_comp[n].coeff_h * 8, sizeof(short), 15))
+      return stbi__err("outofmem", "Out of memory");
+   if (z->low_memory) {
+      z->img_comp[n].packed = (stbi__jpeg_packed *) stbi__jpeg_pool_malloc(blocks * sizeof(stbi__jpeg_packed), &got);
+      if (z->img_comp[n].packed == NULL) return stbi__err("outofmem", "Out of memory");
+      z->img_comp[n].coeff_size = got;
+      memset(z->img_comp[n].packed, 0, blocks * sizeof(stbi__jpeg_packed));
+      z->img_comp[n].store = (short *) stbi__jpeg_pool_malloc(blocks * 16, &got);
+      if (z->img_comp[n].store == NULL) return stbi__err("outofmem", "Out of memory");
+      z->img_comp[n].store_n = 0;
+      z->img_comp[n].store_cap = got / 4;
+   } else {
+      z->img_comp[n].raw_coeff = stbi__jpeg_pool_malloc(blocks * 64 * sizeof(short) + 15, &got);
+      if (z->img_comp[n].raw_coeff == NULL) return stbi__err("outofmem", "Out of memory");
+      z->img_comp[n].coeff_size = got;
+      z->img_comp[n].coeff = (short*) (((size_t) z->img_comp[n].raw_coeff + 15) & ~15);
+      memset(z->img_comp[n].coeff, 0, blocks * 64 * sizeof(short));
+   }
+   return 1;
+}
+
 static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
 {
    int i;
@@ -3214,10 +4632,18 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__jpeg_pool_free(z->img_comp[i].raw_coeff, z->img_comp[i].coeff_size);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
+      if (z->img_comp[i].packed) {
+         stbi__jpeg_pool_free(z->img_comp[i].packed, z->img_comp[i].coeff_size);
+         z->img_comp[i].packed = NULL;
+      }
+      if (z->img_comp[i].store) {
+         stbi__jpeg_pool_free(z->img_comp[i].store, z->img_comp[i].store_cap * 4);
+         z->img_comp[i].store = NULL;
+      }
       if (z->img_comp[i].linebuf) {
          STBI_FREE(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
@@ -3226,10 +4652,42 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    return why;
 }
 
+// log2 of the scale denominator, rounded down and limited to 1/8
+static int stbi__jpeg_scale_global = 0;
+
+static int stbi__jpeg_scale_log2(int denominator)
+{
+   int scale = 0;
+   while (scale < 3 && (2 << scale) <= denominator) ++scale;
+   return scale;
+}
+
+STBIDEF void stbi_set_jpeg_scale(int denominator)
+{
+   stbi__jpeg_scale_global = stbi__jpeg_scale_log2(denominator);
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__jpeg_scale  stbi__jpeg_scale_global
+#else
+static STBI_THREAD_LOCAL int stbi__jpeg_scale_local, stbi__jpeg_scale_set;
+
+STBIDEF void stbi_set_jpeg_scale_thread(int denominator)
+{
+   stbi__jpeg_scale_local = stbi__jpeg_scale_log2(denominator);
+   stbi__jpeg_scale_set = 1;
+}
+
+#define stbi__jpeg_scale  (stbi__jpeg_scale_set           \
+                            ? stbi__jpeg_scale_local      \
+                            : stbi__jpeg_scale_global)
+#endif // STBI_THREAD_LOCAL
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
    int Lf,p,i,q, h_max=1,v_max=1,c;
+   stbi__uint32 code_x;
    Lf = stbi__get16be(s);         if (Lf < 11) return stbi__err("bad SOF len","Corrupt JPEG"); // JPEG
    p  = stbi__get8(s);            if (p != 8) return stbi__err("only 8-bit","JPEG format not supported: 8-bit only"); // JPEG baseline
    s->img_y = stbi__get16be(s);   if (s->img_y == 0) return stbi__err("no header height", "JPEG format not supported: delayed height"); // Legal, but we don't handle it--but neither does IJG
@@ -3258,6 +4716,15 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       z->img_comp[i].tq = stbi__get8(s);  if (z->img_comp[i].tq > 3) return stbi__err("bad TQ","Corrupt JPEG");
    }
 
+   // img_x and img_y become the output size; the mcu layout is that of the
+   // full size image
+   z->scale = stbi__jpeg_scale;
+   z->low_memory = stbi__jpeg_low_memory;
+   z->code_y = s->img_y;
+   code_x = s->img_x;
+   s->img_x = (s->img_x + (1 << z->scale) - 1) >> z->scale;
+   s->img_y = (s->img_y + (1 << z->scale) - 1) >> z->scale;
+
    if (scan != STBI__SCAN_load) return 1;
 
    if (!stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) return stbi__err("too large", "Image too large to decode");
@@ -3280,13 +4747,27 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_w = h_max * 8;
    z->img_mcu_h = v_max * 8;
    // these sizes can't be more than 17 bits
-   z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
-   z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
+   z->img_mcu_x = (code_x + z->img_mcu_w-1) / z->img_mcu_w;
+   z->img_mcu_y = (z->code_y + z->img_mcu_h-1) / z->img_mcu_h;
+   z->img_mcu_w >>= z->scale;
+   z->img_mcu_h >>= z->scale;
 
    for (i=0; i < s->img_n; ++i) {
+      static void (*const reduced[4])(stbi_uc *out, int out_stride, short data[64]) = {
+         NULL, stbi__idct_block_4x4, stbi__idct_block_2x2, stbi__idct_block_1x1
+      };
+      int bw, f = h_max / z->img_comp[i].h;
       // number of effective pixels (e.g. for non-interleaved MCU)
-      z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
-      z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
+      z->img_comp[i].x = (code_x * z->img_comp[i].h + h_max-1) / h_max;
+      z->img_comp[i].y = (z->code_y * z->img_comp[i].v + v_max-1) / v_max;
+      // blocks of a component subsampled by the same factor in both
+      // directions are reduced less, instead of upsampling them afterwards
+      z->img_comp[i].scale = z->scale;
+      if (f == v_max / z->img_comp[i].v)
+         for (; z->img_comp[i].scale > 0 && f % 2 == 0; f /= 2)
+            --z->img_comp[i].scale;
+      z->img_comp[i].idct = z->img_comp[i].scale ? reduced[z->img_comp[i].scale] : z->idct_block_kernel;
+      bw = 8 >> z->img_comp[i].scale;
       // to simplify generation, we'll allocate enough memory to decode
       // the bogus oversized data from using interleaved MCUs and their
       // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
@@ -3294,24 +4775,23 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * bw;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * bw;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
+      z->img_comp[i].packed = NULL;
+      z->img_comp[i].store = NULL;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
-         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      // pixel buffers are allocated by stbi__jpeg_start_output once the
+      // first scan tells whether they can be strips
+      z->img_comp[i].raw_data = NULL;
+      z->img_comp[i].data = NULL;
+      z->img_comp[i].rows = 0;
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
-         if (z->img_comp[i].raw_coeff == NULL)
-            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-         z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         if (!stbi__jpeg_alloc_coeff(z, i))
+            return stbi__free_jpeg_components(z, i+1, 0);
       }
    }
 
@@ -3351,20 +4831,28 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
    return 1;
 }
 
-// decode image to YCbCr format
+// decode image from YCbCr format, converting to the requested output as
+// it goes
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
    int m;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
+      j->img_comp[m].packed = NULL;
+      j->img_comp[m].store = NULL;
    }
    j->restart_interval = 0;
+   j->scans = 0;
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
+         // a sequential scan with every component is the only scan, so
+         // it can be decoded into strips and converted an mcu row at a time
+         if (!j->progressive && !j->output)
+            if (!stbi__jpeg_start_output(j, j->scan_n == j->s->img_n)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
@@ -3381,22 +4869,20 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          int Ld = stbi__get16be(j->s);
          stbi__uint32 NL = stbi__get16be(j->s);
          if (Ld != 4) return stbi__err("bad DNL len", "Corrupt JPEG");
-         if (NL != j->s->img_y) return stbi__err("bad DNL height", "Corrupt JPEG");
+         if (NL != j->code_y) return stbi__err("bad DNL height", "Corrupt JPEG");
       } else {
          if (!stbi__process_marker(j, m)) return 0;
       }
       m = stbi__get_marker(j);
    }
-   if (j->progressive)
-      stbi__jpeg_finish(j);
+   if (!j->output)
+      if (!stbi__jpeg_start_output(j, 1)) return 0;
+   stbi__jpeg_finish(j);
    return 1;
 }
 
 // static jfif-centered resampling (across block boundaries)
 
-typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
-                                    int w, int hs);
-
 #define stbi__div4(x) ((stbi_uc) ((x) >> 2))
 
 static stbi_uc *resample_row_1(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
@@ -3763,44 +5249,108 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI__AVX2
+// 16 pixels per iteration version of the sse2 conversion above, same fixed
+// point math so the results are bit-identical; step == 4 only
+static STBI__TARGET_AVX2 void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+   if (step == 4) {
+      __m256i c128      = _mm256_set1_epi16(128);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // load and widen: y * 256 + 128, (cr - 128) * 256, (cb - 128) * 256
+         __m256i y_w  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (y+i)));
+         __m256i cr_w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcr+i)));
+         __m256i cb_w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcb+i)));
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(y_w, 8), c128);
+         __m256i crw = _mm256_slli_epi16(_mm256_sub_epi16(cr_w, c128), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_sub_epi16(cb_w, c128), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, interleave channels (within lanes)
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0..3, 8..11
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4..7, 12..15
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+   // leftovers (and step != 4)
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   int level = stbi_simd_level();
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block_x2_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
 #ifdef STBI_SSE2
-   if (stbi__sse2_available()) {
+   if (level >= STBI_SIMD_SSE2) {
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
    }
 #endif
 
+#ifdef STBI__AVX2
+   if (level >= STBI_SIMD_AVX2) {
+      j->idct_block_x2_kernel = stbi__idct_avx2_x2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
-   j->idct_block_kernel = stbi__idct_simd;
-   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
-   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   if (level >= STBI_SIMD_SSE2) {
+      j->idct_block_kernel = stbi__idct_simd;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   }
 #endif
+   STBI_NOTUSED(level);
 }
 
 // clean up the temporary component buffers
 static void stbi__cleanup_jpeg(stbi__jpeg *j)
 {
    stbi__free_jpeg_components(j, j->s->img_n, 0);
+   if (j->output) {
+      STBI_FREE(j->output);
+      j->output = NULL;
+   }
 }
 
-typedef struct
-{
-   resample_row_func resample;
-   stbi_uc *line0,*line1;
-   int hs,vs;   // expansion factor in each axis
-   int w_lores; // horizontal pixels pre-expansion
-   int ystep;   // how far through vertical expansion we are
-   int ypos;    // which pre-expansion row we're on
-} stbi__resample;
-
 // fast 0..255 * 0..255 => 0..255 rounded multiplication
 static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
 {
@@ -3808,167 +5358,199 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// allocates the component buffers (strips of three mcu rows or whole planes),
+// the resamplers and the output
+static int stbi__jpeg_start_output(stbi__jpeg *z, int strip)
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   int k;
+   int n = z->req_comp ? z->req_comp : z->s->img_n >= 3 ? 3 : 1;
+   // the same strips with or without a parallel-for, so that a corrupt
+   // stream converts the same rows from them either way
+   int strip_rows = z->restart_interval > 0 && !z->progressive && !z->s->read_from_callbacks ? stbi__jpeg_batch(z, NULL) : 3;
+   // stbi__jpeg_finish's batches, and the two mcu rows before them
+   if (z->progressive && stbi__parallel_for) strip_rows = STBI__JPEG_BATCH_MCU_ROWS + 2;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   z->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   if (z->s->img_n == 3 && n < 3 && !z->is_rgb)
+      z->decode_n = 1;
+   else
+      z->decode_n = z->s->img_n;
+   z->out_n = n;
+   z->out_y = 0;
+
+   for (k=0; k < z->s->img_n; ++k) {
+      // a strip holds the previous, current and next mcu rows, which is what
+      // vertical upsampling needs to convert the current one (more when
+      // restart intervals are decoded in parallel)
+      z->img_comp[k].rows = strip ? z->img_comp[k].v * (8 >> z->img_comp[k].scale) * strip_rows : z->img_comp[k].h2;
+      if (z->img_comp[k].rows > z->img_comp[k].h2) z->img_comp[k].rows = z->img_comp[k].h2;
+      z->img_comp[k].clear_from = z->img_comp[k].h2;
+      z->img_comp[k].raw_data = stbi__malloc_mad2(z->img_comp[k].w2, z->img_comp[k].rows, 15);
+      if (z->img_comp[k].raw_data == NULL) return stbi__err("outofmem", "Out of memory");
+      // align blocks for idct using mmx/sse
+      z->img_comp[k].data = (stbi_uc*) (((size_t) z->img_comp[k].raw_data + 15) & ~15);
+      // rows a corrupt stream never reached are converted from whatever
+      // is in the buffer, make that deterministic
+      memset(z->img_comp[k].data, 0, (size_t) z->img_comp[k].w2 * z->img_comp[k].rows);
+   }
 
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   for (k=0; k < z->decode_n; ++k) {
+      stbi__resample *r = &z->res_comp[k];
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
+      // less for components decoded to larger blocks
+      r->hs      = z->img_h_max / z->img_comp[k].h >> (z->scale - z->img_comp[k].scale);
+      r->vs      = z->img_v_max / z->img_comp[k].v >> (z->scale - z->img_comp[k].scale);
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
 
-   // nothing to do if no components requested; check this now to avoid
-   // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
+   z->output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+   if (!z->output) return stbi__err("outofmem", "Out of memory");
+   return 1;
+}
+
+// resample and color-convert output rows up to y_end; the component rows
+// they need must have been decoded
+static void stbi__jpeg_emit_rows(stbi__jpeg *z, int y_end)
+{
+   int k, n = z->out_n;
+   unsigned int i,j;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   if (y_end > (int) z->s->img_y) y_end = z->s->img_y;
+
+   for (j=z->out_y; (int) j < y_end; ++j) {
+      stbi_uc *out = z->output + n * z->s->img_x * j;
+      for (k=0; k < z->decode_n; ++k) {
+         stbi__resample *r = &z->res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(z->img_comp[k].linebuf,
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < (z->img_comp[k].y + (1 << z->img_comp[k].scale) - 1) >> z->img_comp[k].scale) {
+               r->line1 = stbi__jpeg_row(z, k, r->ypos);
+               if (r->ypos >= z->img_comp[k].clear_from) memset(r->line1, 0, z->img_comp[k].w2);
             }
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (z->is_rgb) {
                for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
                   out += n;
                }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
                for (i=0; i < z->s->img_x; ++i) {
                   stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
                   out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
                for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
                   out += n;
                }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
             }
+      } else {
+         if (z->is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
          }
       }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
    }
+   if (y_end > z->out_y) z->out_y = y_end;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi_uc *output;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   z->output = NULL;
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   z->req_comp = req_comp;
+
+   // decode, resample and color-convert from whichever source
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   output = z->output;
+   z->output = NULL;
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
@@ -4372,38 +5954,215 @@ static int stbi__parse_zlib_header(stbi__zbuf *a)
    return 1;
 }
 
-static const stbi_uc stbi__zdefault_length[STBI__ZNSYMS] =
+static const stbi_uc stbi__zdefault_length[STBI__ZNSYMS] =
+{
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static const stbi_uc stbi__zdefault_distance[32] =
+{
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
+/*
+Init algorithm:
+{
+   int i;   // use <= to match clearly with spec
+   for (i=0; i <= 143; ++i)     stbi__zdefault_length[i]   = 8;
+   for (   ; i <= 255; ++i)     stbi__zdefault_length[i]   = 9;
+   for (   ; i <= 279; ++i)     stbi__zdefault_length[i]   = 7;
+   for (   ; i <= 287; ++i)     stbi__zdefault_length[i]   = 8;
+
+   for (i=0; i <=  31; ++i)     stbi__zdefault_distance[i] = 5;
+}
+*/
+
+static int stbi__verify_checksums_global = 0;
+
+STBIDEF void stbi_set_verify_checksums(int flag_true_if_should_verify)
+{
+   stbi__verify_checksums_global = flag_true_if_should_verify;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__verify_checksums  stbi__verify_checksums_global
+#else
+static STBI_THREAD_LOCAL int stbi__verify_checksums_local, stbi__verify_checksums_set;
+
+STBIDEF void stbi_set_verify_checksums_thread(int flag_true_if_should_verify)
+{
+   stbi__verify_checksums_local = flag_true_if_should_verify;
+   stbi__verify_checksums_set = 1;
+}
+
+#define stbi__verify_checksums  (stbi__verify_checksums_set           \
+                                  ? stbi__verify_checksums_local      \
+                                  : stbi__verify_checksums_global)
+#endif // STBI_THREAD_LOCAL
+
+#define STBI__ADLER_MOD   65521
+#define STBI__ADLER_NMAX  5552 // most bytes summed before s2 could overflow
+
+#ifdef STBI_SSE2
+static stbi__uint32 stbi__sum_epi32(__m128i v)
+{
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+   return (stbi__uint32) _mm_cvtsi128_si32(v);
+}
+
+// adds n bytes, a multiple of 16, to the sums; each of them adds s1 to s2,
+// each 16 bytes add 16 times their sum for every 16 bytes that follow, and
+// each byte adds itself 16 down to 1 times for its place in its 16 bytes
+static void stbi__adler32_sse2(stbi__uint32 *s1, stbi__uint32 *s2, stbi_uc const *p, int n)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i w_lo = _mm_setr_epi16(16,15,14,13,12,11,10,9);
+   __m128i w_hi = _mm_setr_epi16(8,7,6,5,4,3,2,1);
+   __m128i sum = zero, prefix = zero, weighted = zero;
+   int i;
+   for (i=0; i < n; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i const *) (p + i));
+      prefix = _mm_add_epi32(prefix, sum);
+      sum = _mm_add_epi32(sum, _mm_sad_epu8(v, zero));
+      weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+      weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+   }
+   *s2 += (stbi__uint32) n * *s1 + 16 * stbi__sum_epi32(prefix) + stbi__sum_epi32(weighted);
+   *s1 += stbi__sum_epi32(sum);
+}
+#endif
+
+#ifdef STBI__AVX2
+// as above with 32 bytes at a time, the weights applied by multiply-adds
+// of bytes
+static STBI__TARGET_AVX2 void stbi__adler32_avx2(stbi__uint32 *s1, stbi__uint32 *s2, stbi_uc const *p, int n)
+{
+   __m256i zero = _mm256_setzero_si256();
+   __m256i ones = _mm256_set1_epi16(1);
+   __m256i w = _mm256_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17,
+                                16,15,14,13,12,11,10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+   __m256i sum = zero, prefix = zero, weighted = zero;
+   int i;
+   for (i=0; i < n; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i const *) (p + i));
+      prefix = _mm256_add_epi32(prefix, sum);
+      sum = _mm256_add_epi32(sum, _mm256_sad_epu8(v, zero));
+      weighted = _mm256_add_epi32(weighted, _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+   }
+   *s2 += (stbi__uint32) n * *s1 + 32 * stbi__sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(prefix), _mm256_extracti128_si256(prefix, 1)))
+        + stbi__sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(weighted), _mm256_extracti128_si256(weighted, 1)));
+   *s1 += stbi__sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+}
+#endif
+
+#ifdef STBI__AVX512
+static STBI__TARGET_AVX512 stbi__uint32 stbi__sum_epi32_avx512(__m512i v)
 {
-   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
-   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
-};
-static const stbi_uc stbi__zdefault_distance[32] =
+   // through memory, as the lane extracts trip g++ warnings in some GCCs,
+   // it's only done once every STBI__ADLER_NMAX bytes
+   stbi__uint32 t[16], sum = 0;
+   int i;
+   _mm512_storeu_si512((void *) t, v);
+   for (i=0; i < 16; ++i)
+      sum += t[i];
+   return sum;
+}
+
+// and with 64, the largest weights still fit the signed bytes of the
+// multiply-adds without the pairs of products saturating
+static STBI__TARGET_AVX512 void stbi__adler32_avx512(stbi__uint32 *s1, stbi__uint32 *s2, stbi_uc const *p, int n)
 {
-   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
-};
-/*
-Init algorithm:
+   static stbi_uc const weights[64] = {
+      64,63,62,61,60,59,58,57,56,55,54,53,52,51,50,49,48,47,46,45,44,43,42,41,40,39,38,37,36,35,34,33,
+      32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17,16,15,14,13,12,11,10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+   };
+   __m512i zero = _mm512_setzero_si512();
+   __m512i ones = _mm512_set1_epi16(1);
+   __m512i w = _mm512_loadu_si512((void const *) weights);
+   __m512i sum = zero, prefix = zero, weighted = zero;
+   int i;
+   for (i=0; i < n; i += 64) {
+      __m512i v = _mm512_loadu_si512((void const *) (p + i));
+      prefix = _mm512_add_epi32(prefix, sum);
+      sum = _mm512_add_epi32(sum, _mm512_sad_epu8(v, zero));
+      weighted = _mm512_add_epi32(weighted, _mm512_madd_epi16(_mm512_maddubs_epi16(v, w), ones));
+   }
+   *s2 += (stbi__uint32) n * *s1 + 64 * stbi__sum_epi32_avx512(prefix) + stbi__sum_epi32_avx512(weighted);
+   *s1 += stbi__sum_epi32_avx512(sum);
+}
+#endif
+
+static stbi__uint32 stbi__adler32(stbi__uint32 adler, stbi_uc const *p, size_t n)
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     stbi__zdefault_length[i]   = 8;
-   for (   ; i <= 255; ++i)     stbi__zdefault_length[i]   = 9;
-   for (   ; i <= 279; ++i)     stbi__zdefault_length[i]   = 7;
-   for (   ; i <= 287; ++i)     stbi__zdefault_length[i]   = 8;
+   stbi__uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+   while (n > 0) {
+      int k = n < STBI__ADLER_NMAX ? (int) n : STBI__ADLER_NMAX, i = 0;
+#ifdef STBI__AVX512
+      if (stbi_simd_level() >= STBI_SIMD_AVX512) {
+         i = k & ~63;
+         stbi__adler32_avx512(&s1, &s2, p, i);
+      } else
+#endif
+#ifdef STBI__AVX2
+      if (stbi_simd_level() >= STBI_SIMD_AVX2) {
+         i = k & ~31;
+         stbi__adler32_avx2(&s1, &s2, p, i);
+      } else
+#endif
+#ifdef STBI_SSE2
+      if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+         i = k & ~15;
+         stbi__adler32_sse2(&s1, &s2, p, i);
+      }
+#endif
+      for (; i < k; ++i) {
+         s1 += p[i];
+         s2 += s1;
+      }
+      s1 %= STBI__ADLER_MOD;
+      s2 %= STBI__ADLER_MOD;
+      p += k;
+      n -= k;
+   }
+   return (s2 << 16) | s1;
+}
 
-   for (i=0; i <=  31; ++i)     stbi__zdefault_distance[i] = 5;
+// the big-endian Adler-32 of the output follows the last block, at the
+// next byte boundary
+static int stbi__zcheck_adler32(stbi__zbuf *a, stbi__uint32 adler)
+{
+   stbi__uint32 stored = 0;
+   int k;
+   if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
+   if (a->num_bits & 7)
+      stbi__zreceive(a, a->num_bits & 7); // discard
+   // the first bytes may already be in the bit buffer
+   for (k=0; k < 4; ++k) {
+      if (a->num_bits >= 8)
+         stored = (stored << 8) | stbi__zreceive(a, 8);
+      else if (!stbi__zeof(a))
+         stored = (stored << 8) | stbi__zget8(a);
+      else
+         return stbi__err("zlib corrupt","Corrupt PNG");
+   }
+   if (stored != adler) return stbi__err("bad adler32","Corrupt PNG");
+   return 1;
 }
-*/
 
 static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
 {
    int final, type;
+   // the checksum is updated after each block, while its output is in cache
+   int verify = parse_header && stbi__verify_checksums;
+   stbi__uint32 adler = 1;
+   size_t checked = 0;
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
@@ -4425,7 +6184,14 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          }
          if (!stbi__parse_huffman_block(a)) return 0;
       }
+      if (verify) {
+         size_t done = (size_t) (a->zout - a->zout_start);
+         adler = stbi__adler32(adler, (stbi_uc *) a->zout_start + checked, done - checked);
+         checked = done;
+      }
    } while (!final);
+   if (verify)
+      return stbi__zcheck_adler32(a, adler);
    return 1;
 }
 
@@ -4515,10 +6281,81 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
 }
 #endif
 
+#if !defined(STBI_NO_BMP) || !defined(STBI_NO_TGA) || !defined(STBI_NO_PNG)
+#ifdef STBI__TARGETS
+// returns the number of pixels done, leaving at least 2 so no load or store
+// passes the row
+static STBI__TARGET_SSSE3 int stbi__swap_rb_ssse3(stbi_uc *out, stbi_uc const *src, int w, int in_n, int out_n, int *alpha)
+{
+   static signed char const shuffles[4][16] = {
+      { 2,1,0, 5,4,3, 8,7,6, 11,10,9, 12,13,14,15 },                  // 3 to 3
+      { 2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1 },                   // 3 to 4
+      { 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1 },                // 4 to 3
+      { 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15 },                   // 4 to 4
+   };
+   __m128i shuffle = _mm_loadu_si128((__m128i const *) shuffles[(in_n-3)*2 + out_n-3]);
+   __m128i opaque = _mm_set1_epi32(out_n > in_n ? (int) 0xff000000 : 0);
+   __m128i a = _mm_setzero_si128();
+   int i;
+   for (i = 0; i + 6 <= w; i += 4) {
+      __m128i v = _mm_loadu_si128((__m128i const *) (src + in_n*i));
+      a = _mm_or_si128(a, v);
+      _mm_storeu_si128((__m128i *) (out + out_n*i), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), opaque));
+   }
+   if (in_n == 4) {
+      a = _mm_or_si128(a, _mm_srli_si128(a, 8));
+      a = _mm_or_si128(a, _mm_srli_si128(a, 4));
+      *alpha |= (stbi__uint32) _mm_cvtsi128_si32(a) >> 24;
+   }
+   return i;
+}
+#endif
+
+// converts w BGR or BGRA pixels, as stored by BMP, TGA and iPhone PNGs, to
+// RGB or RGBA, which is opaque if the source has no alpha; works in place if
+// in_n == out_n; returns the OR of the alphas
+static int stbi__swap_rb(stbi_uc *out, stbi_uc const *src, int w, int in_n, int out_n)
+{
+   int i = 0, alpha = 0;
+#ifdef STBI__TARGETS
+   if (stbi_simd_level() >= STBI_SIMD_SSSE3)
+      i = stbi__swap_rb_ssse3(out, src, w, in_n, out_n, &alpha);
+#endif
+#ifdef STBI_SSE2
+   if (in_n == 4 && out_n == 4 && stbi_simd_level() >= STBI_SIMD_SSE2) {
+      __m128i ga = _mm_set1_epi32((int) 0xff00ff00), rb = _mm_set1_epi32(0xff);
+      __m128i a = _mm_setzero_si128();
+      for (; i + 4 <= w; i += 4) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (src + 4*i));
+         __m128i t = _mm_or_si128(_mm_and_si128(v, ga), _mm_and_si128(_mm_srli_epi32(v, 16), rb));
+         a = _mm_or_si128(a, v);
+         _mm_storeu_si128((__m128i *) (out + 4*i), _mm_or_si128(t, _mm_slli_epi32(_mm_and_si128(v, rb), 16)));
+      }
+      a = _mm_or_si128(a, _mm_srli_si128(a, 8));
+      a = _mm_or_si128(a, _mm_srli_si128(a, 4));
+      alpha |= (stbi__uint32) _mm_cvtsi128_si32(a) >> 24;
+   }
+#endif
+   src += in_n*i;
+   out += out_n*i;
+   for (; i < w; ++i) {
+      stbi_uc b = src[0], a = in_n == 4 ? src[3] : 255;
+      out[0] = src[2];
+      out[1] = src[1];
+      out[2] = b;
+      if (out_n == 4) out[3] = a;
+      alpha |= a;
+      src += in_n;
+      out += out_n;
+   }
+   return in_n == 4 ? alpha : 255;
+}
+#endif
+
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
 //    simple implementation
 //      - only 8-bit samples
-//      - no CRC checking
+//      - CRCs are only checked with stbi_set_verify_checksums
 //      - allocates lots of intermediate memory
 //        - avoids problem of streaming data between subsystems
 //        - avoids explicit window management
@@ -4549,11 +6386,160 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+// CRC-32 of the PNG chunks (the one of zlib's crc32, reflected polynomial
+// 0xedb88320), a byte at a time
+static const stbi__uint32 stbi__crc_table[256] =
+{
+   0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+   0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+   0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+   0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+   0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+   0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+   0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+   0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924, 0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+   0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+   0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+   0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+   0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+   0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+   0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+   0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+   0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+   0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+   0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+   0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+   0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+   0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+   0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+   0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236, 0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+   0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+   0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+   0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+   0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+   0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+   0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+   0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+   0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+   0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+#ifdef STBI__TARGETS
+// folds 64 bytes at a time with carry-less multiplies by x^(512+-32) and
+// x^(512+32) mod P, then down to 16 and 8 bytes, and Barrett-reduces the
+// rest to 32 bits, as in Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction"; takes the inverted CRC and
+// n >= 64 bytes, a multiple of 16
+static STBI__TARGET_PCLMUL stbi__uint32 stbi__crc32_pclmul(stbi__uint32 crc, stbi_uc const *p, int n)
+{
+   __m128i k1k2 = _mm_set_epi32(0x00000001, 0xc6e41596, 0x00000001, 0x54442bd4);
+   __m128i k3k4 = _mm_set_epi32(0x00000000, 0xccaa009e, 0x00000001, 0x751997d0);
+   __m128i k5   = _mm_set_epi32(0x00000000, 0x00000000, 0x00000001, 0x63cd6124);
+   __m128i poly = _mm_set_epi32(0x00000001, 0xf7011641, 0x00000001, 0xdb710641);
+   __m128i mask = _mm_setr_epi32(-1, 0, -1, 0);
+   __m128i x0, x1, x2, x3, x4, t1, t2, t3, t4;
+   x1 = _mm_xor_si128(_mm_loadu_si128((__m128i const *) p), _mm_cvtsi32_si128((int) crc));
+   x2 = _mm_loadu_si128((__m128i const *) (p + 16));
+   x3 = _mm_loadu_si128((__m128i const *) (p + 32));
+   x4 = _mm_loadu_si128((__m128i const *) (p + 48));
+   for (p += 64, n -= 64; n >= 64; p += 64, n -= 64) {
+      t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+      t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+      t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+      t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((__m128i const *) p));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128((__m128i const *) (p + 16)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128((__m128i const *) (p + 32)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128((__m128i const *) (p + 48)));
+   }
+   // fold the four lanes into one, then the remaining 16 byte blocks
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x2);
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x3);
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x4);
+   for (; n >= 16; p += 16, n -= 16) {
+      t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+      x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1),
+                         _mm_loadu_si128((__m128i const *) p));
+   }
+   // 128 bits to 64
+   x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5, 0x00), x2);
+   // Barrett reduction to 32
+   x0 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+   x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask), poly, 0x00);
+   x1 = _mm_xor_si128(x1, x0);
+   return (stbi__uint32) _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
+static stbi__uint32 stbi__crc32(stbi__uint32 crc, stbi_uc const *p, stbi__uint32 n)
+{
+   crc = ~crc;
+#ifdef STBI__TARGETS
+   // every CPU with PCLMULQDQ has SSE4.1, so it comes with that level
+   if (n >= 64 && stbi_simd_level() >= STBI_SIMD_SSE41 && (stbi__cpu_features() & STBI__CPU_PCLMUL)) {
+      stbi__uint32 m = n & ~15u;
+      crc = stbi__crc32_pclmul(crc, p, (int) m);
+      p += m;
+      n -= m;
+   }
+#endif
+#ifdef STBI__ARM_CRC32
+   for (; n >= 4; p += 4, n -= 4) {
+      stbi__uint32 v;
+      memcpy(&v, p, 4);
+      crc = __crc32w(crc, v);
+   }
+#endif
+   for (; n > 0; --n)
+      crc = stbi__crc_table[(crc ^ *p++) & 255] ^ (crc >> 8);
+   return ~crc;
+}
+
+// CRC of the type of chunk c followed by its data
+static stbi__uint32 stbi__png_chunk_crc(stbi__pngchunk c, stbi_uc const *data, stbi__uint32 n)
+{
+   stbi_uc type[4];
+   type[0] = STBI__BYTECAST(c.type >> 24);
+   type[1] = STBI__BYTECAST(c.type >> 16);
+   type[2] = STBI__BYTECAST(c.type >>  8);
+   type[3] = STBI__BYTECAST(c.type >>  0);
+   return stbi__crc32(stbi__crc32(0, type, 4), data, n);
+}
+
+// reads the data of chunk c through body, which keeps all of it if it
+// fits, and the CRC that follows it, which must match
+static int stbi__png_check_chunk(stbi__context *s, stbi__pngchunk c, stbi_uc *body, int body_len)
+{
+   stbi__uint32 crc = stbi__png_chunk_crc(c, NULL, 0), left = c.length;
+   while (left > 0) {
+      int n = left < (stbi__uint32) body_len ? (int) left : body_len;
+      if (!stbi__getn(s, body, n)) return stbi__err("outofdata","Corrupt PNG");
+      crc = stbi__crc32(crc, body, n);
+      left -= n;
+   }
+   if (stbi__get32be(s) != crc) return stbi__err("bad CRC","Corrupt PNG");
+   return 1;
+}
+
 typedef struct
 {
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int de_iphone; // 1 to swap iPhone BGR while unfiltering, 2 to also unpremultiply
+   stbi_uc *pal;  // 4-channel palette to expand to pal_n channels while unfiltering
+   int pal_n;
+   int bitmap;    // keep the rows of a 1-bit grayscale image packed
 } stbi__png;
 
 
@@ -4588,8 +6574,264 @@ static int stbi__paeth(int a, int b, int c)
    return c;
 }
 
+#ifdef STBI_SSE2
+// the n bytes of a pixel in the low lane, as loaded by its unfilter kernels
+static __m128i stbi__load_pixel(stbi_uc const *p, int n)
+{
+   int v = 0;
+   memcpy(&v, p, n);
+   return _mm_cvtsi32_si128(v);
+}
+
+static void stbi__store_pixel(stbi_uc *p, __m128i v)
+{
+   int t = _mm_cvtsi128_si32(v);
+   memcpy(p, &t, 4);
+}
+
+// unfilters sub and average rows of 3 or 4 byte pixels a pixel at a time,
+// the previous pixel carried in a register; cur, raw and prior start at the
+// second pixel, returns the bytes done, which leaves the last pixel of 3
+// byte rows to the caller so no 4 byte load or store passes the row
+static int stbi__unfilter_sse2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter, int bpp)
+{
+   __m128i one = _mm_set1_epi8(1), zero = _mm_setzero_si128();
+   __m128i a = stbi__load_pixel(cur - bpp, bpp);
+   int k = 0;
+   switch (filter) {
+      case STBI__F_sub:
+      case STBI__F_paeth_first: // the Paeth predictor of a, 0, 0 is a
+         for (; k + 4 <= nk; k += bpp) {
+            a = _mm_add_epi8(a, stbi__load_pixel(raw + k, 4));
+            stbi__store_pixel(cur + k, a);
+         }
+         break;
+      case STBI__F_avg:
+      case STBI__F_avg_first:
+         for (; k + 4 <= nk; k += bpp) {
+            __m128i b = filter == STBI__F_avg ? stbi__load_pixel(prior + k, 4) : zero;
+            // pavgb rounds up, (a + b) >> 1 is one less for odd sums
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(avg, stbi__load_pixel(raw + k, 4));
+            stbi__store_pixel(cur + k, a);
+         }
+         break;
+   }
+   return k;
+}
+#endif
+
+#ifdef STBI__TARGETS
+// as above for Paeth rows, the predictor computed in 16-bit lanes
+static STBI__TARGET_SSE41 int stbi__unfilter_paeth_sse41(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = _mm_unpacklo_epi8(stbi__load_pixel(cur - bpp, bpp), zero);
+   __m128i c = _mm_unpacklo_epi8(stbi__load_pixel(prior - bpp, bpp), zero);
+   int k;
+   for (k=0; k + 4 <= nk; k += bpp) {
+      __m128i b = _mm_unpacklo_epi8(stbi__load_pixel(prior + k, 4), zero);
+      __m128i pa = _mm_sub_epi16(b, c); // p-a, p-b and p-c of stbi__paeth
+      __m128i pb = _mm_sub_epi16(a, c);
+      __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+      __m128i pred, x;
+      pa = _mm_abs_epi16(pa);
+      pb = _mm_abs_epi16(pb);
+      // ties go to a, then to b
+      pred = _mm_blendv_epi8(c, b, _mm_cmpeq_epi16(_mm_min_epi16(pb, pc), pb));
+      pred = _mm_blendv_epi8(pred, a, _mm_cmpeq_epi16(_mm_min_epi16(pa, _mm_min_epi16(pb, pc)), pa));
+      x = _mm_add_epi8(_mm_packus_epi16(pred, pred), stbi__load_pixel(raw + k, 4));
+      stbi__store_pixel(cur + k, x);
+      a = _mm_unpacklo_epi8(x, zero);
+      c = b;
+   }
+   return k;
+}
+#endif
+
+#ifdef STBI_SSE2
+// unfilters what it can of a row of 8-bit RGB or RGBA pixels, returns the
+// bytes done
+static int stbi__unfilter_simd(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter, int bpp)
+{
+   int level = stbi_simd_level();
+#ifdef STBI__TARGETS
+   if (filter == STBI__F_paeth && level >= STBI_SIMD_SSE41)
+      return stbi__unfilter_paeth_sse41(cur, raw, prior, nk, bpp);
+#endif
+   if (filter != STBI__F_none && filter != STBI__F_up && filter != STBI__F_paeth && level >= STBI_SIMD_SSE2)
+      return stbi__unfilter_sse2(cur, raw, prior, nk, filter, bpp);
+   return 0;
+}
+#endif
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#ifdef STBI_SSE2
+// 65535/a, a multiplier for mulhi that gives (x/a) or one less for every
+// x < 65536, which the caller corrects with a multiply back
+static stbi__uint16 const stbi__unpremultiply_recip[256] =
+{
+       0,65535,32767,21845,16383,13107,10922, 9362, 8191, 7281, 6553, 5957,
+    5461, 5041, 4681, 4369, 4095, 3855, 3640, 3449, 3276, 3120, 2978, 2849,
+    2730, 2621, 2520, 2427, 2340, 2259, 2184, 2114, 2047, 1985, 1927, 1872,
+    1820, 1771, 1724, 1680, 1638, 1598, 1560, 1524, 1489, 1456, 1424, 1394,
+    1365, 1337, 1310, 1285, 1260, 1236, 1213, 1191, 1170, 1149, 1129, 1110,
+    1092, 1074, 1057, 1040, 1023, 1008,  992,  978,  963,  949,  936,  923,
+     910,  897,  885,  873,  862,  851,  840,  829,  819,  809,  799,  789,
+     780,  771,  762,  753,  744,  736,  728,  720,  712,  704,  697,  689,
+     682,  675,  668,  661,  655,  648,  642,  636,  630,  624,  618,  612,
+     606,  601,  595,  590,  585,  579,  574,  569,  564,  560,  555,  550,
+     546,  541,  537,  532,  528,  524,  520,  516,  511,  508,  504,  500,
+     496,  492,  489,  485,  481,  478,  474,  471,  468,  464,  461,  458,
+     455,  451,  448,  445,  442,  439,  436,  434,  431,  428,  425,  422,
+     420,  417,  414,  412,  409,  407,  404,  402,  399,  397,  394,  392,
+     390,  387,  385,  383,  381,  378,  376,  374,  372,  370,  368,  366,
+     364,  362,  360,  358,  356,  354,  352,  350,  348,  346,  344,  343,
+     341,  339,  337,  336,  334,  332,  330,  329,  327,  326,  324,  322,
+     321,  319,  318,  316,  315,  313,  312,  310,  309,  307,  306,  304,
+     303,  302,  300,  299,  297,  296,  295,  293,  292,  291,  289,  288,
+     287,  286,  284,  283,  282,  281,  280,  278,  277,  276,  275,  274,
+     273,  271,  270,  269,  268,  267,  266,  265,  264,  263,  262,  261,
+     260,  259,  258,  257,
+};
+
+// unpremultiplies two swapped pixels widened to 16 bits, keeping the
+// swapped values where alpha is 0; m holds each pixel's reciprocal
+static __m128i stbi__unpremultiply_sse2(__m128i v, __m128i m)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i alpha_lane = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+   __m128i c = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+   __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+   __m128i x = _mm_add_epi16(_mm_sub_epi16(_mm_slli_epi16(c, 8), c), _mm_srli_epi16(a, 1)); // c*255 + a/2
+   __m128i q = _mm_mulhi_epu16(x, m);
+   // q is x/a or one less; bump it if (q+1)*a still fits in x
+   __m128i t = _mm_mullo_epi16(_mm_sub_epi16(q, _mm_cmpeq_epi16(zero, zero)), a);
+   __m128i keep = _mm_or_si128(_mm_cmpeq_epi16(a, zero), alpha_lane);
+   q = _mm_sub_epi16(q, _mm_cmpeq_epi16(_mm_subs_epu16(t, x), zero));
+   q = _mm_and_si128(q, _mm_set1_epi16(0xff)); // same truncation as storing to stbi_uc
+   return _mm_or_si128(_mm_and_si128(keep, c), _mm_andnot_si128(keep, q));
+}
+#endif
+
+// converts n pixels from iPhone BGR(A) to RGB(A) in place, unpremultiplying
+// the colors by alpha if asked to
+static void stbi__de_iphone_row(stbi_uc *p, stbi__uint32 n, int out_n, int unpremultiply)
+{
+   stbi__uint32 i = 0;
+   if (!unpremultiply || out_n == 3) {
+      stbi__swap_rb(p, p, (int) n, out_n, out_n);
+      return;
+   }
+   STBI_ASSERT(out_n == 4);
+#ifdef STBI_SSE2
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      __m128i zero = _mm_setzero_si128();
+      for (; i + 4 <= n; i += 4, p += 16) {
+         __m128i v = _mm_loadu_si128((__m128i const *) p);
+         stbi__uint16 const *r = stbi__unpremultiply_recip;
+         __m128i m01 = _mm_unpacklo_epi64(_mm_set1_epi16((short) r[p[3]]), _mm_set1_epi16((short) r[p[7]]));
+         __m128i m23 = _mm_unpacklo_epi64(_mm_set1_epi16((short) r[p[11]]), _mm_set1_epi16((short) r[p[15]]));
+         __m128i lo = stbi__unpremultiply_sse2(_mm_unpacklo_epi8(v, zero), m01);
+         __m128i hi = stbi__unpremultiply_sse2(_mm_unpackhi_epi8(v, zero), m23);
+         _mm_storeu_si128((__m128i *) p, _mm_packus_epi16(lo, hi));
+      }
+   }
+#endif
+   for (; i < n; ++i) {
+      stbi_uc a = p[3];
+      stbi_uc t = p[0];
+      if (a) {
+         stbi_uc half = a / 2;
+         p[0] = (p[2] * 255 + half) / a;
+         p[1] = (p[1] * 255 + half) / a;
+         p[2] = ( t   * 255 + half) / a;
+      } else {
+         p[0] = p[2];
+         p[2] = t;
+      }
+      p += 4;
+   }
+}
+
+#ifdef STBI__AVX2
+// looks up 8 indices at a time; returns the number of pixels done, leaving
+// enough that the 16-byte stores of 3-channel pixels stay in the row
+static STBI__TARGET_AVX2 stbi__uint32 stbi__expand_palette_avx2(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, stbi_uc const *pal, int pal_n)
+{
+   stbi__uint32 i = 0;
+   if (pal_n == 4) {
+      for (; i + 8 <= x; i += 8) {
+         __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (in + i)));
+         _mm256_storeu_si256((__m256i *) (out + 4*i), _mm256_i32gather_epi32((int const *) pal, idx, 4));
+      }
+   } else {
+      __m256i pack = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                      0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      for (; i + 10 <= x; i += 8) {
+         __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (in + i)));
+         __m256i rgb = _mm256_shuffle_epi8(_mm256_i32gather_epi32((int const *) pal, idx, 4), pack);
+         _mm_storeu_si128((__m128i *) (out + 3*i), _mm256_castsi256_si128(rgb));
+         _mm_storeu_si128((__m128i *) (out + 3*i + 12), _mm256_extracti128_si256(rgb, 1));
+      }
+   }
+   return i;
+}
+#endif
+
+// builds the colors of every byte of packed 1/2/4-bit indices, each entry
+// padded to 32 bytes so a row can be expanded with one fixed-size copy per
+// input byte; grayscale samples go through a palette of their levels
+static void stbi__palette_lut(stbi_uc *lut, stbi_uc const *pal, int pal_n, int depth)
+{
+   int b, k, per = 8 / depth, mask = (1 << depth) - 1;
+   for (b=0; b < 256; ++b) {
+      stbi_uc *p = lut + 32*b;
+      for (k=0; k < per; ++k, p += pal_n)
+         memcpy(p, pal + 4*((b >> (8 - depth*(k+1))) & mask), pal_n);
+   }
+}
+
+// expands a row of x palette indices to pal_n channels; at depth 8 lut is
+// the 4-channel palette, otherwise the table from stbi__palette_lut
+static void stbi__expand_palette_row(stbi_uc *out, stbi_uc const *in, stbi__uint32 x, int depth, stbi_uc const *lut, int pal_n)
+{
+   stbi__uint32 i = 0;
+   if (depth == 8) {
+#ifdef STBI__AVX2
+      if (stbi_simd_level() >= STBI_SIMD_AVX2)
+         i = stbi__expand_palette_avx2(out, in, x, lut, pal_n);
+#endif
+      if (pal_n == 4) {
+         for (; i < x; ++i)
+            memcpy(out + 4*i, lut + 4*in[i], 4);
+      } else {
+         // copy whole entries and let the next pixel overwrite the 4th byte
+         for (; i + 1 < x; ++i)
+            memcpy(out + 3*i, lut + 4*in[i], 4);
+         if (i < x)
+            memcpy(out + 3*i, lut + 4*in[i], 3);
+      }
+   } else {
+      // copy the smallest power of two that holds an entry, so the sizes
+      // are constant and little is written only to be overwritten
+      stbi__uint32 per = 8 / depth, bytes = per * pal_n, row = x * pal_n;
+      #define STBI__EXPAND(size) \
+         for (; bytes*i + size <= row; ++i) memcpy(out + bytes*i, lut + 32*in[i], size)
+      if      (bytes <=  2) STBI__EXPAND(2);
+      else if (bytes <=  4) STBI__EXPAND(4);
+      else if (bytes <=  8) STBI__EXPAND(8);
+      else if (bytes <= 16) STBI__EXPAND(16);
+      else                  STBI__EXPAND(32);
+      #undef STBI__EXPAND
+      for (; per*i < x; ++i) {
+         stbi__uint32 n = per*(i+1) <= x ? bytes : row - bytes*i;
+         memcpy(out + bytes*i, lut + 32*in[i], n);
+      }
+   }
+}
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
@@ -4603,9 +6845,18 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
+   stbi_uc *rows = NULL, *lut = NULL;
+   int expand_n = a->pal ? a->pal_n : out_n;
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   if (a->bitmap) {
+      STBI_ASSERT(depth == 1 && out_n == 1);
+      a->out = (stbi_uc *) stbi__malloc_mad2((x + 7) / 8, y, 0);
+   } else if (a->pal) {
+      STBI_ASSERT(out_n == 1);
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, a->pal_n, 0);
+   } else
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
@@ -4617,21 +6868,47 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
+   if (a->pal || depth < 8) {
+      // indices and sub-byte samples are unfiltered into two alternating
+      // rows, and each row is expanded straight into the final image
+      rows = (stbi_uc *) stbi__malloc_mad2(stride, 2, depth < 8 ? 256*32 : 0);
+      if (!rows) return stbi__err("outofmem", "Out of memory");
+      lut = a->pal;
+      if (depth < 8 && !a->bitmap) {
+         stbi_uc levels[16*4];
+         if (!a->pal) {
+            stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+            for (k=0; k < 16; ++k) {
+               levels[k*4+0] = STBI__BYTECAST(scale * k);
+               levels[k*4+1] = 255; // alpha, if out_n == 2
+            }
+         }
+         lut = rows + stride*2;
+         stbi__palette_lut(lut, a->pal ? a->pal : levels, expand_n, depth);
+      }
+   }
+
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
+      stbi_uc *cur = rows ? rows + stride*(j&1) : a->out + stride*j;
       stbi_uc *prior;
       int filter = *raw++;
 
-      if (filter > 4)
+      if (filter > 4) {
+         STBI_FREE(rows);
          return stbi__err("invalid filter","Corrupt PNG");
+      }
 
       if (depth < 8) {
-         if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
+         if (img_width_bytes > x) {
+            STBI_FREE(rows);
+            return stbi__err("invalid width","Corrupt PNG");
+         }
          cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
          filter_bytes = 1;
          width = img_width_bytes;
       }
       prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+      if (rows && !(j&1)) prior = cur + stride;
 
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
@@ -4672,9 +6949,14 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (depth < 8 || img_n == out_n) {
          int nk = (width - 1)*filter_bytes;
+         k = 0;
+#ifdef STBI_SSE2
+         if (depth == 8 && filter_bytes >= 3)
+            k = stbi__unfilter_simd(cur, raw, prior, nk, filter, filter_bytes);
+#endif
          #define STBI__CASE(f) \
              case f:     \
-                for (k=0; k < nk; ++k)
+                for (; k < nk; ++k)
          switch (filter) {
             // "none" filter turns into a memcpy here; make that explicit.
             case STBI__F_none:         memcpy(cur, raw, nk); break;
@@ -4713,81 +6995,25 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             }
          }
       }
-   }
 
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
+      // the previous row is no longer needed as a prior, so convert it
+      // while it's still in the cache instead of in a pass of its own
+      if (a->de_iphone && j > 0)
+         stbi__de_iphone_row(a->out + stride*(j-1), x, out_n, a->de_iphone == 2);
+
+      if (rows) {
+         stbi_uc *in = rows + stride*(j&1) + (depth < 8 ? x*out_n - img_width_bytes : 0);
+         if (a->bitmap)
+            memcpy(a->out + img_width_bytes*j, in, img_width_bytes);
+         else
+            stbi__expand_palette_row(a->out + x*expand_n*j, in, x, depth, lut, expand_n);
       }
-   } else if (depth == 16) {
+   }
+   if (a->de_iphone && y > 0)
+      stbi__de_iphone_row(a->out + stride*(y-1), x, out_n, a->de_iphone == 2);
+   STBI_FREE(rows);
+
+   if (depth == 16) {
       // force the image data from big-endian to platform-native.
       // this is done in a separate pass due to the decoding relying
       // on the data being untouched, but could probably be done
@@ -4935,6 +7161,21 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
+// packs the 0 or 255 pixels of a 1-bit grayscale image back into bits
+static int stbi__png_pack_bitmap(stbi__png *z)
+{
+   stbi__uint32 i, j, w = z->s->img_x, h = z->s->img_y, bpl = (w + 7) / 8;
+   stbi_uc *p = (stbi_uc *) stbi__malloc_mad2(bpl, h, 0);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+   memset(p, 0, bpl * h);
+   for (j=0; j < h; ++j)
+      for (i=0; i < w; ++i)
+         p[bpl*j + i/8] |= (z->out[w*j + i] & 0x80) >> (i & 7);
+   STBI_FREE(z->out);
+   z->out = p;
+   return 1;
+}
+
 static int stbi__unpremultiply_on_load_global = 0;
 static int stbi__de_iphone_flag_global = 0;
 
@@ -4978,44 +7219,8 @@ STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_conve
 static void stbi__de_iphone(stbi__png *z)
 {
    stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
-
-   if (s->img_out_n == 3) {  // convert bgr to rgb
-      for (i=0; i < pixel_count; ++i) {
-         stbi_uc t = p[0];
-         p[0] = p[2];
-         p[2] = t;
-         p += 3;
-      }
-   } else {
-      STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
-         // convert bgr to rgb and unpremultiply
-         for (i=0; i < pixel_count; ++i) {
-            stbi_uc a = p[3];
-            stbi_uc t = p[0];
-            if (a) {
-               stbi_uc half = a / 2;
-               p[0] = (p[2] * 255 + half) / a;
-               p[1] = (p[1] * 255 + half) / a;
-               p[2] = ( t   * 255 + half) / a;
-            } else {
-               p[0] = p[2];
-               p[2] = t;
-            }
-            p += 4;
-         }
-      } else {
-         // convert bgr to rgb
-         for (i=0; i < pixel_count; ++i) {
-            stbi_uc t = p[0];
-            p[0] = p[2];
-            p[2] = t;
-            p += 4;
-         }
-      }
-   }
+   STBI_ASSERT(s->img_out_n == 3 || s->img_out_n == 4);
+   stbi__de_iphone_row(z->out, s->img_x * s->img_y, s->img_out_n, stbi__unpremultiply_on_load);
 }
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
@@ -5027,7 +7232,10 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    stbi__uint16 tc16[3];
    stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
    int first=1,k,interlace=0, color=0, is_iphone=0;
+   int verify = stbi__verify_checksums;
    stbi__context *s = z->s;
+   stbi__context chunk, *cs; // what the chunk data is read from
+   stbi_uc body[1024]; // chunks that are parsed are smaller when valid
 
    z->expanded = NULL;
    z->idata = NULL;
@@ -5039,28 +7247,36 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
    for (;;) {
       stbi__pngchunk c = stbi__get_chunk_header(s);
+      cs = s;
+      if (verify && c.type != STBI__PNG_TYPE('I','D','A','T')) {
+         // the data is checked before it's parsed, from a copy
+         if (!stbi__png_check_chunk(s, c, body, sizeof(body))) return 0;
+         stbi__start_mem(&chunk, body, c.length <= sizeof(body) ? (int) c.length : 0);
+         cs = &chunk;
+      }
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
-            stbi__skip(s, c.length);
+            stbi__skip(cs, c.length);
             break;
          case STBI__PNG_TYPE('I','H','D','R'): {
             int comp,filter;
             if (!first) return stbi__err("multiple IHDR","Corrupt PNG");
             first = 0;
             if (c.length != 13) return stbi__err("bad IHDR len","Corrupt PNG");
-            s->img_x = stbi__get32be(s);
-            s->img_y = stbi__get32be(s);
+            s->img_x = stbi__get32be(cs);
+            s->img_y = stbi__get32be(cs);
             if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
-            z->depth = stbi__get8(s);  if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
-            color = stbi__get8(s);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
+            z->depth = stbi__get8(cs);  if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
+            color = stbi__get8(cs);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
             if (color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
             if (color == 3) pal_img_n = 3; else if (color & 1) return stbi__err("bad ctype","Corrupt PNG");
-            comp  = stbi__get8(s);  if (comp) return stbi__err("bad comp method","Corrupt PNG");
-            filter= stbi__get8(s);  if (filter) return stbi__err("bad filter method","Corrupt PNG");
-            interlace = stbi__get8(s); if (interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
+            comp  = stbi__get8(cs);  if (comp) return stbi__err("bad comp method","Corrupt PNG");
+            filter= stbi__get8(cs);  if (filter) return stbi__err("bad filter method","Corrupt PNG");
+            interlace = stbi__get8(cs); if (interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
             if (!s->img_x || !s->img_y) return stbi__err("0-pixel image","Corrupt PNG");
+            if (scan == STBI__SCAN_load && z->bitmap && (z->depth != 1 || color != 0)) return stbi__err("not a bitmap","PNG not 1-bit grayscale");
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
@@ -5081,9 +7297,9 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             pal_len = c.length / 3;
             if (pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
             for (i=0; i < pal_len; ++i) {
-               palette[i*4+0] = stbi__get8(s);
-               palette[i*4+1] = stbi__get8(s);
-               palette[i*4+2] = stbi__get8(s);
+               palette[i*4+0] = stbi__get8(cs);
+               palette[i*4+1] = stbi__get8(cs);
+               palette[i*4+2] = stbi__get8(cs);
                palette[i*4+3] = 255;
             }
             break;
@@ -5098,15 +7314,15 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                if (c.length > pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
                pal_img_n = 4;
                for (i=0; i < c.length; ++i)
-                  palette[i*4+3] = stbi__get8(s);
+                  palette[i*4+3] = stbi__get8(cs);
             } else {
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
                has_trans = 1;
                if (z->depth == 16) {
-                  for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
+                  for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(cs); // copy the values as-is
                } else {
-                  for (k = 0; k < s->img_n; ++k) tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
+                  for (k = 0; k < s->img_n; ++k) tc[k] = (stbi_uc)(stbi__get16be(cs) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
                }
             }
             break;
@@ -5128,26 +7344,50 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
+            if (verify && stbi__get32be(s) != stbi__png_chunk_crc(c, z->idata+ioff, c.length))
+               return stbi__err("bad CRC","Corrupt PNG");
             ioff += c.length;
             break;
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
+            int pack = 0;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
+            if (z->bitmap) {
+               has_trans = 0; // the mask is the gray bit alone
+               // interlaced passes are scattered as pixels, so pack those afterwards
+               pack = interlace;
+               z->bitmap = !interlace;
+            }
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+            stbi__stage(STBI_STAGE_INFLATE, 0);
             z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
+            stbi__stage(STBI_STAGE_INFLATE, 1);
             STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
+            // tRNS matches colors before the swap, so those images still
+            // take the separate pass after compute_transparency
+            z->de_iphone = 0;
+            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2 && z->depth == 8 && !has_trans)
+               z->de_iphone = stbi__unpremultiply_on_load ? 2 : 1;
+            // interlaced passes are scattered as indices, so those expand afterwards
+            z->pal = NULL;
+            if (pal_img_n && !interlace) {
+               z->pal = palette;
+               z->pal_n = req_comp >= 3 ? req_comp : pal_img_n;
+            }
+            stbi__stage(STBI_STAGE_UNFILTER, 0);
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (pack && !stbi__png_pack_bitmap(z)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -5155,22 +7395,23 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                   if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2 && !z->de_iphone)
                stbi__de_iphone(z);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!z->pal && !stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
                   return 0;
             } else if (has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
             STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__stage(STBI_STAGE_UNFILTER, 1);
             // end of PNG chunk, read and skip CRC
-            stbi__get32be(s);
+            if (!verify) stbi__get32be(s);
             return 1;
          }
 
@@ -5188,11 +7429,11 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                #endif
                return stbi__err(invalid_chunk, "PNG not supported: unknown PNG chunk type");
             }
-            stbi__skip(s, c.length);
+            stbi__skip(cs, c.length);
             break;
       }
-      // end of PNG chunk, read and skip CRC
-      stbi__get32be(s);
+      // end of PNG chunk, read and skip CRC, unless checked already
+      if (!verify) stbi__get32be(s);
    }
 }
 
@@ -5232,9 +7473,37 @@ static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req
 {
    stbi__png p;
    p.s = s;
+   p.bitmap = 0;
    return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
+static stbi_uc *stbi__png_bitmap(stbi__context *s, int *x, int *y)
+{
+   stbi__png p;
+   stbi__result_info ri;
+   stbi_uc *result;
+   p.s = s;
+   p.bitmap = 1;
+   result = (stbi_uc *) stbi__do_png(&p, x, y, NULL, 0, &ri);
+   if (result && stbi__vertically_flip_on_load)
+      stbi__vertical_flip(result, (*x + 7) / 8, *y, 1);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_png_bitmap_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__png_bitmap(&s, x, y);
+}
+
+STBIDEF stbi_uc *stbi_png_bitmap_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__png_bitmap(&s, x, y);
+}
+
 static int stbi__png_test(stbi__context *s)
 {
    int r;
@@ -5348,6 +7617,63 @@ static int stbi__shiftsigned(unsigned int v, int shift, int bits)
    return (int) ((unsigned) v * mul_table[bits]) >> shift_table[bits];
 }
 
+// unpacks w 16- or 32-bit pixels with the channel masks m, which
+// stbi__shiftsigned takes with shift and count, to RGBA; alpha is opaque if
+// there is no alpha mask; returns the OR of the alphas
+static int stbi__bmp_unpack_masked(stbi_uc *out, stbi_uc const *src, int w, int bpp, unsigned int const m[4], int const shift[4], int const count[4])
+{
+   int i = 0, c, alpha = 0;
+#ifdef STBI_SSE2
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      // the same steps as stbi__shiftsigned, on 4 pixels at a time
+      static unsigned short const mul_table[9] = { 0, 0xff, 0x55, 0x49, 0x11, 0x21, 0x41, 0x81, 0x01 };
+      static unsigned char const shift_table[9] = { 0, 0,0,1,0,2,4,6,0 };
+      __m128i mask[4], mul[4], rsh[4], lsh[4], low[4], frac[4], place[4];
+      __m128i zero = _mm_setzero_si128(), a = zero;
+      __m128i opaque = _mm_set1_epi32(m[3] ? 0 : (int) 0xff000000);
+      int channels = m[3] ? 4 : 3;
+      for (c = 0; c < channels; ++c) {
+         mask[c]  = _mm_set1_epi32((int) m[c]);
+         rsh[c]   = _mm_cvtsi32_si128(shift[c] > 0 ? shift[c] : 0);
+         lsh[c]   = _mm_cvtsi32_si128(shift[c] < 0 ? -shift[c] : 0);
+         low[c]   = _mm_cvtsi32_si128(8 - count[c]);
+         mul[c]   = _mm_set1_epi32(mul_table[count[c]]);
+         frac[c]  = _mm_cvtsi32_si128(shift_table[count[c]]);
+         place[c] = _mm_cvtsi32_si128(8*c);
+      }
+      for (; i + 4 <= w; i += 4) {
+         __m128i v, p = opaque;
+         if (bpp == 16)
+            v = _mm_unpacklo_epi16(_mm_loadl_epi64((__m128i const *) (src + 2*i)), zero);
+         else
+            v = _mm_loadu_si128((__m128i const *) (src + 4*i));
+         for (c = 0; c < channels; ++c) {
+            __m128i t = _mm_sll_epi32(_mm_srl_epi32(_mm_and_si128(v, mask[c]), rsh[c]), lsh[c]);
+            // t < 256 and the high halves are 0, so 16-bit products are exact
+            t = _mm_srl_epi32(_mm_mullo_epi16(_mm_srl_epi32(t, low[c]), mul[c]), frac[c]);
+            p = _mm_or_si128(p, _mm_sll_epi32(t, place[c]));
+         }
+         a = _mm_or_si128(a, p);
+         _mm_storeu_si128((__m128i *) (out + 4*i), p);
+      }
+      a = _mm_or_si128(a, _mm_srli_si128(a, 8));
+      a = _mm_or_si128(a, _mm_srli_si128(a, 4));
+      alpha |= (stbi__uint32) _mm_cvtsi128_si32(a) >> 24;
+   }
+#endif
+   for (; i < w; ++i) {
+      stbi__uint32 v = src[bpp/8*i] | (src[bpp/8*i+1] << 8);
+      int a;
+      if (bpp == 32) v |= ((stbi__uint32) src[4*i+2] << 16) | ((stbi__uint32) src[4*i+3] << 24);
+      for (c = 0; c < 3; ++c)
+         out[4*i+c] = STBI__BYTECAST(stbi__shiftsigned(v & m[c], shift[c], count[c]));
+      a = (m[3] ? stbi__shiftsigned(v & m[3], shift[3], count[3]) : 255);
+      out[4*i+3] = STBI__BYTECAST(a);
+      alpha |= a;
+   }
+   return alpha;
+}
+
 typedef struct
 {
    int bpp, offset, hsz;
@@ -5574,9 +7900,10 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
          }
       }
    } else {
-      int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
-      int z = 0;
-      int easy=0;
+      unsigned int mask[4];
+      int shift[4], count[4];
+      int easy=0, n;
+      stbi_uc *buf;
       stbi__skip(s, info.offset - info.extra_read - info.hsz);
       if (info.bpp == 24) width = 3 * s->img_x;
       else if (info.bpp == 16) width = 2*s->img_x;
@@ -5590,40 +7917,38 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       }
       if (!easy) {
          if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
-         // right shift amt to put high bit in position #7
-         rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
-         gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
-         bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
-         ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         mask[0] = mr; mask[1] = mg; mask[2] = mb; mask[3] = ma;
+         for (i=0; i < 4; ++i) {
+            // right shift amt to put high bit in position #7
+            shift[i] = stbi__high_bit(mask[i])-7; count[i] = stbi__bitcount(mask[i]);
+            if (count[i] > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         }
       }
+      // a row at a time, read in place if possible, converted straight to
+      // its row of the output; the scratch holds a row read and a row of
+      // RGBA for 3-channel output from masks
+      n = info.bpp/8 * s->img_x + pad;
+      buf = (stbi_uc *) stbi__malloc_mad2(s->img_x, 8, 4);
+      if (!buf) { STBI_FREE(out); return stbi__errpuc("outofmem", "Out of memory"); }
       for (j=0; j < (int) s->img_y; ++j) {
+         stbi_uc const *src = stbi__get_row(s, buf, n);
+         stbi_uc *dest = out + (flip_vertically ? (int) s->img_y-1-j : j)*s->img_x*target;
          if (easy) {
-            for (i=0; i < (int) s->img_x; ++i) {
-               unsigned char a;
-               out[z+2] = stbi__get8(s);
-               out[z+1] = stbi__get8(s);
-               out[z+0] = stbi__get8(s);
-               z += 3;
-               a = (easy == 2 ? stbi__get8(s) : 255);
-               all_a |= a;
-               if (target == 4) out[z++] = a;
-            }
+            all_a |= stbi__swap_rb(dest, src, s->img_x, easy == 2 ? 4 : 3, target);
+         } else if (target == 4) {
+            all_a |= stbi__bmp_unpack_masked(dest, src, s->img_x, info.bpp, mask, shift, count);
          } else {
-            int bpp = info.bpp;
+            stbi_uc *rgba = buf + 4*s->img_x + 4;
+            all_a |= stbi__bmp_unpack_masked(rgba, src, s->img_x, info.bpp, mask, shift, count);
             for (i=0; i < (int) s->img_x; ++i) {
-               stbi__uint32 v = (bpp == 16 ? (stbi__uint32) stbi__get16le(s) : stbi__get32le(s));
-               unsigned int a;
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
-               a = (ma ? stbi__shiftsigned(v & ma, ashift, acount) : 255);
-               all_a |= a;
-               if (target == 4) out[z++] = STBI__BYTECAST(a);
+               dest[3*i+0] = rgba[4*i+0];
+               dest[3*i+1] = rgba[4*i+1];
+               dest[3*i+2] = rgba[4*i+2];
             }
          }
-         stbi__skip(s, pad);
       }
+      STBI_FREE(buf);
+      flip_vertically = 0; // the rows went straight to their flipped place
    }
 
    // if alpha channel is all 0s, replace with all 255s
@@ -5852,42 +8177,86 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    // skip to the data's starting position (offset usually = 0)
    stbi__skip(s, tga_offset );
 
+   //   do I need to load a palette?
+   if ( tga_indexed)
+   {
+      if (tga_palette_len == 0) {  /* you have to have at least one entry! */
+         STBI_FREE(tga_data);
+         return stbi__errpuc("bad palette", "Corrupt TGA");
+      }
+
+      //   any data to skip? (offset usually = 0)
+      stbi__skip(s, tga_palette_start );
+      //   load the palette
+      tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
+      if (!tga_palette) {
+         STBI_FREE(tga_data);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
+      if (tga_rgb16) {
+         stbi_uc *pal_entry = tga_palette;
+         STBI_ASSERT(tga_comp == STBI_rgb);
+         for (i=0; i < tga_palette_len; ++i) {
+            stbi__tga_read_rgb16(s, pal_entry);
+            pal_entry += tga_comp;
+         }
+      } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
+            STBI_FREE(tga_data);
+            STBI_FREE(tga_palette);
+            return stbi__errpuc("bad palette", "Corrupt TGA");
+      }
+   }
+
    if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
       for (i=0; i < tga_height; ++i) {
          int row = tga_inverted ? tga_height -i - 1 : i;
          stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
          stbi__getn(s, tga_row, tga_width * tga_comp);
       }
-   } else  {
-      //   do I need to load a palette?
-      if ( tga_indexed)
-      {
-         if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
-            return stbi__errpuc("bad palette", "Corrupt TGA");
-         }
-
-         //   any data to skip? (offset usually = 0)
-         stbi__skip(s, tga_palette_start );
-         //   load the palette
-         tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
-         if (!tga_palette) {
-            STBI_FREE(tga_data);
-            return stbi__errpuc("outofmem", "Out of memory");
-         }
-         if (tga_rgb16) {
-            stbi_uc *pal_entry = tga_palette;
-            STBI_ASSERT(tga_comp == STBI_rgb);
-            for (i=0; i < tga_palette_len; ++i) {
-               stbi__tga_read_rgb16(s, pal_entry);
-               pal_entry += tga_comp;
+   } else if ( !tga_is_RLE ) {
+      // indices or 16-bit pixels, a row at a time
+      int index_size = (tga_bits_per_pixel == 8) ? 1 : 2;
+      int n = tga_indexed ? tga_width * index_size : tga_width * 2;
+      stbi_uc *buf = (stbi_uc *) stbi__malloc_mad2(tga_width, 2, 0);
+      if (!buf) {
+         STBI_FREE(tga_data);
+         STBI_FREE(tga_palette);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
+      for (i=0; i < tga_height; ++i) {
+         int row = tga_inverted ? tga_height -i - 1 : i;
+         stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
+         stbi_uc const *src = stbi__get_row(s, buf, n);
+         if ( tga_indexed ) {
+            for (j=0; j < tga_width; ++j) {
+               int pal_idx = (index_size == 1) ? src[j] : src[2*j] + (src[2*j+1] << 8);
+               stbi_uc const *entry;
+               if ( pal_idx >= tga_palette_len ) {
+                  // invalid index
+                  pal_idx = 0;
+               }
+               entry = tga_palette + pal_idx*tga_comp;
+               switch (tga_comp) {
+                  case 4: tga_row[3] = entry[3]; /* fallthrough */
+                  case 3: tga_row[2] = entry[2]; /* fallthrough */
+                  case 2: tga_row[1] = entry[1]; /* fallthrough */
+                  default: tga_row[0] = entry[0];
+               }
+               tga_row += tga_comp;
+            }
+         } else {
+            // the same conversion as stbi__tga_read_rgb16
+            for (j=0; j < tga_width; ++j) {
+               int px = src[2*j] + (src[2*j+1] << 8);
+               tga_row[0] = (stbi_uc) ((((px >> 10) & 31) * 255) / 31);
+               tga_row[1] = (stbi_uc) ((((px >>  5) & 31) * 255) / 31);
+               tga_row[2] = (stbi_uc) ((( px        & 31) * 255) / 31);
+               tga_row += 3;
             }
-         } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
-               return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
+      STBI_FREE(buf);
+   } else  {
       //   load the data
       for (i=0; i < tga_width * tga_height; ++i)
       {
@@ -5962,25 +8331,16 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
             }
          }
       }
-      //   clear my palette, if I had one
-      if ( tga_palette != NULL )
-      {
-         STBI_FREE( tga_palette );
-      }
+   }
+   //   clear my palette, if I had one
+   if ( tga_palette != NULL )
+   {
+      STBI_FREE( tga_palette );
    }
 
    // swap RGB - if the source data was RGB16, it already is in the right order
    if (tga_comp >= 3 && !tga_rgb16)
-   {
-      unsigned char* tga_pixel = tga_data;
-      for (i=0; i < tga_width * tga_height; ++i)
-      {
-         unsigned char temp = tga_pixel[0];
-         tga_pixel[0] = tga_pixel[2];
-         tga_pixel[2] = temp;
-         tga_pixel += tga_comp;
-      }
-   }
+      stbi__swap_rb(tga_data, tga_data, tga_width * tga_height, tga_comp, tga_comp);
 
    // convert to target component count
    if (req_comp && req_comp != tga_comp)
@@ -6007,13 +8367,24 @@ static int stbi__psd_test(stbi__context *s)
    return r;
 }
 
-static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
+// RLE as used by .PSD and .TIFF
+// Loop until you get the number of unpacked bytes you are expecting:
+//     Read the next source byte into n.
+//     If n is between 0 and 127 inclusive, copy the next n+1 bytes literally.
+//     Else if n is between -127 and -1 inclusive, copy the next byte -n+1 times.
+//     Else if n is 128, noop.
+// Endloop
+
+// decodes a channel of pixelCount bytes to p with a stride of 4; the data
+// is read from src[*at..n), then from s
+static int stbi__psd_decode_rle(stbi__context *s, stbi_uc const *src, int n, int *at, stbi_uc *p, int pixelCount)
 {
    int count, nleft, len;
 
+   #define STBI__PSD_GET8()  (*at < n ? src[(*at)++] : stbi__get8(s))
    count = 0;
    while ((nleft = pixelCount - count) > 0) {
-      len = stbi__get8(s);
+      len = STBI__PSD_GET8();
       if (len == 128) {
          // No-op.
       } else if (len < 128) {
@@ -6022,7 +8393,7 @@ static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
          if (len > nleft) return 0; // corrupt data
          count += len;
          while (len) {
-            *p = stbi__get8(s);
+            *p = STBI__PSD_GET8();
             p += 4;
             len--;
          }
@@ -6032,7 +8403,7 @@ static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
          // (Interpret len as a negative 8-bit int.)
          len = 257 - len;
          if (len > nleft) return 0; // corrupt data
-         val = stbi__get8(s);
+         val = STBI__PSD_GET8();
          count += len;
          while (len) {
             *p = val;
@@ -6041,10 +8412,187 @@ static int stbi__psd_decode_rle(stbi__context *s, stbi_uc *p, int pixelCount)
          }
       }
    }
+   #undef STBI__PSD_GET8
 
    return 1;
 }
 
+// unpacks a row of count bytes from exactly the n bytes of src that the
+// row byte counts give it; fails on anything else, such as a run that
+// carries on into the next row
+static int stbi__psd_unpack_row(stbi_uc *out, int count, stbi_uc const *src, int n)
+{
+   int i = 0, k = 0, len;
+   while (k < count) {
+      if (i >= n) return 0;
+      len = src[i++];
+      if (len < 128) {
+         len++;
+         if (len > count - k || len > n - i) return 0;
+         memcpy(out + k, src + i, len);
+         i += len;
+         k += len;
+      } else if (len > 128) {
+         len = 257 - len;
+         if (len > count - k || i >= n) return 0;
+         memset(out + k, src[i++], len);
+         k += len;
+      }
+   }
+   while (i < n && src[i] == 128) ++i; // trailing no-ops
+   return i == n;
+}
+
+// interleaves 4 planes of w bytes, one after the other, into RGBA pixels
+static void stbi__psd_interleave(stbi_uc *out, stbi_uc const *planes, int w)
+{
+   stbi_uc const *r = planes, *g = planes + w, *b = planes + 2*w, *a = planes + 3*w;
+   int i = 0;
+#ifdef STBI_SSE2
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      for (; i + 16 <= w; i += 16) {
+         __m128i rg_lo, rg_hi, ba_lo, ba_hi;
+         __m128i vr = _mm_loadu_si128((__m128i const *) (r + i));
+         __m128i vg = _mm_loadu_si128((__m128i const *) (g + i));
+         __m128i vb = _mm_loadu_si128((__m128i const *) (b + i));
+         __m128i va = _mm_loadu_si128((__m128i const *) (a + i));
+         rg_lo = _mm_unpacklo_epi8(vr, vg);
+         rg_hi = _mm_unpackhi_epi8(vr, vg);
+         ba_lo = _mm_unpacklo_epi8(vb, va);
+         ba_hi = _mm_unpackhi_epi8(vb, va);
+         _mm_storeu_si128((__m128i *) (out + 4*i +  0), _mm_unpacklo_epi16(rg_lo, ba_lo));
+         _mm_storeu_si128((__m128i *) (out + 4*i + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+         _mm_storeu_si128((__m128i *) (out + 4*i + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+         _mm_storeu_si128((__m128i *) (out + 4*i + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+      }
+   }
+#elif defined(STBI_NEON)
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      for (; i + 16 <= w; i += 16) {
+         uint8x16x4_t v;
+         v.val[0] = vld1q_u8(r + i);
+         v.val[1] = vld1q_u8(g + i);
+         v.val[2] = vld1q_u8(b + i);
+         v.val[3] = vld1q_u8(a + i);
+         vst4q_u8(out + 4*i, v);
+      }
+   }
+#endif
+   for (; i < w; ++i) {
+      out[4*i+0] = r[i];
+      out[4*i+1] = g[i];
+      out[4*i+2] = b[i];
+      out[4*i+3] = a[i];
+   }
+}
+
+#define STBI__PSD_BAND  16 // rows per parallel item
+
+typedef struct
+{
+   stbi_uc *out;
+   stbi_uc const *src;       // RLE data of the channels decoded
+   int const *start;         // offset of row y of channel c at [c*h + y], then the end
+   int w, h, channels;
+   int bad;                  // some row didn't unpack from its own bytes
+} stbi__psd_rows;
+
+// unpacks bands k, k+n, ... of rows of every channel into a planar scratch
+// row, which is interleaved into the output
+static void stbi__psd_unpack_rows(void *data, int k, int n)
+{
+   stbi__psd_rows *r = (stbi__psd_rows *) data;
+   int bands = (r->h + STBI__PSD_BAND-1) / STBI__PSD_BAND, band, y, c;
+   stbi_uc *planes = (stbi_uc *) stbi__malloc_mad2(4, r->w, 0);
+   if (planes == NULL) { r->bad = 1; return; }
+   // channels missing from the file are 0, or opaque for alpha
+   for (c = r->channels; c < 4; ++c)
+      memset(planes + c*r->w, c == 3 ? 255 : 0, r->w);
+   for (band = k; band < bands && !r->bad; band += n) {
+      int y1 = (band+1)*STBI__PSD_BAND < r->h ? (band+1)*STBI__PSD_BAND : r->h;
+      for (y = band*STBI__PSD_BAND; y < y1; ++y) {
+         for (c = 0; c < r->channels; ++c) {
+            int at = r->start[c*r->h + y];
+            if (!stbi__psd_unpack_row(planes + c*r->w, r->w, r->src + at, r->start[c*r->h + y + 1] - at)) {
+               r->bad = 1;
+               break;
+            }
+         }
+         stbi__psd_interleave(r->out + (size_t) 4*r->w*y, planes, r->w);
+      }
+   }
+   STBI_FREE(planes);
+}
+
+// the RLE data is preceded by a 2-byte data count for each row of each
+// channel, which tells where every row starts so they can be unpacked in
+// parallel; if the counts don't match the data, which the format allows
+// decoders to ignore, each channel is decoded as one stream instead
+static int stbi__psd_decode_rle_image(stbi__context *s, stbi_uc *out, int w, int h, int channelCount)
+{
+   stbi__psd_rows r;
+   int channels = channelCount < 4 ? channelCount : 4, rows, i, n, at, ok = 1;
+   int *start;
+   stbi_uc *data = NULL, *p;
+   stbi_uc const *src;
+
+   if (!stbi__mad2sizes_valid(h, channels, 1)) return stbi__err("too large", "Corrupt PSD");
+   rows = h * channels;
+   start = (int *) stbi__malloc_mad2(rows + 1, sizeof(int), 0);
+   if (start == NULL) return stbi__err("outofmem", "Out of memory");
+   start[0] = 0;
+   for (i = 0; i < rows; ++i) {
+      int len = stbi__get16be(s);
+      if (len > INT_MAX - start[i]) ok = 0, len = 0;
+      start[i+1] = start[i] + len;
+   }
+   stbi__skip(s, h * (channelCount - channels) * 2);
+
+   if (s->io.read == NULL) {
+      // from memory, where the data can be used in place
+      src = s->img_buffer;
+      n = (int) (s->img_buffer_end - s->img_buffer);
+      s->img_buffer = s->img_buffer_end;
+   } else {
+      n = ok ? start[rows] : 0;
+      data = (stbi_uc *) stbi__malloc(n ? n : 1);
+      if (data == NULL) { STBI_FREE(start); return stbi__err("outofmem", "Out of memory"); }
+      // past the end of the file is read as 0, as stbi__get8 does
+      memset(data, 0, n);
+      if (!stbi__getn(s, data, n)) ok = 0;
+      src = data;
+   }
+
+   r.bad = !ok || start[rows] > n;
+   if (!r.bad) {
+      r.out = out;
+      r.src = src;
+      r.start = start;
+      r.w = w;
+      r.h = h;
+      r.channels = channels;
+      stbi__run_parallel(stbi__psd_unpack_rows, &r, (h + STBI__PSD_BAND-1) / STBI__PSD_BAND);
+   }
+   if (r.bad) {
+      at = 0;
+      for (i = 0; i < 4 && ok >= 0; ++i) {
+         p = out + i;
+         if (i >= channels) {
+            // Fill this channel with default data.
+            int k;
+            for (k = 0; k < w*h; k++, p += 4)
+               *p = (i == 3 ? 255 : 0);
+         } else if (!stbi__psd_decode_rle(s, src, n, &at, p, w*h)) {
+            ok = -1;
+         }
+      }
+   }
+   STBI_FREE(start);
+   STBI_FREE(data);
+   if (ok < 0) return stbi__err("corrupt", "bad RLE data");
+   return 1;
+}
+
 static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    int pixelCount;
@@ -6133,36 +8681,11 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    // Finally, the image data.
    if (compression) {
-      // RLE as used by .PSD and .TIFF
-      // Loop until you get the number of unpacked bytes you are expecting:
-      //     Read the next source byte into n.
-      //     If n is between 0 and 127 inclusive, copy the next n+1 bytes literally.
-      //     Else if n is between -127 and -1 inclusive, copy the next byte -n+1 times.
-      //     Else if n is 128, noop.
-      // Endloop
-
-      // The RLE-compressed data is preceded by a 2-byte data count for each row in the data,
-      // which we're going to just skip.
-      stbi__skip(s, h * channelCount * 2 );
-
-      // Read the RLE data by channel.
-      for (channel = 0; channel < 4; channel++) {
-         stbi_uc *p;
-
-         p = out+channel;
-         if (channel >= channelCount) {
-            // Fill this channel with default data.
-            for (i = 0; i < pixelCount; i++, p += 4)
-               *p = (channel == 3 ? 255 : 0);
-         } else {
-            // Read the RLE data.
-            if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
-               return stbi__errpuc("corrupt", "bad RLE data");
-            }
-         }
+      // Read the RLE data, see stbi__psd_decode_rle_image
+      if (!stbi__psd_decode_rle_image(s, out, w, h, channelCount)) {
+         STBI_FREE(out);
+         return NULL;
       }
-
    } else {
       // We're at the raw image data.  It's each channel in order (Red, Green, Blue, Alpha, ...)
       // where each channel consists of an 8-bit (or 16-bit) value for each pixel in the image.
@@ -6477,6 +9000,7 @@ typedef struct
    stbi__int16 prefix;
    stbi_uc first;
    stbi_uc suffix;
+   stbi__uint16 length;   // of the string, less than 8192
 } stbi__gif_lzw;
 
 typedef struct
@@ -6489,6 +9013,7 @@ typedef struct
    stbi_uc  pal[256][4];
    stbi_uc lpal[256][4];
    stbi__gif_lzw codes[8192];
+   stbi_uc string[8192];         // a code's string, when it continues on another line
    stbi_uc *color_table;
    int parse, step;
    int lflags;
@@ -6573,23 +9098,18 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    return 1;
 }
 
-static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+static void stbi__out_gif_pixel(stbi__gif *g, stbi_uc index)
 {
    stbi_uc *p, *c;
    int idx;
 
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi__out_gif_code(g, g->codes[code].prefix);
-
    if (g->cur_y >= g->max_y) return;
 
    idx = g->cur_x + g->cur_y;
    p = &g->out[idx];
    g->history[idx / 4] = 1;
 
-   c = &g->color_table[g->codes[code].suffix * 4];
+   c = &g->color_table[index * 4];
    if (c[3] > 128) { // don't render transparent pixels;
       p[0] = c[2];
       p[1] = c[1];
@@ -6610,12 +9130,47 @@ static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
    }
 }
 
+static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+{
+   int i, len = g->codes[code].length;
+
+   // the linked-list is backwards, so a string that fits on the current
+   // line is written from its last pixel back to its first
+   if (g->cur_y < g->max_y && g->cur_x + 4*len < g->max_x) {
+      int idx = g->cur_x + g->cur_y + 4*len;
+      for (i=0; i < len; ++i) {
+         stbi_uc *c = &g->color_table[g->codes[code].suffix * 4];
+         idx -= 4;
+         g->history[idx / 4] = 1;
+         if (c[3] > 128) { // don't render transparent pixels;
+            stbi_uc *p = &g->out[idx];
+            p[0] = c[2];
+            p[1] = c[1];
+            p[2] = c[0];
+            p[3] = c[3];
+         }
+         code = g->codes[code].prefix;
+      }
+      g->cur_x += 4*len;
+      return;
+   }
+
+   // otherwise it is unpacked and written a pixel at a time, moving on to
+   // the next line, or next interlace pass, as needed
+   for (i=len-1; i >= 0; --i) {
+      g->string[i] = g->codes[code].suffix;
+      code = g->codes[code].prefix;
+   }
+   for (i=0; i < len; ++i)
+      stbi__out_gif_pixel(g, g->string[i]);
+}
+
 static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
 {
    stbi_uc lzw_cs;
    stbi__int32 len, init_code;
-   stbi__uint32 first;
-   stbi__int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
+   stbi__uint32 first, bits;
+   stbi__int32 codesize, codemask, avail, oldcode, valid_bits, clear, ended;
    stbi__gif_lzw *p;
 
    lzw_cs = stbi__get8(s);
@@ -6630,6 +9185,7 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
       g->codes[init_code].prefix = -1;
       g->codes[init_code].first = (stbi_uc) init_code;
       g->codes[init_code].suffix = (stbi_uc) init_code;
+      g->codes[init_code].length = 1;
    }
 
    // support no starting clear code
@@ -6637,21 +9193,28 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    oldcode = -1;
 
    len = 0;
+   ended = 0;
    for(;;) {
-      if (valid_bits < codesize) {
+      // read as many bytes as fit, across data sub-blocks, until the
+      // terminating empty one
+      while (valid_bits <= 24 && !ended) {
          if (len == 0) {
             len = stbi__get8(s); // start new block
-            if (len == 0)
-               return g->out;
+            if (len == 0) {
+               ended = 1;
+               break;
+            }
          }
          --len;
-         bits |= (stbi__int32) stbi__get8(s) << valid_bits;
+         bits |= (stbi__uint32) stbi__get8(s) << valid_bits;
          valid_bits += 8;
-      } else {
+      }
+      if (valid_bits < codesize)
+         return g->out;
+      else {
          stbi__int32 code = bits & codemask;
          bits >>= codesize;
          valid_bits -= codesize;
-         // @OPTIMIZE: is there some way we can accelerate the non-clear path?
          if (code == clear) {  // clear code
             codesize = lzw_cs + 1;
             codemask = (1 << codesize) - 1;
@@ -6659,9 +9222,11 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
             oldcode = -1;
             first = 0;
          } else if (code == clear + 1) { // end of stream code
-            stbi__skip(s, len);
-            while ((len = stbi__get8(s)) > 0)
-               stbi__skip(s,len);
+            if (!ended) {
+               stbi__skip(s, len);
+               while ((len = stbi__get8(s)) > 0)
+                  stbi__skip(s,len);
+            }
             return g->out;
          } else if (code <= avail) {
             if (first) {
@@ -6677,6 +9242,7 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
                p->prefix = (stbi__int16) oldcode;
                p->first = g->codes[oldcode].first;
                p->suffix = (code == avail) ? p->first : g->codes[code].first;
+               p->length = g->codes[oldcode].length + 1;
             } else if (code == avail)
                return stbi__errpuc("illegal code in raster", "Corrupt GIF");
 
@@ -6871,11 +9437,51 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
    }
 }
 
-static void *stbi__load_gif_main_outofmem(stbi__gif *g, stbi_uc *out, int **delays)
+// the frames of an animation, keeping the one before the last for frames
+// disposed of by restoring the previous one
+typedef struct
+{
+   stbi__gif g;
+   stbi_uc *two_back;   // frame layers-2
+   stbi_uc *spare;      // frame layers-1, while the next one is decoded
+   int layers;
+} stbi__gif_anim;
+
+static void stbi__gif_anim_free(stbi__gif_anim *a)
+{
+   STBI_FREE(a->g.out);
+   STBI_FREE(a->g.history);
+   STBI_FREE(a->g.background);
+   STBI_FREE(a->two_back);
+   STBI_FREE(a->spare);
+}
+
+// the next frame, in a->g.out, or NULL after the last one or on error
+static stbi_uc *stbi__gif_anim_next(stbi__context *s, stbi__gif_anim *a, int *comp, int req_comp)
+{
+   stbi_uc *u, *t;
+   if (a->layers >= 1) {
+      size_t stride = (size_t) a->g.w * a->g.h * 4;
+      if (a->spare == NULL) {
+         a->spare = (stbi_uc *) stbi__malloc(stride);
+         if (a->spare == NULL) return stbi__errpuc("outofmem", "Out of memory");
+      }
+      memcpy(a->spare, a->g.out, stride);
+   }
+   u = stbi__gif_load_next(s, &a->g, comp, req_comp, a->layers >= 2 ? a->two_back : 0);
+   if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
+   if (u) {
+      t = a->two_back;
+      a->two_back = a->spare;
+      a->spare = t;
+      ++a->layers;
+   }
+   return u;
+}
+
+static void *stbi__load_gif_main_outofmem(stbi__gif_anim *a, stbi_uc *out, int **delays)
 {
-   STBI_FREE(g->out);
-   STBI_FREE(g->history);
-   STBI_FREE(g->background);
+   stbi__gif_anim_free(a);
 
    if (out) STBI_FREE(out);
    if (delays && *delays) STBI_FREE(*delays);
@@ -6888,8 +9494,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       int layers = 0;
       stbi_uc *u = 0;
       stbi_uc *out = 0;
-      stbi_uc *two_back = 0;
-      stbi__gif g;
+      stbi__gif_anim a;
       int stride;
       int out_size = 0;
       int delays_size = 0;
@@ -6897,25 +9502,24 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       STBI_NOTUSED(out_size);
       STBI_NOTUSED(delays_size);
 
-      memset(&g, 0, sizeof(g));
+      memset(&a, 0, sizeof(a));
       if (delays) {
          *delays = 0;
       }
 
       do {
-         u = stbi__gif_load_next(s, &g, comp, req_comp, two_back);
-         if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
+         u = stbi__gif_anim_next(s, &a, comp, req_comp);
 
          if (u) {
-            *x = g.w;
-            *y = g.h;
+            *x = a.g.w;
+            *y = a.g.h;
             ++layers;
-            stride = g.w * g.h * 4;
+            stride = a.g.w * a.g.h * 4;
 
             if (out) {
                void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
                if (!tmp)
-                  return stbi__load_gif_main_outofmem(&g, out, delays);
+                  return stbi__load_gif_main_outofmem(&a, out, delays);
                else {
                    out = (stbi_uc*) tmp;
                    out_size = layers * stride;
@@ -6924,41 +9528,36 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                if (delays) {
                   int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
                   if (!new_delays)
-                     return stbi__load_gif_main_outofmem(&g, out, delays);
+                     return stbi__load_gif_main_outofmem(&a, out, delays);
                   *delays = new_delays;
                   delays_size = layers * sizeof(int);
                }
             } else {
                out = (stbi_uc*)stbi__malloc( layers * stride );
                if (!out)
-                  return stbi__load_gif_main_outofmem(&g, out, delays);
+                  return stbi__load_gif_main_outofmem(&a, out, delays);
                out_size = layers * stride;
                if (delays) {
                   *delays = (int*) stbi__malloc( layers * sizeof(int) );
                   if (!*delays)
-                     return stbi__load_gif_main_outofmem(&g, out, delays);
+                     return stbi__load_gif_main_outofmem(&a, out, delays);
                   delays_size = layers * sizeof(int);
                }
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
-            if (layers >= 2) {
-               two_back = out - 2 * stride;
-            }
 
             if (delays) {
-               (*delays)[layers - 1U] = g.delay;
+               (*delays)[layers - 1U] = a.g.delay;
             }
          }
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__gif_anim_free(&a);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
-         out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h);
+         out = stbi__convert_format(out, 4, req_comp, layers * a.g.w, a.g.h);
 
       *z = layers;
       return out;
@@ -6967,6 +9566,107 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
    }
 }
 
+struct stbi_gif_frames
+{
+   stbi__context s;
+   stbi__gif_anim a;
+   stbi_uc *flipped;
+   int done;
+#ifndef STBI_NO_STDIO
+   FILE *f;
+#endif
+};
+
+static stbi_gif_frames *stbi__gif_frames_start(stbi_gif_frames *g, int *x, int *y)
+{
+   if (!stbi__gif_header(&g->s, &g->a.g, NULL, 1)) {
+      stbi_gif_frames_close(g);
+      return NULL;
+   }
+   if (x) *x = g->a.g.w;
+   if (y) *y = g->a.g.h;
+   // the first frame reads the header again
+   stbi__rewind(&g->s);
+   memset(&g->a.g, 0, sizeof(g->a.g));
+   return g;
+}
+
+static stbi_gif_frames *stbi__gif_frames_alloc(void)
+{
+   stbi_gif_frames *g = (stbi_gif_frames *) stbi__malloc(sizeof(stbi_gif_frames));
+   if (g == NULL) return (stbi_gif_frames *) stbi__errpuc("outofmem", "Out of memory");
+   memset(g, 0, sizeof(*g));
+   return g;
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi_gif_frames *g = stbi__gif_frames_alloc();
+   if (g == NULL) return NULL;
+   stbi__start_mem(&g->s, buffer, len);
+   return stbi__gif_frames_start(g, x, y);
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y)
+{
+   stbi_gif_frames *g = stbi__gif_frames_alloc();
+   if (g == NULL) return NULL;
+   stbi__start_callbacks(&g->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_frames_start(g, x, y);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open(char const *filename, int *x, int *y)
+{
+   stbi_gif_frames *g;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return (stbi_gif_frames *) stbi__errpuc("can't fopen", "Unable to open file");
+   g = stbi__gif_frames_alloc();
+   if (g == NULL) {
+      fclose(f);
+      return NULL;
+   }
+   g->f = f;
+   stbi__start_file(&g->s, f);
+   return stbi__gif_frames_start(g, x, y);
+}
+#endif
+
+STBIDEF stbi_uc *stbi_gif_frames_next(stbi_gif_frames *g, int *delay)
+{
+   int comp;
+   stbi_uc *u;
+   if (g->done) return NULL;
+   u = stbi__gif_anim_next(&g->s, &g->a, &comp, 4);
+   if (u == NULL) {
+      g->done = 1;
+      return NULL;
+   }
+   if (delay) *delay = g->a.g.delay;
+   if (stbi__vertically_flip_on_load) {
+      size_t stride = (size_t) g->a.g.w * g->a.g.h * 4;
+      if (g->flipped == NULL) {
+         g->flipped = (stbi_uc *) stbi__malloc(stride);
+         if (g->flipped == NULL) return stbi__errpuc("outofmem", "Out of memory");
+      }
+      memcpy(g->flipped, u, stride);
+      stbi__vertical_flip(g->flipped, g->a.g.w, g->a.g.h, 4);
+      u = g->flipped;
+   }
+   return u;
+}
+
+STBIDEF void stbi_gif_frames_close(stbi_gif_frames *g)
+{
+   if (g == NULL) return;
+   stbi__gif_anim_free(&g->a);
+   STBI_FREE(g->flipped);
+#ifndef STBI_NO_STDIO
+   if (g->f) fclose(g->f);
+#endif
+   STBI_FREE(g);
+}
+
 static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    stbi_uc *u = 0;
@@ -7050,12 +9750,22 @@ static char *stbi__hdr_gettoken(stbi__context *z, char *buffer)
    return buffer;
 }
 
+// 2^(e-136), the scale of the mantissas of a pixel with exponent e > 0,
+// built from its float bits; the smallest ones are denormals
+static float stbi__hdr_scale(int e)
+{
+   stbi__uint32 bits = e >= 10 ? (stbi__uint32) (e - 9) << 23 : (stbi__uint32) 1 << (e + 13);
+   float f;
+   memcpy(&f, &bits, sizeof(f));
+   return f;
+}
+
 static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
 {
    if ( input[3] != 0 ) {
       float f1;
       // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+      f1 = stbi__hdr_scale(input[3]);
       if (req_comp <= 2)
          output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
       else {
@@ -7077,6 +9787,66 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
+#ifdef STBI_SSE2
+static __m128i stbi__hdr_load4(stbi_uc *p)
+{
+   __m128i zero = _mm_setzero_si128();
+   int v;
+   memcpy(&v, p, sizeof(v));
+   return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+}
+#endif
+
+// pixel i of a scanline decoded to planes of r, g, b and e bytes
+static void stbi__hdr_convert_plane_pixel(float *output, stbi_uc *planes, int width, int i, int req_comp)
+{
+   stbi_uc rgbe[4];
+   rgbe[0] = planes[i];
+   rgbe[1] = planes[width + i];
+   rgbe[2] = planes[2*width + i];
+   rgbe[3] = planes[3*width + i];
+   stbi__hdr_convert(output + i*req_comp, rgbe, req_comp);
+}
+
+static void stbi__hdr_convert_planes(float *output, stbi_uc *planes, int width, int req_comp)
+{
+   int i = 0;
+
+#ifdef STBI_SSE2
+   if (req_comp >= 3 && stbi_simd_level() >= STBI_SIMD_SSE2) {
+      __m128i zero = _mm_setzero_si128();
+      __m128i nine = _mm_set1_epi32(9);
+      __m128i ten  = _mm_set1_epi32(10);
+      // the stores of 3 components write the first float of the next pixel
+      int k, end = req_comp == 4 ? width - 3 : width - 4;
+      for (; i < end; i += 4) {
+         __m128i e = stbi__hdr_load4(planes + 3*width + i);
+         __m128 r, g, b, a, scale;
+         // exponents 1..9 scale to denormals, those go the slow way
+         if (_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi32(e, zero), _mm_cmplt_epi32(e, ten)))) {
+            for (k=0; k < 4; ++k)
+               stbi__hdr_convert_plane_pixel(output, planes, width, i+k, req_comp);
+            continue;
+         }
+         // 2^(e-136) as float bits, and 0 for e == 0 (black)
+         scale = _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(_mm_sub_epi32(e, nine), 23), _mm_cmpgt_epi32(e, zero)));
+         r = _mm_mul_ps(_mm_cvtepi32_ps(stbi__hdr_load4(planes + i)), scale);
+         g = _mm_mul_ps(_mm_cvtepi32_ps(stbi__hdr_load4(planes + width + i)), scale);
+         b = _mm_mul_ps(_mm_cvtepi32_ps(stbi__hdr_load4(planes + 2*width + i)), scale);
+         a = _mm_set1_ps(1.0f);
+         _MM_TRANSPOSE4_PS(r, g, b, a);
+         _mm_storeu_ps(output + (i+0)*req_comp, r);
+         _mm_storeu_ps(output + (i+1)*req_comp, g);
+         _mm_storeu_ps(output + (i+2)*req_comp, b);
+         _mm_storeu_ps(output + (i+3)*req_comp, a);
+      }
+   }
+#endif
+
+   for (; i < width; ++i)
+      stbi__hdr_convert_plane_pixel(output, planes, width, i, req_comp);
+}
+
 static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -7087,7 +9857,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
    float *hdr_data;
    int len;
    unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   int i, j, k, c1,c2;
    const char *headerToken;
    STBI_NOTUSED(ri);
 
@@ -7178,7 +9948,10 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             }
          }
 
+         // each component is decoded to its own plane, so runs and dumps
+         // are contiguous
          for (k = 0; k < 4; ++k) {
+            stbi_uc *plane = scanline + k * width;
             int nleft;
             i = 0;
             while ((nleft = width - i) > 0) {
@@ -7188,18 +9961,16 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   value = stbi__get8(s);
                   count -= 128;
                   if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
+                  memset(plane + i, value, count);
                } else {
-                  // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = stbi__get8(s);
+                  // Dump; an empty one, which is also what a truncated file
+                  // reads as, would never end the scanline
+                  if (count == 0 || count > nleft || !stbi__getn(s, plane + i, count)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                }
+               i += count;
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         stbi__hdr_convert_planes(hdr_data + j*width*req_comp, scanline, width, req_comp);
       }
       if (scanline)
          STBI_FREE(scanline);
@@ -7407,9 +10178,9 @@ static int stbi__pic_info(stbi__context *s, int *x, int *y, int *comp)
 // PGM: http://netpbm.sourceforge.net/doc/pgm.html
 // PPM: http://netpbm.sourceforge.net/doc/ppm.html
 //
-// Known limitations:
-//    Does not support comments in the header section
-//    Does not support ASCII image data (formats P2 and P3)
+// Binary (P5 and P6) samples are copied as they are, then 16-bit ones are
+// byte-swapped to native order. ASCII (P2 and P3) samples are parsed 16
+// bytes at a time. Samples are not rescaled to the max value.
 
 #ifndef STBI_NO_PNM
 
@@ -7418,19 +10189,180 @@ static int      stbi__pnm_test(stbi__context *s)
    char p, t;
    p = (char) stbi__get8(s);
    t = (char) stbi__get8(s);
-   if (p != 'P' || (t != '5' && t != '6')) {
+   if (p != 'P' || (t != '2' && t != '3' && t != '5' && t != '6')) {
        stbi__rewind( s );
        return 0;
    }
    return 1;
 }
 
+// n big-endian 16-bit samples from src to native order in out, in place if
+// out == src
+static void stbi__pnm_swap16(stbi__uint16 *out, stbi_uc const *src, int n)
+{
+   int i = 0;
+#ifdef STBI_SSE2
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      for (; i + 8 <= n; i += 8) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (src + 2*i));
+         _mm_storeu_si128((__m128i *) (out + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+      }
+   }
+#elif defined(STBI_NEON)
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      for (; i + 8 <= n; i += 8)
+         vst1q_u8((stbi_uc *) (out + i), vrev16q_u8(vld1q_u8(src + 2*i)));
+   }
+#endif
+   for (; i < n; ++i)
+      out[i] = (stbi__uint16) ((src[2*i] << 8) | src[2*i+1]);
+}
+
+// parser state for ASCII samples, which are decimal numbers separated by
+// whitespace, with # comments to the end of the line
+typedef struct
+{
+   stbi_uc *out8;
+   stbi__uint16 *out16;
+   int count, n;          // samples stored, wanted
+   int maxv;
+   int value, digits;     // number being read, which can go on in the next chunk
+   int comment;           // in a comment
+} stbi__pnm_ascii;
+
+#ifdef STBI_SSE2
+stbi_inline static int stbi__pnm_low_bit(unsigned int z)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return __builtin_ctz(z);
+#elif defined(_MSC_VER)
+   unsigned long n;
+   _BitScanForward(&n, z);
+   return (int) n;
+#else
+   int n = 0;
+   while (!(z & 1)) { z >>= 1; ++n; }
+   return n;
+#endif
+}
+#endif
+
+static void stbi__pnm_ascii_store(stbi__pnm_ascii *a)
+{
+   int v = a->value < a->maxv ? a->value : a->maxv;
+   if (a->out16) a->out16[a->count++] = (stbi__uint16) v;
+   else          a->out8[a->count++] = (stbi_uc) v;
+   a->value = a->digits = 0;
+}
+
+stbi_inline static void stbi__pnm_ascii_digit(stbi__pnm_ascii *a, int c)
+{
+   if (a->value <= 65535) a->value = a->value*10 + (c - '0'); // doesn't overflow
+   a->digits = 1;
+}
+
+static void stbi__pnm_ascii_byte(stbi__pnm_ascii *a, int c)
+{
+   if (a->comment) {
+      if (c == '\n' || c == '\r') a->comment = 0;
+   } else if (c >= '0' && c <= '9') {
+      stbi__pnm_ascii_digit(a, c);
+   } else {
+      if (a->digits) stbi__pnm_ascii_store(a);
+      if (c == '#') a->comment = 1;
+   }
+}
+
+// parses the chunk [p, end) until all the samples are stored; returns
+// where it stopped
+static stbi_uc const *stbi__pnm_parse_ascii(stbi__pnm_ascii *a, stbi_uc const *p, stbi_uc const *end)
+{
+#ifdef STBI_SSE2
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9), hash = _mm_set1_epi8('#');
+      // 16 bytes end at most 8 numbers
+      while (end - p >= 16 && a->n - a->count > 8) {
+         __m128i v = _mm_loadu_si128((__m128i const *) p);
+         __m128i d = _mm_sub_epi8(v, zero);
+         // bit i set if byte i is a digit
+         unsigned int m = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d));
+         int i = 0;
+         if (a->comment || _mm_movemask_epi8(_mm_cmpeq_epi8(v, hash))) {
+            for (; i < 16; ++i)
+               stbi__pnm_ascii_byte(a, p[i]);
+         } else {
+            // a run of digits at a time, up to 8 of them converted at once
+            // from the digit values, which are followed by zeros
+            STBI_SIMD_ALIGN(stbi_uc, digit[24]);
+            _mm_store_si128((__m128i *) digit, d);
+            memset(digit + 16, 0, 8);
+            while (i < 16) {
+               unsigned int rest = m >> i;
+               if (rest & 1) {
+                  int len = stbi__pnm_low_bit(~rest);
+                  if (len <= 8 && a->value <= 65535) {
+                     static unsigned long long const pow10[9] = { 1,10,100,1000,10000,100000,1000000,10000000,100000000 };
+                     unsigned long long x;
+                     memcpy(&x, digit + i, 8);
+                     // the digits to the top bytes, zeros in front of them
+                     x <<= 8*(8-len);
+                     x = ((x & 0x0f0f0f0f0f0f0f0fULL) * 2561) >> 8;
+                     x = ((x & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+                     x = ((x & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32;
+                     x += a->value * pow10[len];
+                     a->value = x > 65536 ? 65536 : (int) x; // all too big alike
+                     a->digits = 1;
+                     i += len;
+                  } else {
+                     int end_of_run = i + len;
+                     for (; i < end_of_run; ++i)
+                        stbi__pnm_ascii_digit(a, p[i]);
+                  }
+               } else {
+                  if (a->digits) stbi__pnm_ascii_store(a);
+                  if (rest == 0) break;
+                  i += stbi__pnm_low_bit(rest);
+               }
+            }
+         }
+         p += 16;
+      }
+   }
+#endif
+   for (; p < end && a->count < a->n; ++p)
+      stbi__pnm_ascii_byte(a, *p);
+   return p;
+}
+
+// reads n ASCII samples to out; returns 0 if the file ends first
+static int stbi__pnm_load_ascii(stbi__context *s, void *out, int n, int bits, int maxv)
+{
+   stbi__pnm_ascii a;
+   memset(&a, 0, sizeof(a));
+   if (bits == 16) a.out16 = (stbi__uint16 *) out;
+   else            a.out8 = (stbi_uc *) out;
+   a.n = n;
+   a.maxv = maxv;
+   for (;;) {
+      s->img_buffer = (stbi_uc *) stbi__pnm_parse_ascii(&a, s->img_buffer, s->img_buffer_end);
+      if (a.count == a.n || !s->read_from_callbacks) break;
+      stbi__refill_buffer(s);
+      if (!s->read_from_callbacks) break; // end of file, which refilled a single 0
+   }
+   // the last number can end the file
+   if (a.count < a.n && a.digits && !a.comment) stbi__pnm_ascii_store(&a);
+   return a.count == a.n;
+}
+
+static int      stbi__pnm_header(stbi__context *s, int *x, int *y, int *comp, int *ascii, int *maxv);
+
 static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    stbi_uc *out;
+   int ascii, maxv, n;
    STBI_NOTUSED(ri);
 
-   ri->bits_per_channel = stbi__pnm_info(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n);
+   ri->bits_per_channel = stbi__pnm_header(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n, &ascii, &maxv);
    if (ri->bits_per_channel == 0)
       return 0;
 
@@ -7446,10 +10378,31 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    out = (stbi_uc *) stbi__malloc_mad4(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
-   stbi__getn(s, out, s->img_n * s->img_x * s->img_y * (ri->bits_per_channel / 8));
+   n = s->img_n * s->img_x * s->img_y;
+   if (ascii) {
+      if (!stbi__pnm_load_ascii(s, out, n, ri->bits_per_channel, maxv)) {
+         STBI_FREE(out);
+         return stbi__errpuc("bad PNM", "PNM file truncated");
+      }
+   } else if (ri->bits_per_channel == 16) {
+      // swapped straight from memory, or after reading
+      stbi_uc const *src = out;
+      if (s->img_buffer_end - s->img_buffer >= 2*n) {
+         src = s->img_buffer;
+         s->img_buffer += 2*n;
+      } else {
+         stbi__getn(s, out, 2*n);
+      }
+      stbi__pnm_swap16((stbi__uint16 *) out, src, n);
+   } else {
+      stbi__getn(s, out, n);
+   }
 
    if (req_comp && req_comp != s->img_n) {
-      out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
+      if (ri->bits_per_channel == 16)
+         out = (stbi_uc *) stbi__convert_format16((stbi__uint16 *) out, s->img_n, req_comp, s->img_x, s->img_y);
+      else
+         out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // stbi__convert_format frees input on failure
    }
    return out;
@@ -7491,9 +10444,11 @@ static int      stbi__pnm_getinteger(stbi__context *s, char *c)
    return value;
 }
 
-static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
+// reads the header, leaving s at the first sample; returns the bits per
+// channel, or 0 if it isn't a PNM
+static int      stbi__pnm_header(stbi__context *s, int *x, int *y, int *comp, int *ascii, int *maxv)
 {
-   int maxv, dummy;
+   int dummy;
    char c, p, t;
 
    if (!x) x = &dummy;
@@ -7505,12 +10460,13 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
    // Get identifier
    p = (char) stbi__get8(s);
    t = (char) stbi__get8(s);
-   if (p != 'P' || (t != '5' && t != '6')) {
+   if (p != 'P' || (t != '2' && t != '3' && t != '5' && t != '6')) {
        stbi__rewind(s);
        return 0;
    }
 
-   *comp = (t == '6') ? 3 : 1;  // '5' is 1-component .pgm; '6' is 3-component .ppm
+   *comp = (t == '3' || t == '6') ? 3 : 1;  // '2' and '5' are 1-component .pgm; '3' and '6' are 3-component .ppm
+   *ascii = (t == '2' || t == '3');
 
    c = (char) stbi__get8(s);
    stbi__pnm_skip_whitespace(s, &c);
@@ -7521,21 +10477,43 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
    *y = stbi__pnm_getinteger(s, &c); // read height
    stbi__pnm_skip_whitespace(s, &c);
 
-   maxv = stbi__pnm_getinteger(s, &c);  // read max value
-   if (maxv > 65535)
+   *maxv = stbi__pnm_getinteger(s, &c);  // read max value
+   if (*maxv > 65535)
       return stbi__err("max value > 65535", "PPM image supports only 8-bit and 16-bit images");
-   else if (maxv > 255)
+   else if (*maxv > 255)
       return 16;
    else
       return 8;
 }
 
+static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   int ascii, maxv;
+   return stbi__pnm_header(s, x, y, comp, &ascii, &maxv);
+}
+
 static int stbi__pnm_is16(stbi__context *s)
 {
    if (stbi__pnm_info(s, NULL, NULL, NULL) == 16)
 	   return 1;
    return 0;
 }
+
+STBIDEF stbi_uc const *stbi_pnm_pixels_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *bits_per_channel)
+{
+   stbi__context s;
+   int w, h, n, bits, ascii, maxv;
+   stbi__start_mem(&s,buffer,len);
+   bits = stbi__pnm_header(&s, &w, &h, &n, &ascii, &maxv);
+   if (bits == 0 || ascii) return NULL;
+   if (!stbi__mad4sizes_valid(n, w, h, bits / 8, 0)) return NULL;
+   if (s.img_buffer_end - s.img_buffer < (ptrdiff_t) n * w * h * (bits / 8)) return NULL;
+   if (x) *x = w;
+   if (y) *y = h;
+   if (comp) *comp = n;
+   if (bits_per_channel) *bits_per_channel = bits;
+   return s.img_buffer;
+}
 #endif
 
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)